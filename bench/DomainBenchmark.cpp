@@ -0,0 +1,250 @@
+/*
+ * Micro-benchmark of the Domain, SubIndex and MPIDomain building blocks:
+ * index conversions, element access, setting up (clipping) padded domains,
+ * serialisation and the padding exchange between neighbouring processes.
+ *
+ * Every process runs each kernel on its own domain at the same time, as in
+ * the application, and the slowest process counts. Run it on one host with
+ * several processes to include the MPI exchange, e.g.
+ *
+ *   mpiexec -n 4 release/domain_bench [extent]
+ *
+ * Each process owns a cube of extent^3 voxels (default 128), stacked along i.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <streambuf>
+#include <vector>
+#include <mpi.h>
+#include "MPIDetails.h"
+#include "MPIDomain.h"
+
+// keeps the compiler from discarding the benchmark loops
+static volatile unsigned long long sink;
+
+// hides a value from the optimiser, as domains set up at run time are in the application
+static int Opaque(int v)
+{
+	volatile int x = v;
+	return x;
+}
+
+/*
+ * A stream buffer over a fixed block of memory, so serialisation is measured
+ * without the cost of a growing string.
+ */
+class MemoryBuffer : public std::streambuf
+{
+public:
+	MemoryBuffer(char *begin, size_t size)
+	{
+		setp(begin, begin + size);
+		setg(begin, begin, begin + size);
+	}
+
+	void rewind()
+	{
+		setp(pbase(), epptr());
+		setg(eback(), eback(), egptr());
+	}
+};
+
+/**
+ * @brief Times a kernel on every process and prints the best of 5 runs of the slowest process.
+ * @param items The number of items (voxels, calls) the kernel processes, for the time per item.
+ * @param bytes The bytes the kernel moves, for the bandwidth (0 to leave it out).
+ */
+template <typename F>
+static void Run(const char *name, double items, const char *item, double bytes, F f)
+{
+	f(); // warm up
+
+	const int repeats = 5;
+	double best = 1e30;
+	for (int r = 0; r < repeats; ++r)
+	{
+		MPI_Barrier(MPI_COMM_WORLD);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		sink = f();
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double slowest;
+		MPI_Allreduce(&secs, &slowest, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+		best = std::min(best, slowest);
+	}
+
+	if (MPIDetails::Rank() == 0)
+	{
+		std::cout << std::left << std::setw(48) << name << std::right << std::setw(10) << std::fixed << std::setprecision(3)
+				  << best * 1e9 / items << " ns/" << item;
+		if (bytes > 0)
+			std::cout << std::setw(10) << bytes / best / 1e9 << " GB/s";
+		std::cout << std::endl;
+	}
+}
+
+// SubIndex conversions over a whole domain, in the layout order of S
+template <IndexScheme S>
+static void BenchSubIndex(const Domain &dom, const char *scheme)
+{
+	const size_t num_voxels = (size_t)dom.extent.i * dom.extent.j * dom.extent.k;
+	const int3 lo = dom.origin, hi = dom.origin + dom.extent;
+	std::string name = std::string("SubIndex<") + scheme + ">(dom, array_id)";
+
+	Run(name.c_str(), num_voxels, "voxel", 0, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int v = 0; v < (int)num_voxels; ++v)
+		{
+			SubIndex<S> idx(dom, v);
+			sum += idx.i + idx.j + idx.k;
+		}
+		return sum;
+	});
+
+	name = std::string("SubIndex<") + scheme + ">::arrayId";
+	Run(name.c_str(), num_voxels, "voxel", 0, [&]()
+	{
+		unsigned long long sum = 0;
+		if (S == ZFastest)
+		{
+			for (int i = lo.i; i < hi.i; ++i)
+				for (int j = lo.j; j < hi.j; ++j)
+					for (int k = lo.k; k < hi.k; ++k)
+						sum += SubIndex<S>(i, j, k).arrayId(dom);
+		}
+		else
+		{
+			for (int k = lo.k; k < hi.k; ++k)
+				for (int j = lo.j; j < hi.j; ++j)
+					for (int i = lo.i; i < hi.i; ++i)
+						sum += SubIndex<S>(i, j, k).arrayId(dom);
+		}
+		return sum;
+	});
+}
+
+// padding exchange of a slab with the given cross section (j, k) and thickness (i)
+template <int Padding>
+static void BenchExchange(int cross, int depth)
+{
+	const int rank = MPIDetails::Rank(), size = MPIDetails::CommSize();
+	MPIDomain<unsigned char, Padding, ZFastest>::SetGlobal(int3(0, 0, 0), int3(depth * size, cross, cross));
+	MPIDomain<unsigned char, Padding, ZFastest> dom;
+	dom.setup(int3(depth * rank, 0, 0), int3(depth, cross, cross));
+
+	// bytes sent plus received by an interior process
+	double bytes = size > 1 ? 2.0 * dom.pad_size * (size > 2 ? 2 : 1) : 0;
+	std::stringstream name;
+	name << "exchangePadding<" << Padding << "> " << cross << "x" << cross << " planes";
+
+	const int exchanges = std::max(10, std::min(20000, 100000000 / (dom.pad_size + 1000)));
+	Run(name.str().c_str(), exchanges, "exchange", bytes * exchanges, [&]()
+	{
+		for (int n = 0; n < exchanges; ++n)
+			dom.exchangePadding(MPI_UNSIGNED_CHAR);
+		return (unsigned long long)dom.pad_size;
+	});
+}
+
+int main(int argc, char *argv[])
+{
+	MPI_Init(&argc, &argv);
+	const int n = argc > 1 ? std::atoi(argv[1]) : 128;
+	const int rank = MPIDetails::Rank(), size = MPIDetails::CommSize();
+
+	// each process owns a cube of the slab decomposition, as in the application
+	const int3 global_extent(n * size, n, n);
+	MPIDomain<unsigned char, 1, ZFastest>::SetGlobal(int3(0, 0, 0), global_extent);
+	MPIDomain<unsigned char, 1, ZFastest> dom;
+	dom.setup(int3(Opaque(n * rank), 0, 0), int3(Opaque(n), n, n));
+	for (size_t v = 0; v < dom.padded.extent.size(); ++v)
+		dom.getData()[v] = (unsigned char)(v * 2654435761u >> 24);
+
+	const size_t num_voxels = (size_t)n * n * n;
+	const int3 lo = dom.origin, hi = dom.origin + dom.extent;
+	if (rank == 0)
+		std::cout << "Domain building blocks, " << n << "^3 voxels on each of " << size << " processes (slowest process, best of 5)" << std::endl;
+
+	BenchSubIndex<ZFastest>(dom.padded, "ZFastest");
+	BenchSubIndex<XFastest>(dom.padded, "XFastest");
+
+	Run("MPIDomain::operator[](SubIndex) (checked)", num_voxels, "voxel", 0, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = lo.i; i < hi.i; ++i)
+			for (int j = lo.j; j < hi.j; ++j)
+				for (int k = lo.k; k < hi.k; ++k)
+					sum += dom[SubIndex<ZFastest>(i, j, k)];
+		return sum;
+	});
+
+	Run("MPIDomain::operator() (unchecked)", num_voxels, "voxel", 0, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = lo.i; i < hi.i; ++i)
+			for (int j = lo.j; j < hi.j; ++j)
+				for (int k = lo.k; k < hi.k; ++k)
+					sum += dom(i, j, k);
+		return sum;
+	});
+
+	// setting up the padded extents (clipped at the global domain), the buffer is kept
+	const int calls = 1000000;
+	MPIDomain<unsigned char, 1, ZFastest> other;
+	other.setup(dom.origin, dom.extent);
+	Run("MPIDomain::setup (clipping, buffer reused)", calls, "call", 0, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int c = 0; c < calls; ++c)
+		{
+			other.setup(int3(Opaque(n * rank), 0, 0), int3(n, n, n));
+			sum += other.padded.extent.i;
+		}
+		return sum;
+	});
+
+	// serialisation to and from memory
+	const size_t stream_bytes = dom.padded.extent.size() + 1024;
+	std::vector<char> stream_memory(stream_bytes);
+	MemoryBuffer buffer(stream_memory.data(), stream_bytes);
+	std::ostream out(&buffer);
+	std::istream in(&buffer);
+	const double domain_bytes = dom.padded.extent.size() * sizeof(unsigned char);
+	Run("MPIDomain::serialize", dom.padded.extent.size(), "voxel", domain_bytes, [&]()
+	{
+		buffer.rewind();
+		dom.serialize(out);
+		return (unsigned long long)out.tellp();
+	});
+	Run("MPIDomain::deserialize", dom.padded.extent.size(), "voxel", domain_bytes, [&]()
+	{
+		buffer.rewind();
+		other.deserialize(in);
+		return (unsigned long long)other.padded.extent.i;
+	});
+
+	// latency (small planes) to bandwidth (large planes) of the padding exchange
+	if (size > 1)
+	{
+		const int crosses[] = {4, 32, 128, 512};
+		for (int c = 0; c < 4; ++c)
+		{
+			BenchExchange<1>(crosses[c], 16);
+			BenchExchange<4>(crosses[c], 16);
+		}
+	}
+	else if (rank == 0)
+	{
+		std::cout << "(run on more than one process to include exchangePadding)" << std::endl;
+	}
+
+	MPI_Finalize();
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Micro-benchmark of the per-voxel cost of index calculations.
+ *
+ * The "legacy" classes reproduce the original int3/SubIndex (virtual
+ * size(), operator==, valid() and destructor) so that the cost before
+ * and after the switch to Strides can be compared on the same machine.
+ *
+ * Usage: index_bench [extent]   (a cube of extent^3 voxels, default 256)
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include "Domain.h"
+
+namespace legacy
+{
+struct int3
+{
+	int i, j, k;
+	int3(int i, int j, int k)
+		: i(i), j(j), k(k)
+	{
+	}
+
+	virtual ~int3()
+	{
+	}
+
+	virtual unsigned int size() const
+	{
+		return i * j * k;
+	}
+};
+
+struct Domain
+{
+	::int3 origin;
+	::int3 extent;
+};
+
+class SubIndex : public int3
+{
+public:
+	virtual ~SubIndex()
+	{
+	}
+
+	SubIndex(int i, int j, int k)
+		: int3(i, j, k)
+	{
+	}
+
+	SubIndex(const Domain &dom, int array_id)
+		: int3(0, 0, 0)
+	{
+		k = array_id % dom.extent.k + dom.origin.k;
+		j = (array_id / dom.extent.k) % dom.extent.j + dom.origin.j;
+		i = ((array_id / dom.extent.k) / (dom.extent.j)) % dom.extent.i + dom.origin.i;
+	}
+
+	int arrayId(const Domain &dom)
+	{
+		int idx = (k - dom.origin.k) + (j - dom.origin.j) * (dom.extent.k) + (i - dom.origin.i) * (dom.extent.k * dom.extent.j);
+		if (!valid(dom))
+			throw std::runtime_error("Domain index out of bounds.");
+		return idx;
+	}
+
+	virtual bool valid(const Domain &dom)
+	{
+		return !(i < dom.origin.i || i >= (dom.origin.i + dom.extent.i) || j < dom.origin.j || j >= (dom.origin.j + dom.extent.j) || k < dom.origin.k || k >= (dom.origin.k + dom.extent.k));
+	}
+};
+} // namespace legacy
+
+// keeps the compiler from discarding the benchmark loops
+static volatile unsigned long long sink;
+
+// hides a value from the optimiser, as domains set up at run time are in the application
+static int3 Opaque(const int3 &v)
+{
+	volatile int i = v.i, j = v.j, k = v.k;
+	return int3(i, j, k);
+}
+
+template <typename F>
+static void Run(const char *name, size_t num_voxels, F f)
+{
+	f(); // warm up
+
+	const int repeats = 5;
+	double best = 1e30;
+	for (int r = 0; r < repeats; ++r)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		sink = f();
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = std::min(best, secs);
+	}
+	std::cout << std::left << std::setw(44) << name << std::right << std::setw(10) << std::fixed << std::setprecision(3) << best * 1e9 / num_voxels << " ns/voxel" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	int n = argc > 1 ? std::atoi(argv[1]) : 256;
+
+	// as in MPIDomain: loops run over the owned voxels, indices are checked against the padded region
+	const int3 origin(3, 0, 0), extent(n, n, n);
+	::Domain dom;
+	dom.setup(Opaque(int3(origin.i - 1, origin.j, origin.k)), Opaque(int3(extent.i + 2, extent.j, extent.k)));
+	legacy::Domain legacy_dom = {dom.origin, dom.extent};
+	const Strides<ZFastest> strides(dom);
+
+	const size_t num_voxels = (size_t)n * n * n;
+	std::vector<unsigned char> data(dom.extent.size());
+	for (size_t v = 0; v < data.size(); ++v)
+		data[v] = (unsigned char)(v * 2654435761u >> 24);
+
+	std::cout << "Index calculations over " << n << "^3 voxels (ZFastest, best of 5)" << std::endl;
+
+	Run("legacy SubIndex::arrayId (virtual valid)", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = origin.i; i < origin.i + extent.i; ++i)
+			for (int j = origin.j; j < origin.j + extent.j; ++j)
+				for (int k = origin.k; k < origin.k + extent.k; ++k)
+					sum += data[legacy::SubIndex(i, j, k).arrayId(legacy_dom)];
+		return sum;
+	});
+
+	Run("SubIndex::arrayId (checked)", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = origin.i; i < origin.i + extent.i; ++i)
+			for (int j = origin.j; j < origin.j + extent.j; ++j)
+				for (int k = origin.k; k < origin.k + extent.k; ++k)
+					sum += data[SubIndex<ZFastest>(i, j, k).arrayId(dom)];
+		return sum;
+	});
+
+	Run("Strides::checkedOffset", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = origin.i; i < origin.i + extent.i; ++i)
+			for (int j = origin.j; j < origin.j + extent.j; ++j)
+				for (int k = origin.k; k < origin.k + extent.k; ++k)
+					sum += data[strides.checkedOffset(i, j, k)];
+		return sum;
+	});
+
+	Run("Strides::offset (unchecked)", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = origin.i; i < origin.i + extent.i; ++i)
+			for (int j = origin.j; j < origin.j + extent.j; ++j)
+				for (int k = origin.k; k < origin.k + extent.k; ++k)
+					sum += data[strides.offset(i, j, k)];
+		return sum;
+	});
+
+	Run("Strides::offset per row, strided walk", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int i = origin.i; i < origin.i + extent.i; ++i)
+			for (int j = origin.j; j < origin.j + extent.j; ++j)
+			{
+				const unsigned char *row = &data[strides.offset(i, j, origin.k)];
+				for (int k = 0; k < extent.k; ++k)
+					sum += row[k * strides.sk];
+			}
+		return sum;
+	});
+
+	Run("legacy SubIndex(dom, array_id)", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (int v = 0; v < (int)num_voxels; ++v)
+		{
+			legacy::SubIndex idx(legacy_dom, v);
+			sum += idx.i + idx.j + idx.k;
+		}
+		return sum;
+	});
+
+	Run("Strides::subscript", num_voxels, [&]()
+	{
+		unsigned long long sum = 0;
+		for (long long v = 0; v < (long long)num_voxels; ++v)
+		{
+			int3 idx = strides.subscript(v);
+			sum += idx.i + idx.j + idx.k;
+		}
+		return sum;
+	});
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+#ifndef BRICKCACHE_H_
+#define BRICKCACHE_H_
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "Domain.h"
+#include "LabelPacking.h"
+
+/*
+ * Least recently used cache of the decoded bricks of a domain (see
+ * GridBrick), up to a capacity in bytes. Bricks are kept bit-packed
+ * (see PackedLabels), so with 2 bit labels four times as many 8 bit
+ * voxels fit as unpacked. It is shared by several
+ * threads: bricks are handed out as shared pointers, so a brick which
+ * is evicted while a thread still copies from it stays alive until the
+ * thread lets go of it. A missing brick is decoded outside the lock, so
+ * threads missing different bricks decode them at the same time; two
+ * threads missing the same brick both decode it and the first to finish
+ * keeps it.
+ */
+template <typename T>
+class BrickCache
+{
+public:
+	typedef std::shared_ptr<const PackedLabels<T> > BrickPtr;
+
+	struct Stats
+	{
+		unsigned long long hits, misses, evictions;
+		size_t bricks, bytes;
+	};
+
+	BrickCache(const Domain &dom, int brick_size, int bits, size_t capacity);
+	virtual ~BrickCache();
+
+	template <typename F>
+	BrickPtr get(int brick, F decode, bool &hit);
+
+	Stats stats() const;
+
+private:
+	typedef std::list<int> Order;
+	struct Entry
+	{
+		BrickPtr voxels;
+		Order::iterator position; // in the order of use, the most recent first
+	};
+
+	Domain dom;
+	int brick_size;
+	int bits;
+	size_t capacity;
+
+	mutable std::mutex mutex;
+	Order order;
+	std::unordered_map<int, Entry> entries;
+	Stats counts;
+};
+
+/**
+ * @param dom The domain split into bricks.
+ * @param brick_size The edge length of a brick in voxels.
+ * @param bits The bits each voxel is packed into (see PackedLabels).
+ * @param capacity The bytes of packed voxels kept, at least one brick.
+ */
+template <typename T>
+BrickCache<T>::BrickCache(const Domain &dom, int brick_size, int bits, size_t capacity)
+	: dom(dom), brick_size(brick_size), bits(bits), capacity(capacity)
+{
+	counts.hits = counts.misses = counts.evictions = 0;
+	counts.bricks = counts.bytes = 0;
+}
+
+template <typename T>
+BrickCache<T>::~BrickCache()
+{
+}
+
+/**
+ * @brief Returns a brick's packed voxels (k fastest), decoding it if it is not cached.
+ * @param brick The index of the brick, see GridBrick.
+ * @param decode Called as decode(box, voxels) to fill the voxels of a missing brick's box.
+ * @param hit Set to whether the brick was cached.
+ * @throws std::runtime_error if the voxels of a missing brick do not fit in the bits.
+ */
+template <typename T>
+template <typename F>
+typename BrickCache<T>::BrickPtr BrickCache<T>::get(int brick, F decode, bool &hit)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		typename std::unordered_map<int, Entry>::iterator found = entries.find(brick);
+		if (found != entries.end())
+		{
+			order.splice(order.begin(), order, found->second.position);
+			++counts.hits;
+			hit = true;
+			return found->second.voxels;
+		}
+		++counts.misses;
+	}
+	hit = false;
+
+	Domain box = GridBrick(dom, brick_size, brick);
+	std::vector<T> decoded((size_t)box.extent.i * box.extent.j * box.extent.k);
+	decode(box, decoded.data());
+	BrickPtr voxels(new PackedLabels<T>(decoded.data(), decoded.size(), bits));
+
+	std::lock_guard<std::mutex> lock(mutex);
+	typename std::unordered_map<int, Entry>::iterator found = entries.find(brick);
+	if (found != entries.end())
+		return found->second.voxels;
+
+	order.push_front(brick);
+	Entry entry = {voxels, order.begin()};
+	entries[brick] = entry;
+	counts.bricks++;
+	counts.bytes += voxels->bytes();
+
+	// the least recently used bricks go, but never the one just decoded
+	while (counts.bytes > capacity && order.size() > 1)
+	{
+		typename std::unordered_map<int, Entry>::iterator last = entries.find(order.back());
+		counts.bytes -= last->second.voxels->bytes();
+		counts.bricks--;
+		counts.evictions++;
+		entries.erase(last);
+		order.pop_back();
+	}
+	return voxels;
+}
+
+/**
+ * @brief The hits, misses and evictions so far and what is cached now.
+ */
+template <typename T>
+typename BrickCache<T>::Stats BrickCache<T>::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return counts;
+}
+
+#endif /* BRICKCACHE_H_ */
@@ -0,0 +1,258 @@
+#include "CompressedInput.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+/**
+ * @brief Identifies the compression of a file from its magic bytes.
+ * @param fname The path to the file.
+ * @return The compression format, Uncompressed if it is not recognised.
+ */
+Compression DetectCompression(const string &fname)
+{
+	unsigned char magic[4] = {0, 0, 0, 0};
+	ifstream fin(fname.c_str(), ios::binary);
+	fin.read((char *)magic, 4);
+
+	if (fin.gcount() >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return Gzip;
+	if (fin.gcount() == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return Zstd;
+
+	return Uncompressed;
+}
+
+DecompressionStream::~DecompressionStream()
+{
+}
+
+size_t DecompressionStream::skip(size_t len)
+{
+	char buf[65536];
+	size_t skipped = 0;
+	while (skipped < len)
+	{
+		size_t n = read(buf, min(sizeof(buf), len - skipped));
+		if (n == 0)
+			break;
+		skipped += n;
+	}
+	return skipped;
+}
+
+/*
+ * gzip (and zlib) streams, including files with several members
+ */
+class GzipStream : public DecompressionStream
+{
+public:
+	GzipStream(const string &fname)
+	{
+		file = gzopen(fname.c_str(), "rb");
+		if (file == NULL)
+			throw runtime_error("Cannot open gzip file " + fname);
+		gzbuffer(file, 1 << 20);
+	}
+
+	virtual ~GzipStream()
+	{
+		gzclose(file);
+	}
+
+	virtual size_t read(char *buf, size_t len)
+	{
+		size_t total = 0;
+		while (total < len)
+		{
+			// gzread is limited to an unsigned int length
+			unsigned int chunk = (unsigned int)min(len - total, (size_t)(1u << 30));
+			int n = gzread(file, buf + total, chunk);
+			if (n < 0)
+			{
+				int err;
+				throw runtime_error(string("Error decompressing gzip file: ") + gzerror(file, &err));
+			}
+			if (n == 0)
+				break;
+			total += n;
+		}
+		return total;
+	}
+
+private:
+	gzFile file;
+};
+
+#ifdef USE_ZSTD
+/*
+ * zstd streams of any number of frames
+ */
+class ZstdStream : public DecompressionStream
+{
+public:
+	ZstdStream(const string &fname)
+		: fin(fname.c_str(), ios::binary), in_buf(ZSTD_DStreamInSize())
+	{
+		if (!fin.is_open())
+			throw runtime_error("Cannot open zstd file " + fname);
+
+		dstream = ZSTD_createDStream();
+		ZSTD_initDStream(dstream);
+		input.src = in_buf.data();
+		input.size = 0;
+		input.pos = 0;
+	}
+
+	virtual ~ZstdStream()
+	{
+		ZSTD_freeDStream(dstream);
+	}
+
+	virtual size_t read(char *buf, size_t len)
+	{
+		ZSTD_outBuffer output = {buf, len, 0};
+		while (output.pos < output.size)
+		{
+			if (input.pos == input.size)
+			{
+				fin.read(in_buf.data(), in_buf.size());
+				input.size = fin.gcount();
+				input.pos = 0;
+				if (input.size == 0)
+					break;
+			}
+
+			size_t ret = ZSTD_decompressStream(dstream, &output, &input);
+			if (ZSTD_isError(ret))
+				throw runtime_error(string("Error decompressing zstd file: ") + ZSTD_getErrorName(ret));
+		}
+		return output.pos;
+	}
+
+private:
+	ifstream fin;
+	vector<char> in_buf;
+	ZSTD_DStream *dstream;
+	ZSTD_inBuffer input;
+};
+#endif
+
+/**
+ * @brief Opens a compressed file for sequential decompression.
+ * @param fname The path to the compressed file.
+ * @throws std::runtime_error if the format is not supported by this build.
+ */
+unique_ptr<DecompressionStream> OpenDecompressionStream(const string &fname)
+{
+	switch (DetectCompression(fname))
+	{
+	case Gzip:
+		return unique_ptr<DecompressionStream>(new GzipStream(fname));
+	case Zstd:
+#ifdef USE_ZSTD
+		return unique_ptr<DecompressionStream>(new ZstdStream(fname));
+#else
+		throw runtime_error("zstd input requires a build with USE_ZSTD=1: " + fname);
+#endif
+	default:
+		throw runtime_error("File is not compressed with a supported format: " + fname);
+	}
+}
+
+static unsigned int ReadLE32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/**
+ * @brief Reads the seek table at the end of a seekable zstd file.
+ * @param fname The path to the zstd file.
+ * @param frames Filled with the compressed and decompressed location of every frame.
+ * @return false if the file does not end with a seek table.
+ */
+bool ReadZstdSeekTable(const string &fname, vector<ZstdFrame> &frames)
+{
+	const unsigned int seekable_magic = 0x8F92EAB1;
+	const unsigned int footer_size = 9;
+	const unsigned int skippable_header_size = 8;
+
+	ifstream fin(fname.c_str(), ios::binary);
+	fin.seekg(0, ios::end);
+	unsigned long long file_size = fin.tellg();
+	if (!fin || file_size < footer_size + skippable_header_size)
+		return false;
+
+	// footer: number of frames, descriptor, magic
+	unsigned char footer[footer_size];
+	fin.seekg(file_size - footer_size);
+	fin.read((char *)footer, footer_size);
+	if (!fin || ReadLE32(footer + 5) != seekable_magic)
+		return false;
+
+	unsigned long long num_frames = ReadLE32(footer);
+	unsigned int entry_size = (footer[4] & 0x80) ? 12 : 8;
+	unsigned long long table_size = num_frames * entry_size;
+	if (table_size + footer_size + skippable_header_size > file_size)
+		return false;
+
+	vector<unsigned char> table(table_size);
+	fin.seekg(file_size - footer_size - table_size);
+	fin.read((char *)table.data(), table_size);
+	if (!fin)
+		return false;
+
+	frames.resize(num_frames);
+	unsigned long long compressed_offset = 0, decompressed_offset = 0;
+	for (unsigned long long f = 0; f < num_frames; ++f)
+	{
+		frames[f].compressed_offset = compressed_offset;
+		frames[f].compressed_size = ReadLE32(&table[f * entry_size]);
+		frames[f].decompressed_offset = decompressed_offset;
+		frames[f].decompressed_size = ReadLE32(&table[f * entry_size + 4]);
+		compressed_offset += frames[f].compressed_size;
+		decompressed_offset += frames[f].decompressed_size;
+	}
+
+	// the frames must be followed directly by the seek table's skippable frame
+	return compressed_offset + skippable_header_size + table_size + footer_size == file_size;
+}
+
+/**
+ * @brief Decompresses a single frame of a seekable zstd file.
+ * @details Safe to call concurrently from several threads.
+ * @param fname The path to the zstd file.
+ * @param frame The frame to decompress.
+ * @param dst Destination, at least frame.decompressed_size bytes.
+ * @throws std::runtime_error if the frame cannot be read or does not decompress to the expected size.
+ */
+void DecompressZstdFrame(const string &fname, const ZstdFrame &frame, char *dst)
+{
+#ifdef USE_ZSTD
+	vector<char> src(frame.compressed_size);
+	ifstream fin(fname.c_str(), ios::binary);
+	fin.seekg(frame.compressed_offset);
+	fin.read(src.data(), src.size());
+	if (!fin)
+		throw runtime_error("Cannot read zstd frame from " + fname);
+
+	size_t ret = ZSTD_decompress(dst, frame.decompressed_size, src.data(), src.size());
+	if (ZSTD_isError(ret) || ret != frame.decompressed_size)
+	{
+		stringstream msg;
+		msg << "Error decompressing zstd frame at byte " << frame.compressed_offset << " of " << fname;
+		if (ZSTD_isError(ret))
+			msg << ": " << ZSTD_getErrorName(ret);
+		throw runtime_error(msg.str());
+	}
+#else
+	(void)frame;
+	(void)dst;
+	throw runtime_error("zstd input requires a build with USE_ZSTD=1: " + fname);
+#endif
+}
@@ -0,0 +1,55 @@
+#ifndef COMPRESSEDINPUT_H_
+#define COMPRESSEDINPUT_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+
+/*
+ * Helpers for reading compressed RAW files. Files are recognised by
+ * their magic bytes rather than their extension.
+ *
+ * gzip files (and zstd files without a seek table) can only be read
+ * sequentially through a DecompressionStream. zstd files written in the
+ * seekable format (independent frames followed by a seek table, see
+ * zstd/contrib/seekable_format) can be decompressed frame by frame, so
+ * each process only decompresses the frames covering its own slab.
+ */
+
+enum Compression
+{
+	Uncompressed,
+	Gzip,
+	Zstd
+};
+
+Compression DetectCompression(const std::string &fname);
+
+// sequential decompression of a whole file
+class DecompressionStream
+{
+public:
+	virtual ~DecompressionStream();
+
+	// reads up to len decompressed bytes, returns 0 at the end of the stream
+	virtual size_t read(char *buf, size_t len) = 0;
+
+	// skips len decompressed bytes, returns the number of bytes actually skipped
+	size_t skip(size_t len);
+};
+
+std::unique_ptr<DecompressionStream> OpenDecompressionStream(const std::string &fname);
+
+// one independently decompressible frame of a seekable zstd file
+struct ZstdFrame
+{
+	unsigned long long compressed_offset;
+	unsigned long long compressed_size;
+	unsigned long long decompressed_offset;
+	unsigned long long decompressed_size;
+};
+
+bool ReadZstdSeekTable(const std::string &fname, std::vector<ZstdFrame> &frames);
+void DecompressZstdFrame(const std::string &fname, const ZstdFrame &frame, char *dst);
+
+#endif /* COMPRESSEDINPUT_H_ */
@@ -1,7 +1,8 @@
 #include "Domain.h"
 #include <stdexcept>
+#include <algorithm>
 
-MPI_Datatype MPI_DOMAIN;
+MPI_Datatype MPI_DOMAIN = MPI_DATATYPE_NULL;
 
 using namespace std;
 
@@ -14,6 +15,11 @@ Domain::Domain()
 {
 }
 
+Domain::Domain(int3 orig, int3 ext)
+	: origin(orig), extent(ext)
+{
+}
+
 Domain::~Domain()
 {
 }
@@ -29,12 +35,141 @@ void Domain::setup(int3 orig, int3 ext)
 	extent = ext;
 }
 
+/**
+ * @brief Finds the voxels two domains have in common.
+ * @return The overlap, with a zero extent if the domains do not overlap.
+ */
+Domain Intersection(const Domain &a, const Domain &b)
+{
+	int3 lo(max(a.origin.i, b.origin.i), max(a.origin.j, b.origin.j), max(a.origin.k, b.origin.k));
+	int3 hi(min(a.origin.i + a.extent.i, b.origin.i + b.extent.i), min(a.origin.j + a.extent.j, b.origin.j + b.extent.j), min(a.origin.k + a.extent.k, b.origin.k + b.extent.k));
+
+	if (hi.i <= lo.i || hi.j <= lo.j || hi.k <= lo.k)
+		return Domain(lo, int3());
+	return Domain(lo, hi - lo);
+}
+
+/**
+ * @brief Finds the smallest domain containing both domains.
+ * @details Equal to the union of the domains when they are adjacent slabs.
+ */
+Domain BoundingBox(const Domain &a, const Domain &b)
+{
+	int3 lo(min(a.origin.i, b.origin.i), min(a.origin.j, b.origin.j), min(a.origin.k, b.origin.k));
+	int3 hi(max(a.origin.i + a.extent.i, b.origin.i + b.extent.i), max(a.origin.j + a.extent.j, b.origin.j + b.extent.j), max(a.origin.k + a.extent.k, b.origin.k + b.extent.k));
+
+	return Domain(lo, hi - lo);
+}
+
+/**
+ * @brief Splits a domain into a grid of 3D blocks.
+ * @details Of all grids with num_blocks blocks, the one with the smallest total block surface
+ * (i.e. the most cube-like blocks) is used. Blocks are numbered with k fastest and the voxels
+ * of each direction are spread as evenly as possible.
+ * @param dom The domain to split.
+ * @param block The index of the block to return (e.g. the MPI rank).
+ * @param num_blocks The number of blocks (e.g. the number of MPI processes).
+ */
+Domain BlockDecomposition(const Domain &dom, int block, int num_blocks)
+{
+	return GridBlock(dom, BlockGrid(dom.extent, num_blocks), block);
+}
+
+/**
+ * @brief The grid of blocks BlockDecomposition splits a domain into.
+ * @details Of all grids with num_blocks blocks, the one with the smallest total block surface.
+ * @param e The extent of the domain to split.
+ * @param num_blocks The number of blocks.
+ * @return The number of blocks along each direction.
+ */
+int3 BlockGrid(const int3 &e, int num_blocks)
+{
+	int3 grid(num_blocks, 1, 1);
+	double best_surface = -1;
+	for (int gi = 1; gi <= num_blocks; ++gi)
+	{
+		if (num_blocks % gi != 0)
+			continue;
+		for (int gj = 1; gj <= num_blocks / gi; ++gj)
+		{
+			if ((num_blocks / gi) % gj != 0)
+				continue;
+			int gk = num_blocks / gi / gj;
+			if (gi > e.i || gj > e.j || gk > e.k)
+				continue;
+
+			double bi = (double)e.i / gi, bj = (double)e.j / gj, bk = (double)e.k / gk;
+			double surface = bi * bj + bj * bk + bi * bk;
+			if (best_surface < 0 || surface < best_surface)
+			{
+				best_surface = surface;
+				grid = int3(gi, gj, gk);
+			}
+		}
+	}
+	return grid;
+}
+
+/**
+ * @brief Returns one block of a grid of blocks covering a domain.
+ * @param dom The domain to split.
+ * @param grid The number of blocks along each direction (see BlockGrid).
+ * @param block The index of the block, numbered with k fastest.
+ */
+Domain GridBlock(const Domain &dom, const int3 &grid, int block)
+{
+	const int3 &e = dom.extent;
+	int3 pos(block / (grid.j * grid.k), block / grid.k % grid.j, block % grid.k);
+
+	// spread the remainder over the first blocks of each direction
+	int3 origin(dom.origin.i + pos.i * (e.i / grid.i) + min(pos.i, e.i % grid.i),
+				 dom.origin.j + pos.j * (e.j / grid.j) + min(pos.j, e.j % grid.j),
+				 dom.origin.k + pos.k * (e.k / grid.k) + min(pos.k, e.k % grid.k));
+	int3 extent(e.i / grid.i + (pos.i < e.i % grid.i ? 1 : 0),
+				e.j / grid.j + (pos.j < e.j % grid.j ? 1 : 0),
+				e.k / grid.k + (pos.k < e.k % grid.k ? 1 : 0));
+	return Domain(origin, extent);
+}
+
+/**
+ * @brief The number of bricks of a fixed size along each direction of a domain.
+ * @param e The extent of the domain.
+ * @param brick_size The edge length of a brick in voxels.
+ */
+int3 BrickGrid(const int3 &e, int brick_size)
+{
+	return int3((e.i + brick_size - 1) / brick_size, (e.j + brick_size - 1) / brick_size, (e.k + brick_size - 1) / brick_size);
+}
+
+/**
+ * @brief Returns one brick of a domain split into bricks of a fixed size.
+ * @details Unlike GridBlock the bricks only depend on the domain and the size, not on how many
+ * there are; the last brick of each direction holds what is left.
+ * @param dom The domain to split.
+ * @param brick_size The edge length of a brick in voxels.
+ * @param brick The index of the brick, numbered with k fastest (see BrickGrid).
+ */
+Domain GridBrick(const Domain &dom, int brick_size, int brick)
+{
+	const int3 grid = BrickGrid(dom.extent, brick_size);
+	int3 pos(brick / (grid.j * grid.k), brick / grid.k % grid.j, brick % grid.k);
+	int3 origin = dom.origin + int3(pos.i * brick_size, pos.j * brick_size, pos.k * brick_size);
+	int3 end(min(origin.i + brick_size, dom.origin.i + dom.extent.i),
+			 min(origin.j + brick_size, dom.origin.j + dom.extent.j),
+			 min(origin.k + brick_size, dom.origin.k + dom.extent.k));
+	return Domain(origin, end - origin);
+}
+
 /**
  * @brief Creates and commits a custom MPI_Datatype for the Domain struct.
  * @details This allows Domain objects to be sent and received in MPI calls directly.
+ * Later calls keep the datatype already built.
  */
 void Domain::BuildMPIDataType()
 {
+	if (MPI_DOMAIN != MPI_DATATYPE_NULL)
+		return;
+
 	int block_lengths[50];
 	MPI_Aint displacements[50];
 	MPI_Aint addresses[50], add_start;
@@ -71,7 +206,11 @@ void Domain::BuildMPIDataType()
 	for (int i = 0; i < count; i++)
 		displacements[i] = addresses[i] - add_start;
 
-	MPI_Type_create_struct(count, block_lengths, displacements, typelist, &MPI_DOMAIN);
+	// resize to the size of the class so that arrays of domains can be sent
+	MPI_Datatype fields;
+	MPI_Type_create_struct(count, block_lengths, displacements, typelist, &fields);
+	MPI_Type_create_resized(fields, 0, sizeof(Domain), &MPI_DOMAIN);
+	MPI_Type_free(&fields);
 	MPI_Type_commit(&MPI_DOMAIN);
 }
 
@@ -81,62 +220,13 @@ std::ostream &operator<<(std::ostream &out, const int3 &v)
 	return out << "(" << v.i << "," << v.j << "," << v.k << ")";
 }
 
-/*
- * ZFastest specialisations
- */
 /**
- * @brief Constructs a 3D index from a 1D array index within a given domain.
- * @param dom The domain defining the mapping from 1D to 3D space.
- * @param array_id The 1D array index.
+ * @brief Reports an index outside of a domain (kept out of line so index calculations stay small).
+ * @throws std::runtime_error always.
  */
-template <>
-SubIndex<ZFastest>::SubIndex(const Domain &dom, int array_id)
+void ThrowOutOfBounds(const int3 &idx)
 {
-	k = array_id % dom.extent.k + dom.origin.k;
-	j = (array_id / dom.extent.k) % dom.extent.j + dom.origin.j;
-	i = ((array_id / dom.extent.k) / (dom.extent.j)) % dom.extent.i + dom.origin.i;
-}
-
-/**
- * @brief Converts the 3D index into a 1D array index for a given domain.
- * @param dom The domain defining the mapping from 3D to 1D space.
- * @return The calculated 1D array index.
- * @throws std::runtime_error if the index is outside the domain bounds.
- */
-template <>
-int SubIndex<ZFastest>::arrayId(const Domain &dom)
-{
-	int idx = (k - dom.origin.k) + (j - dom.origin.j) * (dom.extent.k) + (i - dom.origin.i) * (dom.extent.k * dom.extent.j);
-	if (!valid(dom))
-	{
-		std::stringstream msg;
-		msg << "Domain index " << *this << " out of bounds.";
-		throw std::runtime_error(msg.str());
-	}
-	return idx;
-}
-
-/*
- * XFastest specialisations
- * Same logic as ZFastest, but swapping X and Z indices
- */
-template <>
-SubIndex<XFastest>::SubIndex(const Domain &dom, int array_id)
-{
-	i = array_id % dom.extent.i + dom.origin.i;
-	j = (array_id / dom.extent.i) % dom.extent.j + dom.origin.j;
-	k = ((array_id / dom.extent.i) / (dom.extent.j)) % dom.extent.k + dom.origin.k;
-}
-
-template <>
-int SubIndex<XFastest>::arrayId(const Domain &dom)
-{
-	int idx = (i - dom.origin.i) + (j - dom.origin.j) * (dom.extent.i) + (k - dom.origin.k) * (dom.extent.i * dom.extent.j);
-	if (idx > dom.extent.size())
-	{
-		std::stringstream msg;
-		msg << "Domain index " << *this << " out of bounds.";
-		throw std::runtime_error(msg.str());
-	}
-	return idx;
+	std::stringstream msg;
+	msg << "Domain index " << idx << " out of bounds.";
+	throw std::runtime_error(msg.str());
 }
@@ -3,41 +3,39 @@
 
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <mpi.h>
 #include "compiler_opts.h"
 
 struct int3
 {
 	int i, j, k;
-	int3()
-		: i(0), j(0), k(0) {
-		  };
-
-	int3(int i, int j, int k)
-		: i(i), j(j), k(k)
+	constexpr int3()
+		: i(0), j(0), k(0)
 	{
 	}
 
-	virtual ~int3()
+	constexpr int3(int i, int j, int k)
+		: i(i), j(j), k(k)
 	{
 	}
 
-	virtual bool operator==(const int3 &b)
+	constexpr bool operator==(const int3 &b) const
 	{
 		return (i == b.i && j == b.j && k == b.k);
 	}
 
-	virtual unsigned int size() const
+	constexpr unsigned int size() const
 	{
 		return i * j * k;
 	}
 
-	int3 operator+(const int3 &b)
+	constexpr int3 operator+(const int3 &b) const
 	{
 		return int3(i + b.i, j + b.j, k + b.k);
 	}
 
-	int3 operator-(const int3 &b)
+	constexpr int3 operator-(const int3 &b) const
 	{
 		return int3(i - b.i, j - b.j, k - b.k);
 	}
@@ -45,12 +43,15 @@ struct int3
 
 std::ostream &operator<<(std::ostream &out, const int3 &v);
 
+[[noreturn]] void ThrowOutOfBounds(const int3 &idx);
+
 extern MPI_Datatype MPI_DOMAIN;
 
 class Domain
 {
 public:
 	Domain();
+	Domain(int3 origin, int3 extent);
 	virtual ~Domain();
 
 	virtual void setup(int3 origin, int3 extent);
@@ -63,6 +64,21 @@ public:
 
 std::ostream &operator<<(std::ostream &out, const Domain &d);
 
+// The voxels two domains have in common (an empty extent if there are none)
+Domain Intersection(const Domain &a, const Domain &b);
+
+// The smallest domain containing both domains
+Domain BoundingBox(const Domain &a, const Domain &b);
+
+// Splits a domain into num_blocks 3D blocks and returns the one with the given index
+Domain BlockDecomposition(const Domain &dom, int block, int num_blocks);
+int3 BlockGrid(const int3 &extent, int num_blocks);
+Domain GridBlock(const Domain &dom, const int3 &grid, int block);
+
+// Splits a domain into cubic bricks of a fixed size (smaller at the upper ends) and returns one of them
+int3 BrickGrid(const int3 &extent, int brick_size);
+Domain GridBrick(const Domain &dom, int brick_size, int brick);
+
 /*
  * Class for handling the conversion between 3D (subscript) indices
  * and 1D (array) indices.
@@ -75,26 +91,176 @@ enum IndexScheme
 	ZFastest,
 };
 
+/*
+ * Precomputed strides of the array holding a Domain. offset() does not
+ * check its arguments, so inner loops can use it once their bounds have
+ * been checked; checkedOffset() throws for indices outside the domain.
+ * Both are plain multiply-adds (no virtual calls or divisions).
+ */
+template <IndexScheme S>
+struct Strides
+{
+	int3 origin;
+	int3 extent;
+	long long si, sj, sk; // array distance between neighbours along i, j and k
+
+	constexpr Strides()
+		: origin(), extent(), si(0), sj(0), sk(0)
+	{
+	}
+
+	constexpr Strides(const int3 &origin, const int3 &extent)
+		: origin(origin), extent(extent),
+		  si(S == ZFastest ? (long long)extent.k * extent.j : 1),
+		  sj(S == ZFastest ? extent.k : extent.i),
+		  sk(S == ZFastest ? 1 : (long long)extent.i * extent.j)
+	{
+	}
+
+	explicit Strides(const Domain &dom)
+		: Strides(dom.origin, dom.extent)
+	{
+	}
+
+	constexpr bool contains(int i, int j, int k) const
+	{
+		// a single unsigned comparison per direction also catches indices below the origin
+		return (unsigned int)(i - origin.i) < (unsigned int)extent.i && (unsigned int)(j - origin.j) < (unsigned int)extent.j && (unsigned int)(k - origin.k) < (unsigned int)extent.k;
+	}
+
+	constexpr long long offset(int i, int j, int k) const
+	{
+		return (i - origin.i) * si + (j - origin.j) * sj + (k - origin.k) * sk;
+	}
+
+	long long checkedOffset(int i, int j, int k) const
+	{
+		if (!contains(i, j, k))
+			ThrowOutOfBounds(int3(i, j, k));
+		return offset(i, j, k);
+	}
+
+	/**
+	 * @brief How far runs of a box (lying inside this domain) are contiguous in the array.
+	 * @return 0 if only rows along the fastest direction are, 1 if whole planes are (the box
+	 * fills the fastest direction), 2 if the whole box is (it also fills the middle direction).
+	 */
+	int contiguity(const Domain &box) const
+	{
+		bool fills_fastest = S == ZFastest ? box.extent.k == extent.k : box.extent.i == extent.i;
+		if (!fills_fastest)
+			return 0;
+		return box.extent.j == extent.j ? 2 : 1;
+	}
+
+	constexpr int3 subscript(long long array_id) const
+	{
+		// 32 bit divisions are considerably cheaper, and enough for most domains
+		return (unsigned long long)array_id <= 0xffffffffu ? subscriptAs<unsigned int>(array_id) : subscriptAs<unsigned long long>(array_id);
+	}
+
+private:
+	template <typename U>
+	constexpr int3 subscriptAs(U id) const
+	{
+		return S == ZFastest
+				   ? int3(origin.i + (int)(id / (U)si), origin.j + (int)(id / (U)extent.k % (U)extent.j), origin.k + (int)(id % (U)extent.k))
+				   : int3(origin.i + (int)(id % (U)extent.i), origin.j + (int)(id / (U)extent.i % (U)extent.j), origin.k + (int)(id / (U)sk));
+	}
+};
+
+/**
+ * @brief Visits a box as runs of voxels which are consecutive in layout order.
+ * @details Runs are rows along the fastest direction, merged into planes or the whole box
+ * depending on the contiguity (see Strides::contiguity; pass the smallest one when the runs
+ * have to be contiguous in several arrays).
+ * @param f Called as f(start, length) with the first voxel and the number of voxels of each run.
+ */
+template <IndexScheme S, typename F>
+void ForEachSpan(const Domain &box, int contiguity, F f)
+{
+	if (box.extent.i <= 0 || box.extent.j <= 0 || box.extent.k <= 0)
+		return;
+
+	// outer, middle and fastest directions of the layout
+	const int3 &o = box.origin;
+	const int3 &e = box.extent;
+	int outer_extent = S == ZFastest ? e.i : e.k;
+	int middle_extent = e.j;
+	size_t row_length = S == ZFastest ? e.k : e.i;
+
+	if (contiguity >= 2)
+	{
+		f(o, row_length * middle_extent * outer_extent);
+		return;
+	}
+
+	for (int a = 0; a < outer_extent; ++a)
+	{
+		if (contiguity == 1)
+		{
+			f(S == ZFastest ? int3(o.i + a, o.j, o.k) : int3(o.i, o.j, o.k + a), row_length * middle_extent);
+			continue;
+		}
+		for (int b = 0; b < middle_extent; ++b)
+			f(S == ZFastest ? int3(o.i + a, o.j + b, o.k) : int3(o.i, o.j + b, o.k + a), row_length);
+	}
+}
+
+/**
+ * @brief Splits a domain into slabs along its slowest direction in layout order.
+ * @details ZFastest splits along i, XFastest along k. Every slab has the same thickness
+ * except the last, which also takes the remaining planes.
+ * @param dom The domain to split.
+ * @param slab The index of the slab to return (e.g. the MPI rank).
+ * @param num_slabs The number of slabs (e.g. the number of MPI processes).
+ */
+template <IndexScheme S>
+Domain SlabDecomposition(const Domain &dom, int slab, int num_slabs)
+{
+	Domain part = dom;
+	int &origin = S == ZFastest ? part.origin.i : part.origin.k;
+	int &extent = S == ZFastest ? part.extent.i : part.extent.k;
+	int full = extent;
+
+	int block_size = full / num_slabs;
+	origin += slab * block_size;
+	extent = (slab == num_slabs - 1) ? (full - slab * block_size) : block_size;
+	return part;
+}
+
 // the class
 template <IndexScheme S>
 class SubIndex : public int3
 {
 public:
-	virtual ~SubIndex()
+	constexpr SubIndex()
+		: int3()
 	{
 	}
 
-	SubIndex(int i, int j, int k)
+	constexpr SubIndex(int i, int j, int k)
 		: int3(i, j, k)
 	{
 	}
 
-	SubIndex(const Domain &dom, int array_id);
-	int arrayId(const Domain &dom);
+	SubIndex(const Domain &dom, int array_id)
+		: int3(Strides<S>(dom).subscript(array_id))
+	{
+	}
+
+	/**
+	 * @brief Converts the 3D index into a 1D array index for a given domain.
+	 * @throws std::runtime_error if the index is outside the domain bounds.
+	 */
+	int arrayId(const Domain &dom) const
+	{
+		return (int)Strides<S>(dom).checkedOffset(i, j, k);
+	}
 
-	virtual bool valid(const Domain &dom)
+	bool valid(const Domain &dom) const
 	{
-		return !(i < dom.origin.i || i >= (dom.origin.i + dom.extent.i) || j < dom.origin.j || j >= (dom.origin.j + dom.extent.j) || k < dom.origin.k || k >= (dom.origin.k + dom.extent.k));
+		return Strides<S>(dom).contains(i, j, k);
 	}
 };
 
@@ -0,0 +1,262 @@
+#include "LabelPacking.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACK_X86 1
+#endif
+
+// labels narrowed or widened at a time by the 16 bit kernels (a multiple of 8)
+static const size_t CHUNK = 4096;
+
+/**
+ * @brief The bytes holding count labels of the given bits.
+ */
+size_t PackedBytes(size_t count, int bits)
+{
+	return (count * bits + 7) / 8;
+}
+
+static unsigned Pack8Scalar(const unsigned char *src, size_t count, int bits, unsigned char *dst)
+{
+	const int per_byte = 8 / bits;
+	unsigned any = 0;
+	for (size_t b = 0; b < PackedBytes(count, bits); ++b)
+	{
+		unsigned byte = 0;
+		for (int s = 0; s < per_byte && b * per_byte + s < count; ++s)
+		{
+			unsigned label = src[b * per_byte + s];
+			any |= label;
+			byte |= label << (s * bits);
+		}
+		dst[b] = (unsigned char)byte;
+	}
+	return any;
+}
+
+#ifdef PACK_X86
+
+__attribute__((target("avx2"))) static unsigned Pack8AVX2(const unsigned char *src, size_t count, int bits, unsigned char *dst)
+{
+	if (bits == 8)
+		return Pack8Scalar(src, count, bits, dst);
+
+	// vpmaddubsw adds each even byte to the odd byte after it times 4 (or 16), which are the
+	// labels' places within the byte; the 16 bit sums are then narrowed back to bytes. Packing
+	// works per 128 bit lane, so the quarters are put back in order.
+	const __m256i by4 = _mm256_set1_epi16(0x0401);
+	const __m256i by16 = _mm256_set1_epi16(0x1001);
+	const size_t step = bits == 4 ? 32 : 64;
+	__m256i any = _mm256_setzero_si256();
+
+	size_t v = 0;
+	for (; v + step <= count; v += step)
+	{
+		__m256i nibbles;
+		if (bits == 4)
+		{
+			nibbles = _mm256_loadu_si256((const __m256i *)(src + v));
+			any = _mm256_or_si256(any, nibbles);
+		}
+		else
+		{
+			__m256i lo = _mm256_loadu_si256((const __m256i *)(src + v));
+			__m256i hi = _mm256_loadu_si256((const __m256i *)(src + v + 32));
+			any = _mm256_or_si256(any, _mm256_or_si256(lo, hi));
+			nibbles = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_maddubs_epi16(lo, by4), _mm256_maddubs_epi16(hi, by4)), 0xD8);
+		}
+		__m256i bytes = _mm256_maddubs_epi16(nibbles, by16);
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0xD8);
+		_mm_storeu_si128((__m128i *)(dst + v * bits / 8), _mm256_castsi256_si128(packed));
+	}
+
+	unsigned char lanes[32];
+	_mm256_storeu_si256((__m256i *)lanes, any);
+	unsigned result = 0;
+	for (int n = 0; n < 32; ++n)
+		result |= lanes[n];
+	return result | Pack8Scalar(src + v, count - v, bits, dst + v * bits / 8);
+}
+
+#endif
+
+// unpacks whole bytes, 8 / bits labels from each
+static void UnpackBytesScalar(const unsigned char *src, size_t num_bytes, int bits, unsigned char *dst)
+{
+	const int per_byte = 8 / bits;
+	const unsigned mask = (1u << bits) - 1;
+	for (size_t b = 0; b < num_bytes; ++b)
+	{
+		for (int s = 0; s < per_byte; ++s)
+			dst[b * per_byte + s] = (src[b] >> (s * bits)) & mask;
+	}
+}
+
+static void UnpackBytes(const unsigned char *src, size_t num_bytes, int bits, unsigned char *dst)
+{
+	if (bits == 8)
+	{
+		std::memcpy(dst, src, num_bytes);
+		return;
+	}
+	size_t b = 0;
+#ifdef __SSE2__
+	// the fields of each byte are shifted down and masked, then interleaved back into label order
+	// (16 bit shifts move bits between bytes, but only into the bits the mask clears)
+	const __m128i mask = _mm_set1_epi8(bits == 4 ? 0x0F : 0x03);
+	for (; b + 16 <= num_bytes; b += 16)
+	{
+		__m128i packed = _mm_loadu_si128((const __m128i *)(src + b));
+		__m128i *out = (__m128i *)(dst + b * (8 / bits));
+		if (bits == 4)
+		{
+			__m128i lo = _mm_and_si128(packed, mask);
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+			_mm_storeu_si128(out, _mm_unpacklo_epi8(lo, hi));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi8(lo, hi));
+		}
+		else
+		{
+			__m128i f0 = _mm_and_si128(packed, mask);
+			__m128i f1 = _mm_and_si128(_mm_srli_epi16(packed, 2), mask);
+			__m128i f2 = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+			__m128i f3 = _mm_and_si128(_mm_srli_epi16(packed, 6), mask);
+			__m128i lo01 = _mm_unpacklo_epi8(f0, f1), lo23 = _mm_unpacklo_epi8(f2, f3);
+			__m128i hi01 = _mm_unpackhi_epi8(f0, f1), hi23 = _mm_unpackhi_epi8(f2, f3);
+			_mm_storeu_si128(out, _mm_unpacklo_epi16(lo01, lo23));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo01, lo23));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi01, hi23));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi01, hi23));
+		}
+	}
+#endif
+	UnpackBytesScalar(src + b, num_bytes - b, bits, dst + b * (8 / bits));
+}
+
+typedef unsigned (*Pack8Kernel)(const unsigned char *, size_t, int, unsigned char *);
+
+// the fastest kernel this CPU supports, chosen when the program starts
+static Pack8Kernel SelectPack8(const char **name)
+{
+#ifdef PACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		*name = "AVX2";
+		return Pack8AVX2;
+	}
+#endif
+	*name = "scalar";
+	return Pack8Scalar;
+}
+
+static const char *pack8_name;
+static const Pack8Kernel pack8 = SelectPack8(&pack8_name);
+
+/**
+ * @brief Packs count 8 bit labels into bits each.
+ * @return All labels or-ed together, so a label does not fit if any bits above bits are set.
+ */
+unsigned PackLabels(const unsigned char *src, size_t count, int bits, unsigned char *dst)
+{
+	return pack8(src, count, bits, dst);
+}
+
+/**
+ * @brief Packs count 16 bit labels into bits each, narrowing a chunk at a time to bytes first.
+ * @return All labels or-ed together.
+ */
+unsigned PackLabels(const unsigned short *src, size_t count, int bits, unsigned char *dst)
+{
+	unsigned char narrow[CHUNK];
+	unsigned any = 0;
+	for (size_t v = 0; v < count; v += CHUNK)
+	{
+		size_t n = std::min(CHUNK, count - v);
+		unsigned short wide = 0;
+		for (size_t m = 0; m < n; ++m)
+		{
+			wide |= src[v + m];
+			narrow[m] = (unsigned char)src[v + m];
+		}
+		any |= wide;
+		pack8(narrow, n, bits, dst + v * bits / 8);
+	}
+	return any;
+}
+
+/**
+ * @brief Unpacks count labels from label first on into bytes.
+ */
+void UnpackLabels(const unsigned char *src, size_t first, size_t count, int bits, unsigned char *dst)
+{
+	const size_t per_byte = 8 / bits;
+	const unsigned mask = (1u << bits) - 1;
+	size_t v = first, end = first + count;
+
+	// labels before the first whole byte and after the last one are unpacked one at a time
+	for (; v < end && v % per_byte; ++v)
+		*dst++ = (src[v / per_byte] >> (v % per_byte * bits)) & mask;
+	size_t num_bytes = (end - v) / per_byte;
+	UnpackBytes(src + v / per_byte, num_bytes, bits, dst);
+	dst += num_bytes * per_byte;
+	v += num_bytes * per_byte;
+	for (; v < end; ++v)
+		*dst++ = (src[v / per_byte] >> (v % per_byte * bits)) & mask;
+}
+
+/**
+ * @brief Unpacks count labels from label first on into 16 bit labels, a chunk at a time.
+ */
+void UnpackLabels(const unsigned char *src, size_t first, size_t count, int bits, unsigned short *dst)
+{
+	unsigned char narrow[CHUNK];
+	for (size_t v = 0; v < count; v += CHUNK)
+	{
+		size_t n = std::min(CHUNK, count - v);
+		UnpackLabels(src, first + v, n, bits, narrow);
+		for (size_t m = 0; m < n; ++m)
+			dst[v + m] = narrow[m];
+	}
+}
+
+/**
+ * @brief Adds the number of times each label occurs among count packed labels from label first on.
+ * @param counts Indexed by label, with 1 << bits entries.
+ */
+void CountPackedLabels(const unsigned char *src, size_t first, size_t count, int bits, unsigned long long *counts)
+{
+	const size_t per_byte = 8 / bits;
+	const unsigned mask = (1u << bits) - 1;
+	size_t v = first, end = first + count;
+
+	for (; v < end && v % per_byte; ++v)
+		counts[(src[v / per_byte] >> (v % per_byte * bits)) & mask]++;
+
+	// whole bytes are counted by value, then each value adds the labels it holds
+	size_t num_bytes = (end - v) / per_byte;
+	const unsigned char *bytes = src + v / per_byte;
+	std::vector<unsigned long long> histogram(256);
+	for (size_t b = 0; b < num_bytes; ++b)
+		histogram[bytes[b]]++;
+	for (unsigned value = 0; value < 256; ++value)
+	{
+		if (!histogram[value])
+			continue;
+		for (size_t s = 0; s < per_byte; ++s)
+			counts[(value >> (s * bits)) & mask] += histogram[value];
+	}
+	v += num_bytes * per_byte;
+
+	for (; v < end; ++v)
+		counts[(src[v / per_byte] >> (v % per_byte * bits)) & mask]++;
+}
+
+/**
+ * @brief The instruction set of the packing kernel.
+ */
+const char *PackKernelName()
+{
+	return pack8_name;
+}
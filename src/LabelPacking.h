@@ -0,0 +1,160 @@
+#ifndef LABELPACKING_H_
+#define LABELPACKING_H_
+
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+/*
+ * Bit-packed storage of material labels. A segmented scan has only a
+ * handful of labels (see PixelType in compiler_opts.h), so 2 or 4 bits
+ * per voxel hold it where an 8 or 16 bit voxel is stored otherwise.
+ * Label n takes bits [n * bits, (n + 1) * bits) of the packed bytes, the
+ * low bits of a byte first.
+ *
+ * Packing uses AVX2 byte multiply-adds (vpmaddubsw merges neighbouring
+ * labels, twice for 2 bits) when the CPU has them, chosen at run time
+ * like the kernels of LabelRemap; unpacking uses SSE2 shifts and byte
+ * interleaves, which every x86-64 CPU has. Counting the labels works on
+ * the packed bytes: a histogram of the bytes is expanded into the labels
+ * each byte holds, so a byte of 2 bit labels is counted once, not four
+ * times.
+ */
+size_t PackedBytes(size_t count, int bits);
+unsigned PackLabels(const unsigned char *src, size_t count, int bits, unsigned char *dst);
+unsigned PackLabels(const unsigned short *src, size_t count, int bits, unsigned char *dst);
+void UnpackLabels(const unsigned char *src, size_t first, size_t count, int bits, unsigned char *dst);
+void UnpackLabels(const unsigned char *src, size_t first, size_t count, int bits, unsigned short *dst);
+void CountPackedLabels(const unsigned char *src, size_t first, size_t count, int bits, unsigned long long *counts);
+const char *PackKernelName();
+
+/**
+ * @brief Fallback for labels wider than 16 bits (e.g. component ids), which are never packed.
+ * @throws std::runtime_error always.
+ */
+template <typename T>
+unsigned PackLabels(const T *, size_t, int, unsigned char *)
+{
+	throw std::runtime_error("Only 8 and 16 bit labels are packed.");
+}
+
+/**
+ * @brief Fallback for labels wider than 16 bits, see PackLabels.
+ * @throws std::runtime_error always.
+ */
+template <typename T>
+void UnpackLabels(const unsigned char *, size_t, size_t, int, T *)
+{
+	throw std::runtime_error("Only 8 and 16 bit labels are packed.");
+}
+
+/*
+ * An array of labels packed with 2, 4 or 8 bits each, or kept as they are
+ * (bits = 8 * sizeof(T)).
+ */
+template <typename T>
+class PackedLabels
+{
+public:
+	PackedLabels(const T *labels, size_t count, int bits);
+
+	size_t size() const;
+	size_t bytes() const;
+	int bits() const;
+
+	void unpack(size_t first, size_t count, T *dst) const;
+	void count(size_t first, size_t count, std::vector<unsigned long long> &counts) const;
+
+private:
+	std::vector<unsigned char> packed;
+	size_t num_labels;
+	int num_bits;
+};
+
+/**
+ * @brief Packs an array of labels.
+ * @param labels The labels to pack.
+ * @param count The number of labels.
+ * @param bits 2, 4 or 8, or 8 * sizeof(T) to keep the labels as they are.
+ * @throws std::runtime_error if bits is not one of these, or a label does not fit in bits.
+ */
+template <typename T>
+PackedLabels<T>::PackedLabels(const T *labels, size_t count, int bits)
+	: num_labels(count), num_bits(bits)
+{
+	if (bits == 8 * (int)sizeof(T))
+	{
+		packed.resize(count * sizeof(T));
+		std::memcpy(packed.data(), labels, packed.size());
+		return;
+	}
+	if (bits != 2 && bits != 4 && bits != 8)
+		throw std::runtime_error("Labels are packed with 2, 4 or 8 bits.");
+
+	packed.resize(PackedBytes(count, bits));
+	unsigned any = PackLabels(labels, count, bits, packed.data());
+	if (any >> bits)
+		throw std::runtime_error("The labels do not fit in " + std::to_string(bits) + " bits.");
+}
+
+/**
+ * @brief The number of labels.
+ */
+template <typename T>
+size_t PackedLabels<T>::size() const
+{
+	return num_labels;
+}
+
+/**
+ * @brief The bytes the packed labels take.
+ */
+template <typename T>
+size_t PackedLabels<T>::bytes() const
+{
+	return packed.size();
+}
+
+template <typename T>
+int PackedLabels<T>::bits() const
+{
+	return num_bits;
+}
+
+/**
+ * @brief Copies count labels from label first on into dst.
+ */
+template <typename T>
+void PackedLabels<T>::unpack(size_t first, size_t count, T *dst) const
+{
+	if (num_bits == 8 * (int)sizeof(T))
+		std::memcpy(dst, packed.data() + first * sizeof(T), count * sizeof(T));
+	else
+		UnpackLabels(packed.data(), first, count, num_bits, dst);
+}
+
+/**
+ * @brief Adds the number of times each label occurs among count labels from label first on.
+ * @param counts Indexed by label, resized to hold every label of bits (or of T) if smaller.
+ */
+template <typename T>
+void PackedLabels<T>::count(size_t first, size_t count, std::vector<unsigned long long> &counts) const
+{
+	const size_t num_values = (size_t)1 << (num_bits == 8 * (int)sizeof(T) ? 8 * sizeof(T) : num_bits);
+	if (counts.size() < num_values)
+		counts.resize(num_values);
+
+	if (num_bits == 8 * (int)sizeof(T))
+	{
+		const T *labels = (const T *)packed.data() + first;
+		for (size_t n = 0; n < count; ++n)
+			counts[labels[n]]++;
+	}
+	else
+	{
+		CountPackedLabels(packed.data(), first, count, num_bits, counts.data());
+	}
+}
+
+#endif /* LABELPACKING_H_ */
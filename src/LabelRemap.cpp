@@ -0,0 +1,205 @@
+#include "LabelRemap.h"
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include "compiler_opts.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REMAP_X86 1
+#endif
+
+static void Remap8Scalar(const unsigned char *table, const unsigned char *src, unsigned char *dst, size_t n)
+{
+	for (size_t v = 0; v < n; ++v)
+		dst[v] = table[src[v]];
+}
+
+static void Remap16Scalar(const unsigned short *table, const unsigned short *src, unsigned short *dst, size_t n)
+{
+	for (size_t v = 0; v < n; ++v)
+		dst[v] = table[src[v]];
+}
+
+#ifdef REMAP_X86
+
+__attribute__((target("avx2"))) static void Remap8AVX2(const unsigned char *table, const unsigned char *src, unsigned char *dst, size_t n)
+{
+	// the table as 16 sub-tables of 16 entries, one per value of the high nibble (vpshufb
+	// shuffles within 128 bit lanes, so every sub-table is repeated in both)
+	__m256i sub[16];
+	for (int h = 0; h < 16; ++h)
+		sub[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + 16 * h)));
+	const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+	size_t v = 0;
+	for (; v + 32 <= n; v += 32)
+	{
+		__m256i labels = _mm256_loadu_si256((const __m256i *)(src + v));
+		__m256i lo = _mm256_and_si256(labels, low_nibble);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(labels, 4), low_nibble);
+		__m256i result = _mm256_setzero_si256();
+		for (int h = 0; h < 16; ++h)
+		{
+			__m256i select = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)h));
+			result = _mm256_or_si256(result, _mm256_and_si256(select, _mm256_shuffle_epi8(sub[h], lo)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + v), result);
+	}
+	Remap8Scalar(table, src + v, dst + v, n - v);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) static void Remap8VBMI(const unsigned char *table, const unsigned char *src, unsigned char *dst, size_t n)
+{
+	// vpermi2b looks up 7 bits in two registers, so each half of the table takes one
+	const __m512i t0 = _mm512_loadu_si512(table);
+	const __m512i t1 = _mm512_loadu_si512(table + 64);
+	const __m512i t2 = _mm512_loadu_si512(table + 128);
+	const __m512i t3 = _mm512_loadu_si512(table + 192);
+
+	size_t v = 0;
+	for (; v + 64 <= n; v += 64)
+	{
+		__m512i labels = _mm512_loadu_si512(src + v);
+		__m512i lower = _mm512_permutex2var_epi8(t0, labels, t1);
+		__m512i upper = _mm512_permutex2var_epi8(t2, labels, t3);
+		__m512i result = _mm512_mask_blend_epi8(_mm512_movepi8_mask(labels), lower, upper);
+		_mm512_storeu_si512(dst + v, result);
+	}
+	Remap8Scalar(table, src + v, dst + v, n - v);
+}
+
+__attribute__((target("avx2"))) static void Remap16AVX2(const unsigned short *table, const unsigned short *src, unsigned short *dst, size_t n)
+{
+	// 32 bit gathers at 2 byte steps, keeping the low half (the table has a spare last entry)
+	const int *base = (const int *)table;
+	const __m256i low_half = _mm256_set1_epi32(0xFFFF);
+
+	size_t v = 0;
+	for (; v + 16 <= n; v += 16)
+	{
+		__m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + v)));
+		__m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + v + 8)));
+		lo = _mm256_and_si256(_mm256_i32gather_epi32(base, lo, 2), low_half);
+		hi = _mm256_and_si256(_mm256_i32gather_epi32(base, hi, 2), low_half);
+
+		// packing works per 128 bit lane, so put the quarters back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i *)(dst + v), packed);
+	}
+	Remap16Scalar(table, src + v, dst + v, n - v);
+}
+
+#endif
+
+typedef void (*Remap8Kernel)(const unsigned char *, const unsigned char *, unsigned char *, size_t);
+typedef void (*Remap16Kernel)(const unsigned short *, const unsigned short *, unsigned short *, size_t);
+
+// the fastest kernel this CPU supports, chosen when the program starts
+static Remap8Kernel SelectRemap8(const char **name)
+{
+#ifdef REMAP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw"))
+	{
+		*name = "AVX-512 VBMI";
+		return Remap8VBMI;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		*name = "AVX2";
+		return Remap8AVX2;
+	}
+#endif
+	*name = "scalar";
+	return Remap8Scalar;
+}
+
+static Remap16Kernel SelectRemap16(const char **name)
+{
+#ifdef REMAP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		*name = "AVX2";
+		return Remap16AVX2;
+	}
+#endif
+	*name = "scalar";
+	return Remap16Scalar;
+}
+
+static const char *remap8_name;
+static const char *remap16_name;
+static const Remap8Kernel remap8 = SelectRemap8(&remap8_name);
+static const Remap16Kernel remap16 = SelectRemap16(&remap16_name);
+
+/**
+ * @brief Looks up n 8 bit labels in a 256 entry table.
+ */
+void RemapLabels(const unsigned char *table, const unsigned char *src, unsigned char *dst, size_t n)
+{
+	remap8(table, src, dst, n);
+}
+
+/**
+ * @brief Looks up n 16 bit labels in a table of 65537 entries (the last one unused).
+ */
+void RemapLabels(const unsigned short *table, const unsigned short *src, unsigned short *dst, size_t n)
+{
+	remap16(table, src, dst, n);
+}
+
+/**
+ * @brief The instruction set of the kernel used for labels of the given size.
+ */
+const char *RemapKernelName(size_t label_bytes)
+{
+	return label_bytes == 1 ? remap8_name : remap16_name;
+}
+
+/**
+ * @brief Parses label pairs from a file or from the command line.
+ * @details If spec names a file, it holds one pair per line ("from to", # starts a comment),
+ * otherwise spec lists the pairs inline as "from:to,from:to". Labels are numbers or, for
+ * the labels of compiler_opts.h, material names (e.g. "0:Air,1:Pore,2:Rock").
+ * @throws std::runtime_error if a pair cannot be parsed.
+ */
+std::vector<std::pair<long, long> > ParseLabelPairs(const std::string &spec)
+{
+	std::vector<std::string> pairs;
+	struct stat filestatus;
+	if (stat(spec.c_str(), &filestatus) == 0)
+	{
+		std::ifstream fin(spec.c_str());
+		std::string line;
+		while (std::getline(fin, line))
+		{
+			line = line.substr(0, line.find('#'));
+			std::stringstream fields(line);
+			std::string from, to, extra;
+			if (!(fields >> from))
+				continue;
+			if (!(fields >> to) || (fields >> extra))
+				throw std::runtime_error("Cannot parse the label pair '" + line + "' in " + spec + ".");
+			pairs.push_back(from + ":" + to);
+		}
+	}
+	else
+	{
+		std::stringstream items(spec);
+		std::string item;
+		while (std::getline(items, item, ','))
+			pairs.push_back(item);
+	}
+
+	std::vector<std::pair<long, long> > labels;
+	for (size_t n = 0; n < pairs.size(); ++n)
+	{
+		size_t colon = pairs[n].find(':');
+		if (colon == std::string::npos)
+			throw std::runtime_error("Cannot parse the label pair '" + pairs[n] + "', expected from:to.");
+		labels.push_back(std::make_pair((long)ParsePixelType(pairs[n].substr(0, colon)), (long)ParsePixelType(pairs[n].substr(colon + 1))));
+	}
+	return labels;
+}
@@ -0,0 +1,109 @@
+#ifndef LABELREMAP_H_
+#define LABELREMAP_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdexcept>
+
+/*
+ * Lookup table which renumbers the material labels of a scan, e.g. from
+ * the 0-based numbering of one segmentation tool to the labels of
+ * PixelType (see compiler_opts.h). The loader applies it to the voxels
+ * as they are read, while they are still in the cache, so remapping needs
+ * no pass of its own over the domain.
+ *
+ * The table has an entry for every value of the voxel type (256 or
+ * 65536); labels which are not mapped keep their value. The kernels use
+ * the widest vector instructions the CPU supports, chosen at run time:
+ * byte shuffles (AVX-512 VBMI vpermi2b, or AVX2 pshufb over 16
+ * sub-tables) for 8 bit labels and AVX2 gathers for 16 bit labels.
+ */
+void RemapLabels(const unsigned char *table, const unsigned char *src, unsigned char *dst, size_t n);
+void RemapLabels(const unsigned short *table, const unsigned short *src, unsigned short *dst, size_t n);
+const char *RemapKernelName(size_t label_bytes);
+
+std::vector<std::pair<long, long> > ParseLabelPairs(const std::string &spec);
+
+template <typename T>
+class LabelRemap
+{
+public:
+	LabelRemap();
+	LabelRemap(const std::string &spec);
+
+	void set(long from, long to);
+	bool empty() const;
+	const std::vector<T> &lookup() const;
+
+	void apply(const T *src, T *dst, size_t n) const;
+
+private:
+	// one entry per label (plus one, so 16 bit gathers never read past the end), empty when off
+	std::vector<T> table;
+};
+
+template <typename T>
+LabelRemap<T>::LabelRemap()
+{
+	static_assert(sizeof(T) <= 2, "Labels are remapped with a table of every value, so at most 16 bits.");
+}
+
+/**
+ * @brief Builds the table from a file or from inline pairs.
+ * @param spec See ParseLabelPairs.
+ * @throws std::runtime_error if the pairs cannot be parsed or a label does not fit the voxel type.
+ */
+template <typename T>
+LabelRemap<T>::LabelRemap(const std::string &spec)
+{
+	std::vector<std::pair<long, long> > pairs = ParseLabelPairs(spec);
+	for (size_t n = 0; n < pairs.size(); ++n)
+		set(pairs[n].first, pairs[n].second);
+}
+
+/**
+ * @brief Maps one label to another.
+ * @throws std::runtime_error if a label does not fit the voxel type.
+ */
+template <typename T>
+void LabelRemap<T>::set(long from, long to)
+{
+	const long num_labels = 1L << (8 * sizeof(T));
+	if (from < 0 || from >= num_labels || to < 0 || to >= num_labels)
+		throw std::runtime_error("Remapped labels must lie between 0 and " + std::to_string(num_labels - 1) + ".");
+
+	if (table.empty())
+	{
+		table.resize(num_labels + 1);
+		for (long label = 0; label < num_labels; ++label)
+			table[label] = (T)label;
+	}
+	table[from] = (T)to;
+}
+
+/**
+ * @brief Whether no label is mapped (apply() is then not needed).
+ */
+template <typename T>
+bool LabelRemap<T>::empty() const
+{
+	return table.empty();
+}
+
+template <typename T>
+const std::vector<T> &LabelRemap<T>::lookup() const
+{
+	return table;
+}
+
+/**
+ * @brief Remaps n labels from src to dst, which may be the same memory.
+ */
+template <typename T>
+void LabelRemap<T>::apply(const T *src, T *dst, size_t n) const
+{
+	RemapLabels(table.data(), src, dst, n);
+}
+
+#endif /* LABELREMAP_H_ */
@@ -0,0 +1 @@
+#include "MPIComponentLabeler.h"
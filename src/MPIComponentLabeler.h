@@ -0,0 +1,575 @@
+#ifndef MPICOMPONENTLABELER_H_
+#define MPICOMPONENTLABELER_H_
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <stdexcept>
+#include "MPIDomain.h"
+
+/*
+ * Class which labels the 6-connected components of selected
+ * materials across the distributed domain. Voxels of different
+ * materials are never connected. Every voxel gets a global
+ * component id (0 for voxels which are not of a selected material,
+ * components are numbered consecutively from 1).
+ *
+ * Labelling happens in three steps:
+ *  1. union-find inside the local domain of each process,
+ *  2. provisional labels are made global with a prefix sum and the
+ *     first plane of every process is matched against the padding
+ *     received from the lower neighbour,
+ *  3. the label equivalences found on the process boundaries are
+ *     merged up a binary tree of adjacent slabs, which only passes
+ *     on the labels of the first and last plane of each group, and
+ *     the final roots are handed back down the tree. The process
+ *     holding the root of a merged component numbers it and tells
+ *     the other processes the final id.
+ * Only boundary labels and the ids of merged components are
+ * communicated, the volume data never leaves its process.
+ */
+template <typename T, int Padding, IndexScheme S>
+class MPIComponentLabeler : public MPIDomain<unsigned int, Padding, S>
+{
+public:
+	MPIComponentLabeler(MPIDomain<T, Padding, S> &material_data);
+	virtual ~MPIComponentLabeler();
+
+	void label(const std::vector<T> &phases);
+
+	unsigned int numComponents() const;
+	void writeCounts(const std::string &fname);
+
+private:
+	bool selected(T value) const;
+	static unsigned int Find(std::vector<unsigned int> &parent, unsigned int v);
+	static unsigned int Find(std::unordered_map<unsigned int, unsigned int> &parent, unsigned int v);
+	static void Union(std::unordered_map<unsigned int, unsigned int> &parent, unsigned int a, unsigned int b);
+	unsigned int &at(int i, int j, int k);
+	void matchPlane(bool upper, std::vector<unsigned int> &pairs);
+	static std::vector<unsigned int> ReceiveLabels(int source, int tag);
+
+	// a merge of two groups of slabs in the tree of step 3, kept by the lower group
+	struct Merge
+	{
+		int partner; // the first process of the upper group
+		std::unordered_map<unsigned int, unsigned int> equiv;
+		std::vector<unsigned int> lower_roots, upper_roots; // roots on the boundaries before the merge
+	};
+
+	MPIDomain<T, Padding, S> &material;
+	std::vector<T> phases;
+
+	// number of components whose lowest provisional label is on this process
+	// and the global id of the first of them
+	unsigned int num_owned;
+	unsigned int first_owned;
+	unsigned int num_total;
+
+	// voxel count and material of the owned components
+	std::vector<unsigned long long> owned_counts;
+	std::vector<T> owned_phases;
+};
+
+template <typename T, int Padding, IndexScheme S>
+MPIComponentLabeler<T, Padding, S>::MPIComponentLabeler(MPIDomain<T, Padding, S> &material_data)
+	: material(material_data), num_owned(0), first_owned(0), num_total(0)
+{
+	this->setup(material.origin, material.extent);
+}
+
+template <typename T, int Padding, IndexScheme S>
+MPIComponentLabeler<T, Padding, S>::~MPIComponentLabeler()
+{
+}
+
+template <typename T, int Padding, IndexScheme S>
+bool MPIComponentLabeler<T, Padding, S>::selected(T value) const
+{
+	return std::find(phases.begin(), phases.end(), value) != phases.end();
+}
+
+template <typename T, int Padding, IndexScheme S>
+unsigned int &MPIComponentLabeler<T, Padding, S>::at(int i, int j, int k)
+{
+	return (*this)[SubIndex<S>(i, j, k)];
+}
+
+template <typename T, int Padding, IndexScheme S>
+unsigned int MPIComponentLabeler<T, Padding, S>::Find(std::vector<unsigned int> &parent, unsigned int v)
+{
+	while (parent[v] != v)
+	{
+		parent[v] = parent[parent[v]]; // path halving
+		v = parent[v];
+	}
+	return v;
+}
+
+template <typename T, int Padding, IndexScheme S>
+unsigned int MPIComponentLabeler<T, Padding, S>::Find(std::unordered_map<unsigned int, unsigned int> &parent, unsigned int v)
+{
+	std::unordered_map<unsigned int, unsigned int>::iterator it = parent.find(v);
+	if (it == parent.end())
+		return v;
+
+	while (it->second != v)
+	{
+		v = it->second;
+		it = parent.find(v);
+	}
+	return v;
+}
+
+template <typename T, int Padding, IndexScheme S>
+void MPIComponentLabeler<T, Padding, S>::Union(std::unordered_map<unsigned int, unsigned int> &parent, unsigned int a, unsigned int b)
+{
+	if (parent.find(a) == parent.end())
+		parent[a] = a;
+	if (parent.find(b) == parent.end())
+		parent[b] = b;
+
+	a = Find(parent, a);
+	b = Find(parent, b);
+
+	// the lowest label is always the root
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+}
+
+/**
+ * @brief Labels the connected components of the given materials.
+ * @details The padding of the material domain must be up to date. The padding of the
+ * label domain is exchanged on completion so that neighbouring labels are available
+ * to later stages.
+ * @param phases_in The material labels to compute components for.
+ * @throws std::runtime_error if the number of components does not fit into 32 bits.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIComponentLabeler<T, Padding, S>::label(const std::vector<T> &phases_in)
+{
+	phases = phases_in;
+	const Domain &local = *this;
+	const int rank = MPIDetails::Rank();
+	const int comm_size = MPIDetails::CommSize();
+
+	// 1. local union-find; the root of a set is always its lowest array id
+	std::vector<unsigned int> parent(local.extent.size());
+	for (int i = local.origin.i; i < (local.origin.i + local.extent.i); ++i)
+		for (int j = local.origin.j; j < (local.origin.j + local.extent.j); ++j)
+			for (int k = local.origin.k; k < (local.origin.k + local.extent.k); ++k)
+			{
+				unsigned int id = SubIndex<S>(i, j, k).arrayId(local);
+				parent[id] = id;
+
+				T value = material[SubIndex<S>(i, j, k)];
+				if (!selected(value))
+					continue;
+
+				int3 nbrs[3] = {int3(i - 1, j, k), int3(i, j - 1, k), int3(i, j, k - 1)};
+				for (int n = 0; n < 3; ++n)
+				{
+					SubIndex<S> nbr(nbrs[n].i, nbrs[n].j, nbrs[n].k);
+					if (!nbr.valid(local) || material[nbr] != value)
+						continue;
+
+					unsigned int a = Find(parent, id);
+					unsigned int b = Find(parent, nbr.arrayId(local));
+					if (a < b)
+						parent[b] = a;
+					else if (b < a)
+						parent[a] = b;
+				}
+			}
+
+	// assign consecutive provisional labels to the roots (in array order, so a root is
+	// always labelled before the rest of its set)
+	std::vector<unsigned int> root_label(local.extent.size(), 0);
+	unsigned int num_local = 0;
+	std::vector<T> local_phases;
+	for (int i = local.origin.i; i < (local.origin.i + local.extent.i); ++i)
+		for (int j = local.origin.j; j < (local.origin.j + local.extent.j); ++j)
+			for (int k = local.origin.k; k < (local.origin.k + local.extent.k); ++k)
+			{
+				T value = material[SubIndex<S>(i, j, k)];
+				if (!selected(value))
+				{
+					at(i, j, k) = 0;
+					continue;
+				}
+
+				unsigned int id = SubIndex<S>(i, j, k).arrayId(local);
+				unsigned int root = Find(parent, id);
+				if (root == id)
+				{
+					root_label[id] = ++num_local;
+					local_phases.push_back(value);
+				}
+				at(i, j, k) = root_label[root];
+			}
+	std::vector<unsigned int>().swap(parent);
+	std::vector<unsigned int>().swap(root_label);
+
+	// 2. make the provisional labels global
+	unsigned long long local_count = num_local, offset = 0, total = 0;
+	MPI_Exscan(&local_count, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPIDetails::Comm());
+	MPI_Allreduce(&local_count, &total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPIDetails::Comm());
+	if (rank == 0)
+		offset = 0;
+	if (total >= 0xFFFFFFFFull)
+		throw std::runtime_error("Too many connected components for 32 bit component ids.");
+
+	for (int i = local.origin.i; i < (local.origin.i + local.extent.i); ++i)
+		for (int j = local.origin.j; j < (local.origin.j + local.extent.j); ++j)
+			for (int k = local.origin.k; k < (local.origin.k + local.extent.k); ++k)
+			{
+				unsigned int &l = at(i, j, k);
+				if (l != 0)
+					l += (unsigned int)offset;
+			}
+
+	this->exchangePadding(MPI_UNSIGNED);
+
+	// the labels of the first and last plane which continue into the neighbouring domains,
+	// as pairs of the label on the other side and the label on this process
+	std::vector<unsigned int> pairs, upper;
+	if (rank > 0)
+		matchPlane(false, pairs);
+	if (rank < comm_size - 1)
+		matchPlane(true, upper);
+
+	// 3. merge the boundary equivalences up a binary tree of adjacent slabs: in round s
+	// the group of processes [g, g + s) takes over the group [g + s, g + 2s) above it. A
+	// group only keeps the labels of its first and last plane (with the root of their
+	// component within the group), so no message is larger than a plane of labels.
+	const int tag = 30;
+	std::unordered_map<unsigned int, unsigned int> bottom, top;
+	for (size_t p = 0; p < pairs.size(); p += 2)
+		bottom[pairs[p + 1]] = pairs[p + 1];
+	for (size_t p = 0; p < upper.size(); p += 2)
+		top[upper[p + 1]] = upper[p + 1];
+	std::vector<unsigned int>().swap(upper);
+
+	std::vector<Merge> merges;
+	int parent_rank = -1;
+	for (int s = 1; s < comm_size; s *= 2)
+	{
+		if (rank % (2 * s) == s)
+		{
+			// hand the boundary pairs (with the roots on this side) and the last plane to the group below
+			std::vector<unsigned int> msg(1, (unsigned int)(pairs.size() / 2));
+			for (size_t p = 0; p < pairs.size(); p += 2)
+			{
+				msg.push_back(pairs[p]);
+				msg.push_back(bottom[pairs[p + 1]]);
+			}
+			for (std::unordered_map<unsigned int, unsigned int>::iterator it = top.begin(); it != top.end(); ++it)
+			{
+				msg.push_back(it->first);
+				msg.push_back(it->second);
+			}
+			MPI_Send(msg.data(), (int)msg.size(), MPI_UNSIGNED, rank - s, tag, MPIDetails::Comm());
+			parent_rank = rank - s;
+			break;
+		}
+		if (rank + s >= comm_size)
+			continue;
+
+		std::vector<unsigned int> msg = ReceiveLabels(rank + s, tag);
+		Merge merge;
+		merge.partner = rank + s;
+		const size_t num_cut = msg[0];
+		for (size_t p = 0; p < num_cut; ++p)
+		{
+			unsigned int below = msg[1 + 2 * p], root = msg[2 + 2 * p];
+			std::unordered_map<unsigned int, unsigned int>::iterator it = top.find(below);
+			Union(merge.equiv, it == top.end() ? below : it->second, root);
+			merge.upper_roots.push_back(root);
+		}
+
+		std::unordered_map<unsigned int, unsigned int> upper_top;
+		for (size_t p = 1 + 2 * num_cut; p < msg.size(); p += 2)
+		{
+			merge.upper_roots.push_back(msg[p + 1]);
+			upper_top[msg[p]] = Find(merge.equiv, msg[p + 1]);
+		}
+		for (std::unordered_map<unsigned int, unsigned int>::iterator it = bottom.begin(); it != bottom.end(); ++it)
+		{
+			merge.lower_roots.push_back(it->second);
+			it->second = Find(merge.equiv, it->second);
+		}
+		for (std::unordered_map<unsigned int, unsigned int>::iterator it = top.begin(); it != top.end(); ++it)
+			merge.lower_roots.push_back(it->second);
+		top.swap(upper_top);
+
+		std::sort(merge.lower_roots.begin(), merge.lower_roots.end());
+		merge.lower_roots.erase(std::unique(merge.lower_roots.begin(), merge.lower_roots.end()), merge.lower_roots.end());
+		std::sort(merge.upper_roots.begin(), merge.upper_roots.end());
+		merge.upper_roots.erase(std::unique(merge.upper_roots.begin(), merge.upper_roots.end()), merge.upper_roots.end());
+		merges.push_back(merge);
+	}
+
+	// hand the final roots back down the tree
+	std::unordered_map<unsigned int, unsigned int> final_root;
+	if (parent_rank >= 0)
+	{
+		std::vector<unsigned int> msg = ReceiveLabels(parent_rank, tag);
+		for (size_t p = 0; p < msg.size(); p += 2)
+			final_root[msg[p]] = msg[p + 1];
+	}
+	for (size_t n = merges.size(); n-- > 0;)
+	{
+		Merge &merge = merges[n];
+		auto resolve = [&](unsigned int r) {
+			r = Find(merge.equiv, r);
+			std::unordered_map<unsigned int, unsigned int>::iterator it = final_root.find(r);
+			return it == final_root.end() ? r : it->second;
+		};
+
+		std::vector<unsigned int> msg;
+		for (size_t p = 0; p < merge.upper_roots.size(); ++p)
+		{
+			msg.push_back(merge.upper_roots[p]);
+			msg.push_back(resolve(merge.upper_roots[p]));
+		}
+		MPI_Send(msg.data(), (int)msg.size(), MPI_UNSIGNED, merge.partner, tag, MPIDetails::Comm());
+
+		std::unordered_map<unsigned int, unsigned int> lower_final;
+		for (size_t p = 0; p < merge.lower_roots.size(); ++p)
+			lower_final[merge.lower_roots[p]] = resolve(merge.lower_roots[p]);
+		final_root.swap(lower_final);
+	}
+	std::vector<Merge>().swap(merges);
+
+	// number the components rooted on this process consecutively
+	const unsigned int first_label = (unsigned int)offset + 1;
+	std::vector<unsigned int> root(num_local), final_label(num_local, 0);
+	num_owned = 0;
+	for (unsigned int l = 0; l < num_local; ++l)
+	{
+		std::unordered_map<unsigned int, unsigned int>::iterator it = final_root.find(first_label + l);
+		root[l] = it == final_root.end() ? first_label + l : it->second;
+		if (root[l] == first_label + l)
+			final_label[l] = num_owned++;
+	}
+
+	unsigned int owned_offset = 0;
+	MPI_Exscan(&num_owned, &owned_offset, 1, MPI_UNSIGNED, MPI_SUM, MPIDetails::Comm());
+	if (rank == 0)
+		owned_offset = 0;
+	first_owned = owned_offset + 1;
+	MPI_Allreduce(&num_owned, &num_total, 1, MPI_UNSIGNED, MPI_SUM, MPIDetails::Comm());
+
+	owned_phases.assign(num_owned, 0);
+	for (unsigned int l = 0; l < num_local; ++l)
+	{
+		if (root[l] == first_label + l)
+		{
+			final_label[l] += first_owned;
+			owned_phases[final_label[l] - first_owned] = local_phases[l];
+		}
+	}
+
+	// count the voxels of each provisional label
+	std::vector<unsigned long long> label_counts(num_local, 0);
+	for (int i = local.origin.i; i < (local.origin.i + local.extent.i); ++i)
+		for (int j = local.origin.j; j < (local.origin.j + local.extent.j); ++j)
+			for (int k = local.origin.k; k < (local.origin.k + local.extent.k); ++k)
+			{
+				unsigned int l = at(i, j, k);
+				if (l != 0)
+					label_counts[l - first_label]++;
+			}
+
+	owned_counts.assign(num_owned, 0);
+	std::unordered_map<unsigned int, unsigned long long> foreign_counts;
+	for (unsigned int l = 0; l < num_local; ++l)
+	{
+		if (root[l] == first_label + l)
+			owned_counts[final_label[l] - first_owned] += label_counts[l];
+		else
+			foreign_counts[root[l]] += label_counts[l];
+	}
+
+	// send the voxel counts of components rooted elsewhere to the process holding their root,
+	// which answers with the final id of the component
+	unsigned long long first_label_ull = first_label;
+	std::vector<unsigned long long> all_first_labels(comm_size);
+	MPI_Allgather(&first_label_ull, 1, MPI_UNSIGNED_LONG_LONG, all_first_labels.data(), 1, MPI_UNSIGNED_LONG_LONG, MPIDetails::Comm());
+
+	std::vector<std::vector<unsigned long long> > send_bufs(comm_size);
+	for (std::unordered_map<unsigned int, unsigned long long>::iterator it = foreign_counts.begin(); it != foreign_counts.end(); ++it)
+	{
+		int owner = std::upper_bound(all_first_labels.begin(), all_first_labels.end(), (unsigned long long)it->first) - all_first_labels.begin() - 1;
+		send_bufs[owner].push_back(it->first);
+		send_bufs[owner].push_back(it->second);
+	}
+
+	std::vector<int> send_counts(comm_size), recv_counts(comm_size), send_displs(comm_size, 0), recv_displs(comm_size, 0);
+	std::vector<unsigned long long> send_buf;
+	for (int p = 0; p < comm_size; ++p)
+	{
+		send_counts[p] = send_bufs[p].size();
+		send_displs[p] = send_buf.size();
+		send_buf.insert(send_buf.end(), send_bufs[p].begin(), send_bufs[p].end());
+	}
+	MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, MPIDetails::Comm());
+	for (int p = 1; p < comm_size; ++p)
+		recv_displs[p] = recv_displs[p - 1] + recv_counts[p - 1];
+
+	std::vector<unsigned long long> recv_buf(recv_displs[comm_size - 1] + recv_counts[comm_size - 1]);
+	MPI_Alltoallv(send_buf.data(), send_counts.data(), send_displs.data(), MPI_UNSIGNED_LONG_LONG,
+				  recv_buf.data(), recv_counts.data(), recv_displs.data(), MPI_UNSIGNED_LONG_LONG, MPIDetails::Comm());
+
+	std::vector<unsigned int> answers(recv_buf.size() / 2), replies(send_buf.size() / 2);
+	for (size_t p = 0; p < recv_buf.size(); p += 2)
+	{
+		unsigned int id = final_label[recv_buf[p] - first_label];
+		owned_counts[id - first_owned] += recv_buf[p + 1];
+		answers[p / 2] = id;
+	}
+
+	// the answers go back the way the questions came, one id per pair
+	for (int p = 0; p < comm_size; ++p)
+	{
+		send_counts[p] /= 2;
+		send_displs[p] /= 2;
+		recv_counts[p] /= 2;
+		recv_displs[p] /= 2;
+	}
+	MPI_Alltoallv(answers.data(), recv_counts.data(), recv_displs.data(), MPI_UNSIGNED,
+				  replies.data(), send_counts.data(), send_displs.data(), MPI_UNSIGNED, MPIDetails::Comm());
+
+	std::unordered_map<unsigned int, unsigned int> foreign_ids;
+	for (size_t p = 0; p < replies.size(); ++p)
+		foreign_ids[(unsigned int)send_buf[2 * p]] = replies[p];
+	for (unsigned int l = 0; l < num_local; ++l)
+	{
+		if (root[l] != first_label + l)
+			final_label[l] = foreign_ids[root[l]];
+	}
+
+	// relabel
+	for (int i = local.origin.i; i < (local.origin.i + local.extent.i); ++i)
+		for (int j = local.origin.j; j < (local.origin.j + local.extent.j); ++j)
+			for (int k = local.origin.k; k < (local.origin.k + local.extent.k); ++k)
+			{
+				unsigned int &l = at(i, j, k);
+				if (l != 0)
+					l = final_label[l - first_label];
+			}
+
+	this->exchangePadding(MPI_UNSIGNED);
+}
+
+/**
+ * @brief Finds the labels of the first or last plane which continue into the neighbouring domain.
+ * @details The padding of the material and of the label domain must be up to date.
+ * @param upper Match the last plane against the padding above instead of the first plane against the padding below.
+ * @param pairs Receives the (sorted, unique) pairs of the neighbouring label and the label on this process.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIComponentLabeler<T, Padding, S>::matchPlane(bool upper, std::vector<unsigned int> &pairs)
+{
+	const Domain &local = *this;
+	Domain plane = local;
+	int3 nbr;
+	switch (S)
+	{
+	case ZFastest: // Decomposed along 'i'
+		if (upper)
+			plane.origin.i += plane.extent.i - 1;
+		plane.extent.i = 1;
+		nbr = int3(upper ? 1 : -1, 0, 0);
+		break;
+	case XFastest: // Decomposed along 'k'
+		if (upper)
+			plane.origin.k += plane.extent.k - 1;
+		plane.extent.k = 1;
+		nbr = int3(0, 0, upper ? 1 : -1);
+		break;
+	}
+
+	std::vector<std::pair<unsigned int, unsigned int> > unique_pairs;
+	for (int i = plane.origin.i; i < (plane.origin.i + plane.extent.i); ++i)
+		for (int j = plane.origin.j; j < (plane.origin.j + plane.extent.j); ++j)
+			for (int k = plane.origin.k; k < (plane.origin.k + plane.extent.k); ++k)
+			{
+				T value = material[SubIndex<S>(i, j, k)];
+				if (!selected(value) || material[SubIndex<S>(i + nbr.i, j + nbr.j, k + nbr.k)] != value)
+					continue;
+
+				unique_pairs.push_back(std::make_pair(at(i + nbr.i, j + nbr.j, k + nbr.k), at(i, j, k)));
+			}
+	std::sort(unique_pairs.begin(), unique_pairs.end());
+	unique_pairs.erase(std::unique(unique_pairs.begin(), unique_pairs.end()), unique_pairs.end());
+
+	pairs.clear();
+	for (size_t p = 0; p < unique_pairs.size(); ++p)
+	{
+		pairs.push_back(unique_pairs[p].first);
+		pairs.push_back(unique_pairs[p].second);
+	}
+}
+
+/**
+ * @brief Receives a message of labels of unknown length.
+ */
+template <typename T, int Padding, IndexScheme S>
+std::vector<unsigned int> MPIComponentLabeler<T, Padding, S>::ReceiveLabels(int source, int tag)
+{
+	MPI_Status status;
+	int count;
+	MPI_Probe(source, tag, MPIDetails::Comm(), &status);
+	MPI_Get_count(&status, MPI_UNSIGNED, &count);
+
+	std::vector<unsigned int> labels(count);
+	MPI_Recv(labels.data(), count, MPI_UNSIGNED, source, tag, MPIDetails::Comm(), MPI_STATUS_IGNORE);
+	return labels;
+}
+
+/**
+ * @brief Gets the global number of components.
+ */
+template <typename T, int Padding, IndexScheme S>
+unsigned int MPIComponentLabeler<T, Padding, S>::numComponents() const
+{
+	return num_total;
+}
+
+/**
+ * @brief Writes the material and voxel count of every component to a CSV file.
+ * @details Every process writes the rows of the components it owns into its own part
+ * of the file with collective MPI-IO, so no process has to hold the whole table.
+ * @param fname The name of the CSV file.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIComponentLabeler<T, Padding, S>::writeCounts(const std::string &fname)
+{
+	std::stringstream rows;
+	if (MPIDetails::Rank() == 0)
+		rows << "component_id,material,voxels" << std::endl;
+	for (unsigned int c = 0; c < num_owned; ++c)
+		rows << first_owned + c << "," << PixelTypeName((PixelType)owned_phases[c]) << "," << owned_counts[c] << std::endl;
+
+	std::string text = rows.str();
+	long long size = text.size(), file_offset = 0;
+	MPI_Exscan(&size, &file_offset, 1, MPI_LONG_LONG, MPI_SUM, MPIDetails::Comm());
+	if (MPIDetails::Rank() == 0)
+		file_offset = 0;
+
+	MPI_File fh;
+	if (MPI_File_open(MPIDetails::Comm(), fname.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+		throw std::runtime_error("Cannot open " + fname + " for writing.");
+
+	// truncate any previous output
+	MPI_File_set_size(fh, 0);
+	MPI_File_write_at_all(fh, file_offset, text.data(), (int)text.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+	MPI_File_close(&fh);
+}
+
+#endif /* MPICOMPONENTLABELER_H_ */
@@ -1,7 +1,11 @@
 #include "MPIDetails.h"
+#include <stdexcept>
 
 int MPIDetails::mpi_rank = -1;
 int MPIDetails::mpi_comm_size = -1;
+MPI_Comm MPIDetails::comm = MPI_COMM_WORLD;
+MPI_Comm MPIDetails::node_comm = MPI_COMM_NULL;
+int MPIDetails::comm_users = 0;
 bool MPIDetails::init = false;
 
 MPIDetails::MPIDetails()
@@ -14,8 +18,8 @@ MPIDetails::~MPIDetails()
 
 void MPIDetails::Init()
 {
-	MPI_Comm_size(MPI_COMM_WORLD, &mpi_comm_size);
-	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+	MPI_Comm_size(comm, &mpi_comm_size);
+	MPI_Comm_rank(comm, &mpi_rank);
 
 	init = true;
 }
@@ -35,3 +39,61 @@ int MPIDetails::CommSize()
 
 	return mpi_comm_size;
 }
+
+/**
+ * @brief Returns the communicator of the processes which share the work.
+ */
+MPI_Comm MPIDetails::Comm()
+{
+	return comm;
+}
+
+/**
+ * @brief Selects the processes which share the work, e.g. the communicator a simulation
+ * hands over when it uses raw2vtk as a library, until the matching ReleaseComm.
+ * @details Must be called by all processes of the communicator before anything else is set up;
+ * the rank, size and node communicator are then those within it. The communicator, like the
+ * rank, the decomposition (see MPISubIndex) and the datatypes, is process-wide rather than
+ * held by each user, so users at the same time (e.g. two Preprocessors) must share it.
+ * @throws std::runtime_error if another communicator is still in use.
+ */
+void MPIDetails::AcquireComm(MPI_Comm comm_in)
+{
+	if (comm_in != comm && comm_users > 0)
+	{
+		int result;
+		MPI_Comm_compare(comm_in, comm, &result);
+		if (result != MPI_IDENT)
+			throw std::runtime_error("Another communicator is in use in this process; all Preprocessors alive at the same time must share one.");
+	}
+	else if (comm_in != comm)
+	{
+		// the last communicator may have been freed since, so it is not compared
+		if (node_comm != MPI_COMM_NULL)
+			MPI_Comm_free(&node_comm);
+		comm = comm_in;
+		init = false;
+	}
+	comm_users++;
+}
+
+/**
+ * @brief Ends a use of the communicator, after which AcquireComm may select another one.
+ */
+void MPIDetails::ReleaseComm()
+{
+	if (comm_users > 0)
+		comm_users--;
+}
+
+/**
+ * @brief Returns a communicator of the processes on the same node as this one.
+ * @details Created on the first call, which must be made by all processes.
+ */
+MPI_Comm MPIDetails::NodeComm()
+{
+	if (node_comm == MPI_COMM_NULL)
+		MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, Rank(), MPI_INFO_NULL, &node_comm);
+
+	return node_comm;
+}
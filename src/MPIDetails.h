@@ -9,6 +9,15 @@ public:
 	static int Rank();
 	static int CommSize();
 
+	// the processes sharing the work (MPI_COMM_WORLD unless set otherwise); process-wide, so
+	// all users at the same time share one communicator
+	static MPI_Comm Comm();
+	static void AcquireComm(MPI_Comm comm);
+	static void ReleaseComm();
+
+	// processes sharing this process' node (memory)
+	static MPI_Comm NodeComm();
+
 private:
 	MPIDetails();
 	virtual ~MPIDetails();
@@ -17,6 +26,9 @@ private:
 
 	static int mpi_rank;
 	static int mpi_comm_size;
+	static MPI_Comm comm;
+	static MPI_Comm node_comm;
+	static int comm_users;
 
 	static bool init;
 };
@@ -0,0 +1,54 @@
+#include "MPIDistanceTransform.h"
+
+/**
+ * @brief The 1D squared distance transform of a line: d[x] = min over q of f[q] + (x - q)^2.
+ * @details The lower envelope of the parabolas rooted at (q, f[q]) is built in one sweep and
+ * then read off in another, so the transform takes linear time. Voxels whose f is UINT_MAX
+ * (no target found yet) root no parabola, and stay UINT_MAX if the line has none at all.
+ * @param f The squared distances found by the previous passes.
+ * @param n The length of the line.
+ * @param d Set to the squared distances.
+ * @param v Scratch for n parabola roots.
+ * @param z Scratch for n + 1 boundaries between parabolas.
+ */
+void SquaredDistances(const unsigned int *f, int n, unsigned int *d, int *v, double *z)
+{
+	int k = -1;
+	for (int q = 0; q < n; ++q)
+	{
+		if (f[q] == UINT_MAX)
+			continue;
+
+		// drop the parabolas the new one lies below from where they would take over
+		double s = -std::numeric_limits<double>::infinity();
+		while (k >= 0)
+		{
+			s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * (q - v[k]));
+			if (s > z[k])
+				break;
+			--k;
+		}
+		if (k < 0)
+			s = -std::numeric_limits<double>::infinity();
+		++k;
+		v[k] = q;
+		z[k] = s;
+	}
+
+	if (k < 0)
+	{
+		std::fill(d, d + n, UINT_MAX);
+		return;
+	}
+
+	const int last = k;
+	z[last + 1] = std::numeric_limits<double>::infinity();
+	k = 0;
+	for (int x = 0; x < n; ++x)
+	{
+		while (z[k + 1] < x)
+			++k;
+		unsigned long long dist = (unsigned long long)(x - v[k]) * (x - v[k]) + f[v[k]];
+		d[x] = (unsigned int)std::min(dist, (unsigned long long)UINT_MAX - 1);
+	}
+}
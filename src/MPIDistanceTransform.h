@@ -0,0 +1,181 @@
+#ifndef MPIDISTANCETRANSFORM_H_
+#define MPIDISTANCETRANSFORM_H_
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <climits>
+#include <mpi.h>
+#include "MPIDomain.h"
+#include "MPIRedistributor.h"
+#include "Threads.h"
+
+/*
+ * Class which computes the exact Euclidean distance (in voxels) from
+ * every voxel of selected materials to the nearest voxel of a set of
+ * target materials across the distributed domain, e.g. from each Pore
+ * voxel to the nearest Rock. Voxels of other materials get distance 0,
+ * and -1 marks voxels with no target anywhere in the domain.
+ *
+ * The squared distances are separable (Felzenszwalb and Huttenlocher,
+ * "Distance Transforms of Sampled Functions"): a 1D transform along
+ * each axis in turn, each taking the lower envelope of the parabolas
+ * rooted at the previous pass's values. The passes along the rows and
+ * columns of the slabs run on each process; for the decomposed axis the
+ * squared distances are redistributed into pencils which span the whole
+ * domain along it (split along j instead), transformed there and sent
+ * back. The distances are then exchanged into the padding like the
+ * materials, so they can be written with the same pieces.
+ */
+void SquaredDistances(const unsigned int *f, int n, unsigned int *d, int *v, double *z);
+
+template <typename T, int Padding, IndexScheme S>
+class MPIDistanceTransform : public MPIDomain<float, Padding, S>
+{
+public:
+	MPIDistanceTransform(MPIDomain<T, Padding, S> &material_data);
+	virtual ~MPIDistanceTransform();
+
+	void compute(const std::vector<T> &phases, const std::vector<T> &targets);
+
+private:
+	template <typename F>
+	static void TransformLines(unsigned int *data, size_t num_lines, int length, size_t stride, F first);
+
+	MPIDomain<T, Padding, S> &material;
+
+	// squared distances of the owned voxels, and of the pencil along the decomposed axis
+	MPIDomain<unsigned int, 0, S> slab, pencil;
+	std::unique_ptr<MPIRedistributor<S, S> > to_pencils, from_pencils;
+};
+
+/**
+ * @brief Sets up the distance domain and plans the transpose into pencils. Must be called by all processes.
+ */
+template <typename T, int Padding, IndexScheme S>
+MPIDistanceTransform<T, Padding, S>::MPIDistanceTransform(MPIDomain<T, Padding, S> &material_data)
+	: material(material_data)
+{
+	this->setup(material.origin, material.extent);
+	slab.setExtents(material.origin, material.extent, Domain(material.origin, material.extent));
+	slab.allocate();
+
+	// the pencils split j evenly and span i and k
+	const int rank = MPIDetails::Rank(), size = MPIDetails::CommSize();
+	int first = global.origin.j + (int)((long)global.extent.j * rank / size);
+	int last = global.origin.j + (int)((long)global.extent.j * (rank + 1) / size);
+	Domain box(int3(global.origin.i, first, global.origin.k), int3(global.extent.i, last - first, global.extent.k));
+	pencil.setExtents(box.origin, box.extent, box);
+	pencil.allocate();
+
+	to_pencils.reset(new MPIRedistributor<S, S>(Domain(material.origin, material.extent), box));
+	from_pencils.reset(new MPIRedistributor<S, S>(box, Domain(material.origin, material.extent)));
+}
+
+template <typename T, int Padding, IndexScheme S>
+MPIDistanceTransform<T, Padding, S>::~MPIDistanceTransform()
+{
+}
+
+/**
+ * @brief Runs the 1D transform over lines of squared distances (on all threads).
+ * @param data The squared distances, transformed in place.
+ * @param num_lines The number of lines.
+ * @param length The voxels in every line.
+ * @param stride The distance between the voxels of a line.
+ * @param first Maps a line number to the offset of its first voxel.
+ */
+template <typename T, int Padding, IndexScheme S>
+template <typename F>
+void MPIDistanceTransform<T, Padding, S>::TransformLines(unsigned int *data, size_t num_lines, int length, size_t stride, F first)
+{
+	Threads::ParallelFor(num_lines, [&](size_t begin, size_t end)
+	{
+		std::vector<unsigned int> f(length), d(length);
+		std::vector<int> v(length);
+		std::vector<double> z(length + 1);
+		for (size_t line = begin; line < end; ++line)
+		{
+			unsigned int *voxels = data + first(line);
+			for (int n = 0; n < length; ++n)
+				f[n] = voxels[n * stride];
+			SquaredDistances(f.data(), length, d.data(), v.data(), z.data());
+			for (int n = 0; n < length; ++n)
+				voxels[n * stride] = d[n];
+		}
+	});
+}
+
+/**
+ * @brief Computes the distance from every voxel of the given materials to the nearest target.
+ * @details Must be called by all processes.
+ * @param phases The materials to compute distances for (e.g. Pore).
+ * @param targets The materials distances are measured to (e.g. Rock), or empty for every
+ * material not in phases.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIDistanceTransform<T, Padding, S>::compute(const std::vector<T> &phases, const std::vector<T> &targets)
+{
+	// the layout of the slab and the pencil: planes a along the decomposed axis, rows along j, columns c
+	const int planes = S == ZFastest ? this->extent.i : this->extent.k;
+	const int rows = this->extent.j;
+	const int columns = S == ZFastest ? this->extent.k : this->extent.i;
+	const size_t plane_size = (size_t)rows * columns;
+	const int3 &o = this->origin;
+	unsigned int *sq = slab.getData().get();
+
+	// targets are at distance 0, the rest infinitely far until the passes find a target
+	std::vector<unsigned char> target(std::numeric_limits<T>::max() + 1, targets.empty());
+	for (size_t n = 0; n < phases.size(); ++n)
+		target[phases[n]] = false;
+	for (size_t n = 0; n < targets.size(); ++n)
+		target[targets[n]] = true;
+
+	Threads::ParallelFor((size_t)planes * rows, [&](size_t begin, size_t end)
+	{
+		for (size_t r = begin; r < end; ++r)
+		{
+			int a = (int)(r / rows), b = (int)(r % rows);
+			const T *in = S == ZFastest ? &material(o.i + a, o.j + b, o.k) : &material(o.i, o.j + b, o.k + a);
+			unsigned int *out = sq + r * columns;
+			for (int c = 0; c < columns; ++c)
+				out[c] = target[in[c]] ? 0 : UINT_MAX;
+		}
+	});
+
+	// along the columns and rows of every plane
+	TransformLines(sq, (size_t)planes * rows, columns, 1, [&](size_t line) { return line * columns; });
+	TransformLines(sq, (size_t)planes * columns, rows, columns, [&](size_t line) { return (line / columns) * plane_size + line % columns; });
+
+	// along the decomposed axis, in the pencils
+	to_pencils->redistribute(slab, pencil, MPI_UNSIGNED);
+	const size_t pencil_plane = (size_t)pencil.extent.j * columns;
+	const int length = S == ZFastest ? pencil.extent.i : pencil.extent.k;
+	if (pencil_plane > 0)
+		TransformLines(pencil.getData().get(), pencil_plane, length, pencil_plane, [](size_t line) { return line; });
+	from_pencils->redistribute(pencil, slab, MPI_UNSIGNED);
+
+	// distances of the selected materials only
+	std::vector<unsigned char> selected(std::numeric_limits<T>::max() + 1, false);
+	for (size_t n = 0; n < phases.size(); ++n)
+		selected[phases[n]] = true;
+
+	Threads::ParallelFor((size_t)planes * rows, [&](size_t begin, size_t end)
+	{
+		for (size_t r = begin; r < end; ++r)
+		{
+			int a = (int)(r / rows), b = (int)(r % rows);
+			const T *in = S == ZFastest ? &material(o.i + a, o.j + b, o.k) : &material(o.i, o.j + b, o.k + a);
+			float *out = S == ZFastest ? &(*this)(o.i + a, o.j + b, o.k) : &(*this)(o.i, o.j + b, o.k + a);
+			const unsigned int *d = sq + r * columns;
+			for (int c = 0; c < columns; ++c)
+				out[c] = !selected[in[c]] ? 0.0f : d[c] == UINT_MAX ? -1.0f : (float)std::sqrt((double)d[c]);
+		}
+	});
+
+	this->exchangePadding(MPI_FLOAT);
+}
+
+#endif /* MPIDISTANCETRANSFORM_H_ */
@@ -3,15 +3,34 @@
 
 #include <memory>
 #include <fstream>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <climits>
 #include <mpi.h>
 #include <cassert>
 #include "MPIDetails.h"
 #include "Domain.h"
+#include "SlabAllocator.h"
+#include "LabelPacking.h"
+#include "Threads.h"
 
 extern Domain global; // probably a nicer way of doing this which ensures it has been initialised
 
 void HandleMPIErr(int MPI_ERR);
 
+/*
+ * A run of voxels which are consecutive in memory: data[0 .. length)
+ * holds voxel start and the voxels following it in layout order.
+ */
+template <typename T>
+struct Span
+{
+	T *data;
+	size_t length;
+	int3 start;
+};
+
 template <typename T, int Padding, IndexScheme S>
 class MPIDomain : public Domain
 {
@@ -20,31 +39,61 @@ public:
 	virtual ~MPIDomain();
 
 	virtual void setup(int3 origin, int3 extent);
+	void setExtents(int3 origin, int3 extent);
+	void setExtents(int3 origin, int3 extent, const Domain &padded_box);
+	void allocate();
 	static void SetGlobal(int3 origin, int3 extent);
 
 	T &operator[](SubIndex<S> idx);
+	T &at(int i, int j, int k);
+	T &operator()(int i, int j, int k);
 
-	std::unique_ptr<T[]> &getData();
-	const std::unique_ptr<T[]> &getData() const;
-	void take(std::unique_ptr<T[]> &data);
+	template <typename F>
+	void forEachSpan(const Domain &box, F f);
+	template <typename F>
+	void forEachRow(const Domain &box, F f);
+
+	SlabPtr<T> &getData();
+	const SlabPtr<T> &getData() const;
+	void take(SlabPtr<T> &data);
 
 	void exchangePadding(MPI_Datatype exch_type);
 
+	void pack(int bits);
+	void clearPacked();
+	bool isPacked() const;
+	int packedBits() const;
+	const unsigned char *packedPlanes(const Domain &box) const;
+
 	void serialize(std::ostream &fout);
 	void deserialize(std::istream &fin);
 
 	void debugPrint(std::ostream &fout);
 
 	Domain padded;
+	Strides<S> strides; // of the padded domain
 	int pad_size;
 
 protected:
 	T &operator[](int arrayId);
-	std::unique_ptr<T[]> data;
+
+	template <typename F>
+	void visitSpans(const Domain &box, int contiguity, F &f);
+	size_t numPlanes() const;
+
+	SlabPtr<T> data;
+
+	// A bit-packed copy of the labels (see pack()): one plane along the slowest direction after
+	// the other, each starting on a byte boundary
+	std::vector<unsigned char> packed;
+	int packed_bits; // 0 if not packed
+	size_t plane_size; // voxels of a plane
+	size_t plane_bytes; // bytes of a packed plane
 };
 
 template <typename T, int Padding, IndexScheme S>
 MPIDomain<T, Padding, S>::MPIDomain()
+	: packed_bits(0), plane_size(0), plane_bytes(0)
 {
 }
 
@@ -59,6 +108,20 @@ MPIDomain<T, Padding, S>::MPIDomain()
 template <typename T, int Padding, IndexScheme S>
 void MPIDomain<T, Padding, S>::setup(int3 orig, int3 ext)
 {
+	setExtents(orig, ext);
+	allocate();
+}
+
+/**
+ * @brief Sets up the local and padded extents without allocating any storage.
+ * @details Used by domains which receive their buffer from elsewhere (take() or getData()).
+ * @param orig The origin of this process's local (unpadded) domain.
+ * @param ext The extent of this process's local (unpadded) domain.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIDomain<T, Padding, S>::setExtents(int3 orig, int3 ext)
+{
+	clearPacked();
 	origin = orig;
 	extent = ext;
 
@@ -80,14 +143,14 @@ void MPIDomain<T, Padding, S>::setup(int3 orig, int3 ext)
 	}
 
 	// ensure the padding does not go outside of the global domain
-	// *Use 'else if' to make boundary clipping mutually exclusive
+	// (a single process touches both boundaries, so each side is clipped independently)
 	// i-dimension clipping
 	if (padded.origin.i < global.origin.i)
 	{
 		padded.extent.i -= (global.origin.i - padded.origin.i);
 		padded.origin.i = global.origin.i;
 	}
-	else if (padded.origin.i + padded.extent.i > global.origin.i + global.extent.i)
+	if (padded.origin.i + padded.extent.i > global.origin.i + global.extent.i)
 	{
 		padded.extent.i = (global.origin.i + global.extent.i) - padded.origin.i;
 	}
@@ -98,7 +161,7 @@ void MPIDomain<T, Padding, S>::setup(int3 orig, int3 ext)
 		padded.extent.j -= (global.origin.j - padded.origin.j);
 		padded.origin.j = global.origin.j;
 	}
-	else if (padded.origin.j + padded.extent.j > global.origin.j + global.extent.j)
+	if (padded.origin.j + padded.extent.j > global.origin.j + global.extent.j)
 	{
 		padded.extent.j = (global.origin.j + global.extent.j) - padded.origin.j;
 	}
@@ -109,55 +172,213 @@ void MPIDomain<T, Padding, S>::setup(int3 orig, int3 ext)
 		padded.extent.k -= (global.origin.k - padded.origin.k);
 		padded.origin.k = global.origin.k;
 	}
-	else if (padded.origin.k + padded.extent.k > global.origin.k + global.extent.k)
+	if (padded.origin.k + padded.extent.k > global.origin.k + global.extent.k)
 	{
 		padded.extent.k = (global.origin.k + global.extent.k) - padded.origin.k;
 	}
 
-	size_t n = 2;
-	if (MPIDetails::Rank() == 0 || MPIDetails::Rank() == (MPIDetails::CommSize() - 1))
-		n = 1;
+	// number of neighbours (and so of padding layers)
+	size_t n = (MPIDetails::Rank() > 0) + (MPIDetails::Rank() < MPIDetails::CommSize() - 1);
 
 	assert(pad_size * n + extent.size() == padded.extent.size() && "The local extent plus padding does not match the padded extent!");
 
-	// allocate storage
-	data = std::unique_ptr<T[]>(new T[padded.extent.size()]);
+	strides = Strides<S>(padded);
+}
+
+/**
+ * @brief Sets up the local extents with an arbitrary box around them instead of the padding.
+ * @details For domains which are filled by redistribution (see MPIRedistributor) rather than
+ * by exchangePadding, e.g. output pieces which overlap their neighbours in every direction.
+ * @param orig The origin of this process's local (unpadded) domain.
+ * @param ext The extent of this process's local (unpadded) domain.
+ * @param padded_box The region stored, which must contain the local domain.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIDomain<T, Padding, S>::setExtents(int3 orig, int3 ext, const Domain &padded_box)
+{
+	clearPacked();
+	origin = orig;
+	extent = ext;
+	padded = padded_box;
+	pad_size = 0;
+	strides = Strides<S>(padded);
+}
+
+/**
+ * @brief Allocates (zeroed) storage for the padded domain.
+ * @details A buffer which is already large enough is kept as it is, so domains which are
+ * set up again, or which get a buffer handed back, are not reallocated. A view of memory
+ * owned elsewhere (see ViewSlab) is never written into and is replaced.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIDomain<T, Padding, S>::allocate()
+{
+	if (SlabCapacity(data) < padded.extent.size() || data.get_deleter().source == SlabView)
+		data = AllocateSlab<T>(padded.extent.size());
 }
 
 /**
  * @brief Exchanges padding (ghost) cells with neighboring MPI processes.
  * @details Uses non-blocking sends and receives (MPI_Isend/MPI_Irecv) to transfer
- * boundary data required for stencil-based computations.
+ * boundary data required for stencil-based computations. A packed domain (see pack())
+ * sends its packed planes and unpacks the ones received into the voxel buffer, so every
+ * process must be packed with the same bits or not at all.
  * @param exch_type The MPI_Datatype of the elements being exchanged.
  */
 template <typename T, int Padding, IndexScheme S>
 void MPIDomain<T, Padding, S>::exchangePadding(MPI_Datatype exch_type)
 {
 	MPI_Request reqs[4];
-	MPI_Status stats[4];
+
+	// the padding planes at either end of the buffer, and the owned planes next to them
+	char *base = (char *)data.get();
+	size_t elem_size = sizeof(T), total = padded.extent.size();
+	int count_elems = pad_size;
+	const size_t pad_planes = plane_size ? pad_size / plane_size : 0;
+	if (packed_bits)
+	{
+		base = (char *)packed.data();
+		elem_size = 1;
+		total = packed.size();
+		count_elems = (int)(pad_planes * plane_bytes);
+		exch_type = MPI_BYTE;
+	}
 
 	int count = 0;
-	if (MPIDetails::Rank() > 0)
+	const bool below = MPIDetails::Rank() > 0, above = MPIDetails::Rank() < MPIDetails::CommSize() - 1;
+	if (below)
 	{
-		MPI_Irecv(data.get(), pad_size, exch_type, MPIDetails::Rank() - 1, 0, MPI_COMM_WORLD, &reqs[count]);
+		MPI_Irecv(base, count_elems, exch_type, MPIDetails::Rank() - 1, 0, MPIDetails::Comm(), &reqs[count]);
 		count++;
-		MPI_Isend(data.get() + pad_size, pad_size, exch_type, MPIDetails::Rank() - 1, 1, MPI_COMM_WORLD, &reqs[count]);
+		MPI_Isend(base + count_elems * elem_size, count_elems, exch_type, MPIDetails::Rank() - 1, 1, MPIDetails::Comm(), &reqs[count]);
 		count++;
 	}
-	if (MPIDetails::Rank() < MPIDetails::CommSize() - 1)
+	if (above)
 	{
-		MPI_Irecv(&(data.get()[padded.extent.size() - pad_size]), pad_size, exch_type, MPIDetails::Rank() + 1, 1, MPI_COMM_WORLD, &reqs[count]);
+		MPI_Irecv(base + (total - count_elems) * elem_size, count_elems, exch_type, MPIDetails::Rank() + 1, 1, MPIDetails::Comm(), &reqs[count]);
 		count++;
-		MPI_Isend(&(data.get()[padded.extent.size() - 2 * pad_size]), pad_size, exch_type, MPIDetails::Rank() + 1, 0, MPI_COMM_WORLD, &reqs[count]);
+		MPI_Isend(base + (total - 2 * count_elems) * elem_size, count_elems, exch_type, MPIDetails::Rank() + 1, 0, MPIDetails::Comm(), &reqs[count]);
 		count++;
 	}
 
-	int status = MPI_Waitall(count, reqs, MPI_STATUS_IGNORE);
+	int status = MPI_Waitall(count, reqs, MPI_STATUSES_IGNORE);
 	if (status == MPI_ERR_IN_STATUS)
 	{
 		throw std::runtime_error("MPI error exchanging padding.");
 	}
-	MPI_Barrier(MPI_COMM_WORLD);
+
+	// the voxel buffer is kept up to date with the packed planes received
+	if (packed_bits)
+	{
+		const size_t planes = numPlanes();
+		for (size_t p = 0; p < planes; ++p)
+		{
+			if ((below && p < pad_planes) || (above && p >= planes - pad_planes))
+				UnpackLabels(packed.data() + p * plane_bytes, 0, plane_size, packed_bits, data.get() + p * plane_size);
+		}
+	}
+	MPI_Barrier(MPIDetails::Comm());
+}
+
+/**
+ * @brief The number of planes along the slowest direction (the decomposed one) of the padded region.
+ */
+template <typename T, int Padding, IndexScheme S>
+size_t MPIDomain<T, Padding, S>::numPlanes() const
+{
+	return S == ZFastest ? padded.extent.i : padded.extent.k;
+}
+
+/**
+ * @brief Makes a bit-packed copy of the labels of the padded region.
+ * @details A segmentation with up to 4 (or 16) labels then moves 2 (or 4) bits per voxel
+ * instead of 8 or 16: each plane along the slowest direction is packed on its own (in
+ * parallel, see Threads), starting on a byte boundary, and exchangePadding and
+ * MPIRedistributor send the packed planes. The voxel buffer (or the view of memory owned
+ * elsewhere) is kept as it is and still holds the labels, so the next read reuses it and the
+ * voxels are read and indexed as before. The copy is only valid until the voxels change, see
+ * clearPacked. Does nothing if already packed.
+ * @param bits 2, 4 or 8, or 8 * sizeof(T) to keep the labels as they are.
+ * @throws std::runtime_error if bits is not one of these, or a label does not fit in bits
+ * (the domain is then left unpacked).
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIDomain<T, Padding, S>::pack(int bits)
+{
+	if (packed_bits || bits == 8 * (int)sizeof(T))
+		return;
+	if (bits != 2 && bits != 4 && bits != 8)
+		throw std::runtime_error("Labels are packed with 2, 4 or 8 bits.");
+
+	const size_t planes = numPlanes();
+	plane_size = planes ? padded.extent.size() / planes : 0;
+	plane_bytes = PackedBytes(plane_size, bits);
+	packed.resize(planes * plane_bytes);
+
+	std::vector<unsigned> any(planes, 0);
+	const T *src = data.get();
+	unsigned char *dst = packed.data();
+	const size_t size = plane_size, bytes = plane_bytes;
+	Threads::ParallelFor(planes, [&](size_t begin, size_t end)
+	{
+		for (size_t p = begin; p < end; ++p)
+			any[p] = PackLabels(src + p * size, size, bits, dst + p * bytes);
+	});
+
+	unsigned all = 0;
+	for (size_t p = 0; p < planes; ++p)
+		all |= any[p];
+	if (all >> bits)
+	{
+		clearPacked();
+		throw std::runtime_error("The labels do not fit in " + std::to_string(bits) + " bits.");
+	}
+	packed_bits = bits;
+}
+
+/**
+ * @brief The packed planes of a box spanning whole planes of the padded region.
+ * @return The first packed byte of the box, whose planes follow each other, or NULL if the
+ * domain is not packed or the box does not span whole planes.
+ */
+template <typename T, int Padding, IndexScheme S>
+const unsigned char *MPIDomain<T, Padding, S>::packedPlanes(const Domain &box) const
+{
+	if (!packed_bits || box.origin.j != padded.origin.j || box.extent.j != padded.extent.j)
+		return NULL;
+	if (S == ZFastest && (box.origin.k != padded.origin.k || box.extent.k != padded.extent.k))
+		return NULL;
+	if (S == XFastest && (box.origin.i != padded.origin.i || box.extent.i != padded.extent.i))
+		return NULL;
+
+	size_t p = S == ZFastest ? box.origin.i - padded.origin.i : box.origin.k - padded.origin.k;
+	return packed.data() + p * plane_bytes;
+}
+
+/**
+ * @brief Discards the packed copy, e.g. before the voxels are changed or replaced.
+ * @details Its storage is kept for the next pack().
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIDomain<T, Padding, S>::clearPacked()
+{
+	packed.clear();
+	packed_bits = 0;
+}
+
+template <typename T, int Padding, IndexScheme S>
+bool MPIDomain<T, Padding, S>::isPacked() const
+{
+	return packed_bits != 0;
+}
+
+/**
+ * @brief The bits each label is packed into, 0 if the domain is not packed.
+ */
+template <typename T, int Padding, IndexScheme S>
+int MPIDomain<T, Padding, S>::packedBits() const
+{
+	return packed_bits;
 }
 
 /**
@@ -178,22 +399,23 @@ MPIDomain<T, Padding, S>::~MPIDomain()
 }
 
 template <typename T, int Padding, IndexScheme S>
-std::unique_ptr<T[]> &MPIDomain<T, Padding, S>::getData()
+SlabPtr<T> &MPIDomain<T, Padding, S>::getData()
 {
 	return data;
 }
 
 template <typename T, int Padding, IndexScheme S>
-const std::unique_ptr<T[]> &MPIDomain<T, Padding, S>::getData() const
+const SlabPtr<T> &MPIDomain<T, Padding, S>::getData() const
 {
 	return data;
 }
 
 template <typename T, int Padding, IndexScheme S>
-void MPIDomain<T, Padding, S>::take(std::unique_ptr<T[]> &data_in)
+void MPIDomain<T, Padding, S>::take(SlabPtr<T> &data_in)
 {
 	// take ownership (data_in is invalid after this)
 	data = std::move(data_in);
+	clearPacked();
 }
 
 template <typename T, int Padding, IndexScheme S>
@@ -205,16 +427,83 @@ T &MPIDomain<T, Padding, S>::operator[](int arrayId)
 template <typename T, int Padding, IndexScheme S>
 T &MPIDomain<T, Padding, S>::operator[](SubIndex<S> idx)
 {
-	if (idx.valid(padded)) // local index
+	return at(idx.i, idx.j, idx.k);
+}
+
+/**
+ * @brief Bounds checked access to a voxel of the padded region.
+ * @throws std::runtime_error if (i, j, k) is outside of the padded region.
+ */
+template <typename T, int Padding, IndexScheme S>
+T &MPIDomain<T, Padding, S>::at(int i, int j, int k)
+{
+	if (strides.contains(i, j, k)) // local index
 	{
-		return data[idx.arrayId(padded)];
+		return data[strides.offset(i, j, k)];
 	}
 
 	std::stringstream msg;
-	msg << "Index " << idx << " out of bounds for padded region.";
+	msg << "Index " << int3(i, j, k) << " out of bounds for padded region.";
 	throw std::runtime_error(msg.str());
 }
 
+/**
+ * @brief Unchecked access to a voxel of the padded region, for loops whose bounds lie inside it.
+ */
+template <typename T, int Padding, IndexScheme S>
+inline T &MPIDomain<T, Padding, S>::operator()(int i, int j, int k)
+{
+	return data[strides.offset(i, j, k)];
+}
+
+/**
+ * @brief Visits a box of the padded region as the longest possible runs of consecutive voxels.
+ * @details A box spanning the padded region along the fastest direction is visited as planes,
+ * one also spanning the middle direction as a single span. Otherwise every row along the
+ * fastest direction is a span.
+ * @param box The voxels to visit, which must lie inside the padded region.
+ * @param f Called as f(const Span<T> &) for each span, in layout order.
+ * @throws std::runtime_error if the box is not inside the padded region.
+ */
+template <typename T, int Padding, IndexScheme S>
+template <typename F>
+void MPIDomain<T, Padding, S>::forEachSpan(const Domain &box, F f)
+{
+	visitSpans(box, strides.contiguity(box), f);
+}
+
+/**
+ * @brief As forEachSpan, but always visits single rows along the fastest direction.
+ */
+template <typename T, int Padding, IndexScheme S>
+template <typename F>
+void MPIDomain<T, Padding, S>::forEachRow(const Domain &box, F f)
+{
+	visitSpans(box, 0, f);
+}
+
+template <typename T, int Padding, IndexScheme S>
+template <typename F>
+void MPIDomain<T, Padding, S>::visitSpans(const Domain &box, int contiguity, F &f)
+{
+	if (box.extent.size() == 0)
+		return;
+	if (!strides.contains(box.origin.i, box.origin.j, box.origin.k) || !strides.contains(box.origin.i + box.extent.i - 1, box.origin.j + box.extent.j - 1, box.origin.k + box.extent.k - 1))
+	{
+		std::stringstream msg;
+		msg << box << " is not inside the padded region " << padded << ".";
+		throw std::runtime_error(msg.str());
+	}
+
+	T *base = data.get();
+	const Strides<S> &st = strides;
+	ForEachSpan<S>(box, contiguity, [base, &st, &f](const int3 &start, size_t length)
+	{
+		Span<T> span = {base + st.offset(start.i, start.j, start.k), length, start};
+		f(span);
+	});
+}
+
 template <typename T, int Padding, IndexScheme S>
 void MPIDomain<T, Padding, S>::serialize(std::ostream &fout)
 {
@@ -254,9 +543,10 @@ void MPIDomain<T, Padding, S>::deserialize(std::istream &in)
 	in.read((char *)&padded.extent.i, sizeof(int));
 	in.read((char *)&padded.extent.j, sizeof(int));
 	in.read((char *)&padded.extent.k, sizeof(int));
+	strides = Strides<S>(padded);
 
 	// allocate space
-	data = std::unique_ptr<T[]>(new T[padded.extent.size()]);
+	allocate();
 
 	switch (S)
 	{
@@ -277,22 +567,21 @@ void MPIDomain<T, Padding, S>::debugPrint(std::ostream &fout)
 {
 	using namespace std;
 
-	for (int i = padded.origin.i; i < (padded.origin.i + padded.extent.i); ++i)
+	// one line per row in layout order, a separator after each plane
+	const int last_j = padded.origin.j + padded.extent.j - 1;
+	forEachRow(padded, [&](const Span<T> &row)
 	{
-		for (int j = padded.origin.j; j < (padded.origin.j + padded.extent.j); ++j)
+		for (size_t n = 0; n < row.length; ++n)
+			fout << (double)row.data[n] << "\t";
+		fout << endl;
+
+		if (row.start.j == last_j)
 		{
-			for (int k = padded.origin.k; k < (padded.origin.k + padded.extent.k); ++k)
-			{
-				fout << (double)data[Index(i, j, k).arrayId(padded)] << "\t";
-				//  fout << Index(i,j,k).arrayId(padded) << "\t";
-				//  fout << Index(i,j,k).arrayId(global) << "\t";
-			}
-			fout << endl;
+			fout << endl
+				 << "-------------------------------------------------------------------------------------------------------------------------" << endl
+				 << endl;
 		}
-		fout << endl
-			 << "-------------------------------------------------------------------------------------------------------------------------" << endl
-			 << endl;
-	}
+	});
 }
 
 /*
@@ -322,7 +611,8 @@ public:
 	/**
 	 * @brief Initialises static variables required for mapping between local and global indices.
 	 * @details This function must be called once by all processes. It gathers the local domain
-	 * information from all processes to compute the offsets needed for global index calculation.
+	 * information from all processes (in a single MPI_Allgather) to compute the offsets needed
+	 * for global index calculation and the owner index used by Owner().
 	 * @param local_dom The unpadded local domain of the calling process.
 	 * @param mpi_rank The rank of the calling process.
 	 * @param mpi_comm_size The total number of MPI processes.
@@ -335,14 +625,7 @@ public:
 
 		// distribute unpadded local domains
 		Domain tmp = local_dom;
-
-		for (int p = 0; p < mpi_comm_size; ++p)
-		{
-			if (p == mpi_rank)
-				tmp = local_dom;
-			MPI_Bcast(&tmp, 1, MPI_DOMAIN, p, MPI_COMM_WORLD);
-			all_local_domains[p] = tmp;
-		}
+		MPI_Allgather(&tmp, 1, MPI_DOMAIN, all_local_domains.get(), 1, MPI_DOMAIN, MPIDetails::Comm());
 
 		// calculate offsets by distributed extent of each
 		offsets[0] = 0;
@@ -351,11 +634,61 @@ public:
 			offsets[p] = offsets[p - 1] + all_local_domains[p - 1].extent.size();
 		}
 
+		// the domains are slabs along the decomposed direction, so sorting their starts along it
+		// lets the owner of an index be found by a binary search
+		slab_starts.clear();
+		for (int p = 0; p < mpi_comm_size; ++p)
+		{
+			if (all_local_domains[p].extent.size() > 0)
+				slab_starts.push_back(std::make_pair(DecomposedCoord(all_local_domains[p].origin), p));
+		}
+		std::sort(slab_starts.begin(), slab_starts.end());
+
 		// store rank and comm_size
 		MPISubIndex<S>::mpi_comm_size = mpi_comm_size;
 		MPISubIndex<S>::mpi_rank = mpi_rank;
 	}
 
+	/**
+	 * @brief Finds the process owning a global 3D index.
+	 * @details A binary search over the slab starts, O(log P).
+	 * @return The rank of the owner, or -1 if the index lies outside of the global domain.
+	 */
+	static int Owner(const int3 &idx)
+	{
+		int c = DecomposedCoord(idx);
+		std::vector<std::pair<int, int> >::const_iterator it = std::upper_bound(slab_starts.begin(), slab_starts.end(), std::make_pair(c, INT_MAX));
+		if (it == slab_starts.begin())
+			return -1;
+
+		int p = (--it)->second;
+		return SubIndex<S>(idx.i, idx.j, idx.k).valid(all_local_domains[p]) ? p : -1;
+	}
+
+	/**
+	 * @brief Finds the processes owning many global 3D indices in one call.
+	 * @details Runs of indices with the same owner (as when walking along a row) are resolved
+	 * without a search, others as in Owner().
+	 * @param idx The global indices.
+	 * @param n The number of indices.
+	 * @param owners Receives the rank owning each index (-1 if outside of the global domain).
+	 * @param global_ids If not NULL, receives the global 1D array index of each index (see globalArrayId).
+	 */
+	static void Owners(const int3 *idx, size_t n, int *owners, int *global_ids = NULL)
+	{
+		int last = -1;
+		for (size_t m = 0; m < n; ++m)
+		{
+			SubIndex<S> sub(idx[m].i, idx[m].j, idx[m].k);
+			int p = (last >= 0 && sub.valid(all_local_domains[last])) ? last : Owner(idx[m]);
+			owners[m] = p;
+			if (global_ids)
+				global_ids[m] = p >= 0 ? offsets[p] + sub.arrayId(all_local_domains[p]) : -1;
+			if (p >= 0)
+				last = p;
+		}
+	}
+
 	/**
 	 * @brief Converts a 1D array index local to this process into a 1D global array index.
 	 * @param local_idx The 1D index in the local process's data array.
@@ -383,9 +716,9 @@ public:
 		}
 		else
 		{
-			for (int p = 0; p < mpi_comm_size; ++p)
-				if (SubIndex<S>::valid(all_local_domains[p]))
-					return offsets[p] + SubIndex<S>::arrayId(all_local_domains[p]);
+			int p = Owner(*this);
+			if (p >= 0)
+				return offsets[p] + SubIndex<S>::arrayId(all_local_domains[p]);
 
 			std::stringstream msg;
 			msg << "A Matching domain for global index " << *this << " was not found.";
@@ -408,6 +741,16 @@ public:
 	static int mpi_comm_size;
 	static std::unique_ptr<unsigned int[]> offsets;
 	static std::unique_ptr<Domain[]> all_local_domains;
+
+private:
+	// the coordinate along the direction the domain is decomposed in (see Preprocessor::decomposeDomain)
+	static int DecomposedCoord(const int3 &idx)
+	{
+		return S == ZFastest ? idx.i : idx.k;
+	}
+
+	// (start along the decomposed direction, rank) of every non-empty local domain, sorted
+	static std::vector<std::pair<int, int> > slab_starts;
 };
 
 // static variable definitions
@@ -419,6 +762,8 @@ template <IndexScheme S>
 int MPISubIndex<S>::mpi_rank;
 template <IndexScheme S>
 int MPISubIndex<S>::mpi_comm_size;
+template <IndexScheme S>
+std::vector<std::pair<int, int> > MPISubIndex<S>::slab_starts;
 
 // typedef
 #define IDX_SCHEME ZFastest
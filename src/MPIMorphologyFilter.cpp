@@ -0,0 +1,52 @@
+#include "MPIMorphologyFilter.h"
+#include <sstream>
+#include <cstdlib>
+
+/**
+ * @brief Parses a chain of filters, e.g. "median:1,open:2:cube".
+ * @details Every filter is an operation (erode, dilate, open, close or median) and a radius,
+ * optionally followed by the shape of the structuring element (ball, the default, or cube).
+ * The filters run in the order given.
+ * @throws std::runtime_error if a filter cannot be parsed.
+ */
+std::vector<MorphologyStep> ParseFilterChain(const std::string &spec)
+{
+	const char *names[] = {"erode", "dilate", "open", "close", "median"};
+	const MorphologyOp ops[] = {Erode, Dilate, Open, Close, Median};
+
+	std::vector<MorphologyStep> steps;
+	std::stringstream items(spec);
+	std::string item;
+	while (std::getline(items, item, ','))
+	{
+		std::stringstream fields(item);
+		std::string name, radius, shape;
+		std::getline(fields, name, ':');
+		std::getline(fields, radius, ':');
+		std::getline(fields, shape, ':');
+
+		MorphologyStep step;
+		int op = 0;
+		while (op < 5 && name != names[op])
+			++op;
+		char *end;
+		step.radius = std::strtol(radius.c_str(), &end, 10);
+		if (op == 5 || radius.empty() || *end != '\0' || step.radius < 1 || (shape != "" && shape != "ball" && shape != "cube"))
+			throw std::runtime_error("Cannot parse the filter '" + item + "', expected erode|dilate|open|close|median:radius[:ball|cube].");
+		step.op = ops[op];
+		step.cube = shape == "cube";
+		steps.push_back(step);
+	}
+	return steps;
+}
+
+/**
+ * @brief The largest radius of a chain of filters, i.e. the halo it needs (0 for no filters).
+ */
+int MaxRadius(const std::vector<MorphologyStep> &steps)
+{
+	int radius = 0;
+	for (size_t s = 0; s < steps.size(); ++s)
+		radius = std::max(radius, steps[s].radius);
+	return radius;
+}
@@ -0,0 +1,334 @@
+#ifndef MPIMORPHOLOGYFILTER_H_
+#define MPIMORPHOLOGYFILTER_H_
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <mpi.h>
+#include "MPIDomain.h"
+#include "Threads.h"
+
+/*
+ * Morphological filters of a label volume, each with a ball or cube
+ * shaped structuring element of a given radius. Labels are treated as
+ * grey values: erosion takes the smallest label under the element and
+ * dilation the largest, so on the boundary between two materials
+ * erosion grows the lower label and dilation the higher one. Opening
+ * (erode, dilate) removes specks of the higher label smaller than the
+ * element, closing (dilate, erode) fills holes in it. The median filter
+ * replaces every voxel by the median label under the element, which on
+ * two-material boundaries is a majority vote that smooths away noise.
+ *
+ * The filters run on each process's slab plus halo planes of the
+ * largest radius in the chain, exchanged with the neighbouring slabs
+ * before every pass. The planes which need no halo are filtered while
+ * the halo is in flight. Every pass runs over the rows of the slab with
+ * the element split into one window per row it covers; min and max
+ * windows are plain loops over a row which the compiler vectorises.
+ */
+enum MorphologyOp
+{
+	Erode,
+	Dilate,
+	Open,
+	Close,
+	Median
+};
+
+struct MorphologyStep
+{
+	MorphologyOp op;
+	int radius;
+	bool cube; // a cube of side 2 * radius + 1 instead of a ball
+};
+
+std::vector<MorphologyStep> ParseFilterChain(const std::string &spec);
+int MaxRadius(const std::vector<MorphologyStep> &steps);
+
+template <typename T, IndexScheme S>
+class MPIMorphologyFilter
+{
+public:
+	MPIMorphologyFilter(const std::vector<MorphologyStep> &steps);
+	virtual ~MPIMorphologyFilter();
+
+	template <int Padding>
+	void apply(MPIDomain<T, Padding, S> &dom, MPI_Datatype type);
+
+private:
+	enum Pass
+	{
+		PassMin,
+		PassMax,
+		PassMedian
+	};
+
+	// the part of the structuring element in row (a + da, b + db): columns c - w .. c + w
+	struct RowWindow
+	{
+		int da, db, w;
+	};
+
+	void setupSlab(const Domain &owned);
+	void runPass(Pass pass, int radius, bool cube, MPI_Datatype type);
+	void filterPlanes(Pass pass, const std::vector<RowWindow> &windows, int a_begin, int a_end);
+
+	static std::vector<RowWindow> Element(int radius, bool cube);
+
+	std::vector<MorphologyStep> steps;
+	int max_radius;
+
+	// the slab with its halo, in layout order: planes a along the decomposition, rows b, columns c
+	MPIDomain<T, 0, S> in, out;
+	int num_planes, first_owned, end_owned, rows, columns;
+	size_t plane_size;
+};
+
+template <typename T, IndexScheme S>
+MPIMorphologyFilter<T, S>::MPIMorphologyFilter(const std::vector<MorphologyStep> &steps)
+	: steps(steps), max_radius(MaxRadius(steps)), num_planes(0), first_owned(0), end_owned(0), rows(0), columns(0), plane_size(0)
+{
+}
+
+template <typename T, IndexScheme S>
+MPIMorphologyFilter<T, S>::~MPIMorphologyFilter()
+{
+}
+
+/**
+ * @brief Runs the filter chain on the owned voxels of a domain.
+ * @details Must be called by all processes. The domain is decomposed into slabs in rank order
+ * (see Preprocessor::decomposeDomain), each at least as thick as the largest radius. The
+ * padding is left as it was, see MPIDomain::exchangePadding.
+ * @param dom The domain to filter in place.
+ * @param type The MPI type of T.
+ * @throws std::runtime_error if a slab is thinner than the largest radius.
+ */
+template <typename T, IndexScheme S>
+template <int Padding>
+void MPIMorphologyFilter<T, S>::apply(MPIDomain<T, Padding, S> &dom, MPI_Datatype type)
+{
+	if (steps.empty())
+		return;
+
+	int thickness = S == ZFastest ? dom.extent.i : dom.extent.k;
+	int thinnest;
+	MPI_Allreduce(&thickness, &thinnest, 1, MPI_INT, MPI_MIN, MPIDetails::Comm());
+	if (thinnest < max_radius)
+		throw std::runtime_error("Filter radius " + std::to_string(max_radius) + " is larger than the thinnest slab (" + std::to_string(thinnest) + " planes); use fewer processes.");
+
+	setupSlab(dom);
+
+	// the owned planes are contiguous in both domains
+	T *owned = &dom(dom.origin.i, dom.origin.j, dom.origin.k);
+	size_t owned_size = (size_t)(end_owned - first_owned) * plane_size;
+	std::memcpy(&in.getData()[first_owned * plane_size], owned, owned_size * sizeof(T));
+
+	for (size_t s = 0; s < steps.size(); ++s)
+	{
+		const MorphologyStep &step = steps[s];
+		switch (step.op)
+		{
+		case Erode:
+			runPass(PassMin, step.radius, step.cube, type);
+			break;
+		case Dilate:
+			runPass(PassMax, step.radius, step.cube, type);
+			break;
+		case Open:
+			runPass(PassMin, step.radius, step.cube, type);
+			runPass(PassMax, step.radius, step.cube, type);
+			break;
+		case Close:
+			runPass(PassMax, step.radius, step.cube, type);
+			runPass(PassMin, step.radius, step.cube, type);
+			break;
+		case Median:
+			runPass(PassMedian, step.radius, step.cube, type);
+			break;
+		}
+	}
+
+	std::memcpy(owned, &in.getData()[first_owned * plane_size], owned_size * sizeof(T));
+}
+
+/**
+ * @brief Sizes the slab buffers: the owned planes plus up to max_radius halo planes on each side.
+ */
+template <typename T, IndexScheme S>
+void MPIMorphologyFilter<T, S>::setupSlab(const Domain &owned)
+{
+	Domain box = owned;
+	int &origin = S == ZFastest ? box.origin.i : box.origin.k;
+	int &extent = S == ZFastest ? box.extent.i : box.extent.k;
+	int global_origin = S == ZFastest ? global.origin.i : global.origin.k;
+	int global_end = global_origin + (S == ZFastest ? global.extent.i : global.extent.k);
+
+	int owned_origin = origin, owned_end = origin + extent;
+	origin = std::max(global_origin, owned_origin - max_radius);
+	extent = std::min(global_end, owned_end + max_radius) - origin;
+
+	num_planes = extent;
+	first_owned = owned_origin - origin;
+	end_owned = owned_end - origin;
+	rows = box.extent.j;
+	columns = S == ZFastest ? box.extent.k : box.extent.i;
+	plane_size = (size_t)rows * columns;
+
+	in.setExtents(owned.origin, owned.extent, box);
+	in.allocate();
+	out.setExtents(owned.origin, owned.extent, box);
+	out.allocate();
+}
+
+/**
+ * @brief The rows covered by a structuring element and the half width of the element in each.
+ */
+template <typename T, IndexScheme S>
+std::vector<typename MPIMorphologyFilter<T, S>::RowWindow> MPIMorphologyFilter<T, S>::Element(int radius, bool cube)
+{
+	std::vector<RowWindow> windows;
+	for (int da = -radius; da <= radius; ++da)
+	{
+		for (int db = -radius; db <= radius; ++db)
+		{
+			int rest = radius * radius - da * da - db * db;
+			if (cube)
+				windows.push_back(RowWindow{da, db, radius});
+			else if (rest >= 0)
+				windows.push_back(RowWindow{da, db, (int)std::sqrt((double)rest)});
+		}
+	}
+	return windows;
+}
+
+/**
+ * @brief Filters the owned planes of in into out, then swaps them.
+ * @details The halo planes are exchanged with the neighbouring slabs while the planes which
+ * do not reach into the halo are filtered.
+ */
+template <typename T, IndexScheme S>
+void MPIMorphologyFilter<T, S>::runPass(Pass pass, int radius, bool cube, MPI_Datatype type)
+{
+	const int tag = 20;
+	const int rank = MPIDetails::Rank();
+	const bool has_prev = rank > 0;
+	const bool has_next = rank < MPIDetails::CommSize() - 1;
+	T *data = in.getData().get();
+
+	MPI_Request reqs[4];
+	int count = 0;
+	size_t halo_size = radius * plane_size;
+	if (has_prev)
+	{
+		MPI_Irecv(data + (first_owned - radius) * plane_size, halo_size, type, rank - 1, tag, MPIDetails::Comm(), &reqs[count++]);
+		MPI_Isend(data + first_owned * plane_size, halo_size, type, rank - 1, tag + 1, MPIDetails::Comm(), &reqs[count++]);
+	}
+	if (has_next)
+	{
+		MPI_Irecv(data + end_owned * plane_size, halo_size, type, rank + 1, tag + 1, MPIDetails::Comm(), &reqs[count++]);
+		MPI_Isend(data + (end_owned - radius) * plane_size, halo_size, type, rank + 1, tag, MPIDetails::Comm(), &reqs[count++]);
+	}
+
+	std::vector<RowWindow> windows = Element(radius, cube);
+	int interior_begin = first_owned + (has_prev ? radius : 0);
+	int interior_end = end_owned - (has_next ? radius : 0);
+	if (interior_begin < interior_end)
+		filterPlanes(pass, windows, interior_begin, interior_end);
+
+	if (MPI_Waitall(count, reqs, MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+		throw std::runtime_error("MPI error exchanging filter halos.");
+
+	if (interior_begin < interior_end)
+	{
+		filterPlanes(pass, windows, first_owned, interior_begin);
+		filterPlanes(pass, windows, interior_end, end_owned);
+	}
+	else
+	{
+		filterPlanes(pass, windows, first_owned, end_owned);
+	}
+
+	std::swap(in.getData(), out.getData());
+}
+
+/**
+ * @brief Filters the planes a_begin .. a_end of in into out (on all threads).
+ * @details The element is clipped at the ends of the rows and at the planes and rows which do
+ * not exist (the global boundary).
+ */
+template <typename T, IndexScheme S>
+void MPIMorphologyFilter<T, S>::filterPlanes(Pass pass, const std::vector<RowWindow> &windows, int a_begin, int a_end)
+{
+	if (a_begin >= a_end)
+		return;
+
+	const T *src = in.getData().get();
+	T *dst = out.getData().get();
+	const int C = columns;
+
+	Threads::ParallelFor((size_t)(a_end - a_begin) * rows, [&](size_t begin, size_t end)
+	{
+		std::vector<T> values;
+		for (size_t r = begin; r < end; ++r)
+		{
+			int a = a_begin + (int)(r / rows);
+			int b = (int)(r % rows);
+			T *out_row = dst + a * plane_size + (size_t)b * C;
+
+			if (pass == PassMedian)
+			{
+				for (int c = 0; c < C; ++c)
+				{
+					values.clear();
+					for (size_t w = 0; w < windows.size(); ++w)
+					{
+						const RowWindow &win = windows[w];
+						int sa = a + win.da, sb = b + win.db;
+						if (sa < 0 || sa >= num_planes || sb < 0 || sb >= rows)
+							continue;
+						const T *in_row = src + sa * plane_size + (size_t)sb * C;
+						for (int sc = std::max(0, c - win.w); sc <= std::min(C - 1, c + win.w); ++sc)
+							values.push_back(in_row[sc]);
+					}
+					std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+					out_row[c] = values[values.size() / 2];
+				}
+				continue;
+			}
+
+			std::fill(out_row, out_row + C, pass == PassMin ? std::numeric_limits<T>::max() : std::numeric_limits<T>::min());
+			for (size_t w = 0; w < windows.size(); ++w)
+			{
+				const RowWindow &win = windows[w];
+				int sa = a + win.da, sb = b + win.db;
+				if (sa < 0 || sa >= num_planes || sb < 0 || sb >= rows)
+					continue;
+				const T *in_row = src + sa * plane_size + (size_t)sb * C;
+
+				// one shifted copy of the row per column of the window
+				for (int dc = -win.w; dc <= win.w; ++dc)
+				{
+					int lo = std::max(0, -dc), hi = std::min(C, C - dc);
+					const T *shifted = in_row + dc;
+					if (pass == PassMin)
+					{
+						for (int c = lo; c < hi; ++c)
+							out_row[c] = shifted[c] < out_row[c] ? shifted[c] : out_row[c];
+					}
+					else
+					{
+						for (int c = lo; c < hi; ++c)
+							out_row[c] = shifted[c] > out_row[c] ? shifted[c] : out_row[c];
+					}
+				}
+			}
+		}
+	});
+}
+
+#endif /* MPIMORPHOLOGYFILTER_H_ */
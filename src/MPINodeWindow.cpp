@@ -0,0 +1 @@
+#include "MPINodeWindow.h"
@@ -0,0 +1,114 @@
+#ifndef MPINODEWINDOW_H_
+#define MPINODEWINDOW_H_
+
+#include <stdexcept>
+#include <mpi.h>
+#include "Domain.h"
+#include "SlabAllocator.h"
+
+/*
+ * Class which holds a box of voxels in memory shared by all processes
+ * of a node (MPI_Win_allocate_shared). The memory is allocated by the
+ * node's first process; every process can then view any slab of the box
+ * in place, so slabs of neighbouring processes on the same node share
+ * their overlapping (padding) planes rather than holding copies.
+ *
+ * The window stays in a passive target epoch for its whole lifetime, so
+ * the processes access the memory directly and call sync() to make their
+ * writes visible to each other.
+ */
+template <typename T, IndexScheme S>
+class MPINodeWindow
+{
+public:
+	MPINodeWindow(const Domain &node_box, MPI_Comm node_comm);
+	virtual ~MPINodeWindow();
+
+	SlabPtr<T> view(const Domain &box);
+	void sync();
+
+	const Domain &box() const;
+
+private:
+	MPINodeWindow(const MPINodeWindow &);
+	MPINodeWindow &operator=(const MPINodeWindow &);
+
+	Domain node_box;
+	Strides<S> strides;
+	MPI_Comm comm;
+	MPI_Win win;
+	T *base;
+};
+
+/**
+ * @brief Allocates the shared memory for a box. Must be called by all processes of the node.
+ * @param node_box The voxels held, the same on all processes of the node.
+ * @param node_comm The processes of the node (see MPIDetails::NodeComm).
+ * @throws std::runtime_error if the shared memory cannot be allocated.
+ */
+template <typename T, IndexScheme S>
+MPINodeWindow<T, S>::MPINodeWindow(const Domain &node_box, MPI_Comm node_comm)
+	: node_box(node_box), strides(node_box), comm(node_comm), win(MPI_WIN_NULL), base(NULL)
+{
+	int node_rank;
+	MPI_Comm_rank(comm, &node_rank);
+
+	// only the first process contributes memory, so the box is contiguous
+	MPI_Aint size = node_rank == 0 ? (MPI_Aint)node_box.extent.size() * sizeof(T) : 0;
+	T *mine;
+	if (MPI_Win_allocate_shared(size, sizeof(T), MPI_INFO_NULL, comm, &mine, &win) != MPI_SUCCESS)
+		throw std::runtime_error("Cannot allocate shared memory for the node's domain.");
+
+	MPI_Aint first_size;
+	int disp_unit;
+	MPI_Win_shared_query(win, 0, &first_size, &disp_unit, &base);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+}
+
+template <typename T, IndexScheme S>
+MPINodeWindow<T, S>::~MPINodeWindow()
+{
+	// owners which outlive MPI (e.g. main's Preprocessor) leave the window to MPI_Finalize
+	int finalized;
+	MPI_Finalized(&finalized);
+	if (finalized)
+		return;
+
+	MPI_Win_unlock_all(win);
+	MPI_Win_free(&win);
+}
+
+/**
+ * @brief Returns a non-owning view of part of the box, e.g. to give an MPIDomain.
+ * @param box The voxels to view, which have to be contiguous in the box (a slab of whole planes).
+ * @throws std::runtime_error if the box is not a contiguous part of the node's box.
+ */
+template <typename T, IndexScheme S>
+SlabPtr<T> MPINodeWindow<T, S>::view(const Domain &box)
+{
+	int3 last = box.origin + box.extent - int3(1, 1, 1);
+	if (!strides.contains(box.origin.i, box.origin.j, box.origin.k) || !strides.contains(last.i, last.j, last.k) || strides.contiguity(box) < 2)
+		throw std::runtime_error("Cannot view a domain which is not a contiguous part of the node's domain.");
+
+	return ViewSlab(base + strides.offset(box.origin.i, box.origin.j, box.origin.k), box.extent.size());
+}
+
+/**
+ * @brief Makes the writes of every process of the node visible to the others.
+ * @details A barrier over the node, so it must be called by all processes of the node.
+ */
+template <typename T, IndexScheme S>
+void MPINodeWindow<T, S>::sync()
+{
+	MPI_Win_sync(win);
+	MPI_Barrier(comm);
+	MPI_Win_sync(win);
+}
+
+template <typename T, IndexScheme S>
+const Domain &MPINodeWindow<T, S>::box() const
+{
+	return node_box;
+}
+
+#endif /* MPINODEWINDOW_H_ */
@@ -0,0 +1,88 @@
+#include "MPIPreviewExtractor.h"
+#include <sstream>
+#include <cstdlib>
+
+/**
+ * @brief Parses the planes and projections to extract, e.g. "x=100,y=50,z=10,z=20" and "xyz".
+ * @param slices Comma separated axis=position planes (positions in voxels from 0), or empty.
+ * @param mip_axes The axes to project along, or empty for no projections.
+ * @throws std::runtime_error if a plane or axis cannot be parsed.
+ */
+std::vector<PreviewPlane> ParsePreviewPlanes(const std::string &slices, const std::string &mip_axes)
+{
+	std::vector<PreviewPlane> planes;
+	std::stringstream items(slices);
+	std::string item;
+	while (std::getline(items, item, ','))
+	{
+		PreviewPlane plane;
+		plane.axis = item.empty() ? '\0' : item[0];
+		char *end = NULL;
+		const char *position = item.size() > 2 ? item.c_str() + 2 : "";
+		plane.position = std::strtol(position, &end, 10);
+		if (item.size() < 3 || item[1] != '=' || *end != '\0' || plane.position < 0 || (plane.axis != 'x' && plane.axis != 'y' && plane.axis != 'z'))
+			throw std::runtime_error("Cannot parse the slice '" + item + "', expected x|y|z=position.");
+		planes.push_back(plane);
+	}
+
+	for (size_t n = 0; n < mip_axes.size(); ++n)
+	{
+		PreviewPlane plane;
+		plane.axis = mip_axes[n];
+		plane.position = -1;
+		if (plane.axis != 'x' && plane.axis != 'y' && plane.axis != 'z')
+			throw std::runtime_error("Cannot parse the projection axes '" + mip_axes + "', expected some of x, y and z.");
+		planes.push_back(plane);
+	}
+
+	if (planes.empty())
+		throw std::runtime_error("No preview slices or projections given.");
+	return planes;
+}
+
+/**
+ * @brief Writes a grey scale image as a binary PGM file.
+ * @details The maximum grey value is the image's largest value, so viewers stretch the
+ * contrast (labels 1 to 4 show as dark to white). Values above 255 take two bytes, big endian.
+ * @param fname The file to write.
+ * @param data The values, row by row.
+ * @param bytes_per_value 1 or 2.
+ * @param width The values in a row.
+ * @param height The number of rows.
+ * @throws std::runtime_error if the file cannot be written.
+ */
+void WritePgm(const std::string &fname, const void *data, size_t bytes_per_value, int width, int height)
+{
+	const size_t count = (size_t)width * height;
+	const unsigned char *bytes = (const unsigned char *)data;
+	const unsigned short *shorts = (const unsigned short *)data;
+
+	unsigned int max_value = 1;
+	for (size_t n = 0; n < count; ++n)
+		max_value = std::max(max_value, bytes_per_value == 1 ? (unsigned int)bytes[n] : (unsigned int)shorts[n]);
+
+	std::ofstream fout(fname.c_str(), std::ios::binary);
+	fout << "P5\n" << width << " " << height << "\n" << max_value << "\n";
+	if (bytes_per_value == 1)
+	{
+		fout.write((const char *)bytes, count);
+	}
+	else if (max_value < 256)
+	{
+		// the format has one byte per value up to a maximum of 255
+		std::vector<unsigned char> narrow(shorts, shorts + count);
+		fout.write((const char *)narrow.data(), narrow.size());
+	}
+	else
+	{
+		std::vector<unsigned char> big_endian(2 * count);
+		for (size_t n = 0; n < count; ++n)
+		{
+			big_endian[2 * n] = shorts[n] >> 8;
+			big_endian[2 * n + 1] = shorts[n] & 0xff;
+		}
+		fout.write((const char *)big_endian.data(), big_endian.size());
+	}
+	if (!fout)
+		throw std::runtime_error("Error writing " + fname + "!");
+}
@@ -0,0 +1,367 @@
+#ifndef MPIPREVIEWEXTRACTOR_H_
+#define MPIPREVIEWEXTRACTOR_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <mpi.h>
+#include "Domain.h"
+#include "MPIDetails.h"
+#include "LabelRemap.h"
+#include "SliceStack.h"
+#include "MappedVtiFile.h"
+#include "Threads.h"
+
+/*
+ * Class which extracts a few orthogonal planes and maximum intensity
+ * projections (MIPs) of a RAW volume, or of a slice stack, without
+ * converting it, to check a scan in seconds. Only the bytes of the
+ * requested planes are read: a plane of constant z is one contiguous
+ * range of the file, a plane of constant y one row per z and a plane of
+ * constant x one voxel per row. Projections read the whole volume, but
+ * plane by plane, so nothing of the size of the volume is ever held.
+ *
+ * Every process reads the z planes of its own slab (the RAW file's
+ * slowest direction, whatever the index scheme), on all its threads.
+ * The partial images are then reduced to the root with a maximum: the
+ * processes' parts of an image are disjoint and zero elsewhere, apart
+ * from projections along z, whose parts are merged by the reduction.
+ * The root writes each image as a one voxel thick .vti, placed where
+ * it lies in the volume (so it overlays the converted output), and as
+ * a PGM file for any image viewer.
+ */
+
+// A plane of constant x, y or z, or a projection along that axis
+struct PreviewPlane
+{
+	char axis;	  // 'x', 'y' or 'z'
+	int position; // along the axis, -1 for a maximum intensity projection
+};
+
+std::vector<PreviewPlane> ParsePreviewPlanes(const std::string &slices, const std::string &mip_axes);
+void WritePgm(const std::string &fname, const void *data, size_t bytes_per_value, int width, int height);
+
+template <typename T>
+class MPIPreviewExtractor
+{
+public:
+	MPIPreviewExtractor(const Domain &global_domain, const std::vector<PreviewPlane> &planes);
+	virtual ~MPIPreviewExtractor();
+
+	void setRemap(const LabelRemap<T> &remap);
+	void extract(const std::string &fname, const std::vector<std::string> &slices, size_t header, MPI_Datatype type);
+	std::vector<std::string> write(const std::string &fname_root, bool cell_data) const;
+
+private:
+	void readBox(std::ifstream &fin, const SliceLayout &layout, int j0, int j1, int k0, int k1, T *dst) const;
+	void addPlane(int i, const T *plane, T *z_projection);
+
+	Domain global;
+	std::vector<PreviewPlane> planes;
+	LabelRemap<T> remap;
+
+	// one image per plane, covering its box of the volume in file order (k fastest, i slowest)
+	std::vector<Domain> boxes;
+	std::vector<std::vector<T> > images;
+};
+
+/**
+ * @brief Sets up the (zeroed) images of the requested planes.
+ * @throws std::runtime_error if a plane lies outside the volume.
+ */
+template <typename T>
+MPIPreviewExtractor<T>::MPIPreviewExtractor(const Domain &global_domain, const std::vector<PreviewPlane> &planes)
+	: global(global_domain), planes(planes)
+{
+	const int3 &e = global.extent;
+	for (size_t p = 0; p < planes.size(); ++p)
+	{
+		const PreviewPlane &plane = planes[p];
+		int extent = plane.axis == 'z' ? e.i : plane.axis == 'y' ? e.j : e.k;
+		if (plane.position >= extent)
+			throw std::runtime_error(std::string("Preview plane ") + plane.axis + "=" + std::to_string(plane.position) + " lies outside the domain.");
+
+		// internally (i, j, k) = (z, y, x); projections are placed at position 0
+		int at = std::max(0, plane.position);
+		Domain box(int3(), e);
+		if (plane.axis == 'z')
+			box = Domain(int3(at, 0, 0), int3(1, e.j, e.k));
+		else if (plane.axis == 'y')
+			box = Domain(int3(0, at, 0), int3(e.i, 1, e.k));
+		else
+			box = Domain(int3(0, 0, at), int3(e.i, e.j, 1));
+		boxes.push_back(box);
+		images.push_back(std::vector<T>(box.extent.size(), 0));
+	}
+}
+
+template <typename T>
+MPIPreviewExtractor<T>::~MPIPreviewExtractor()
+{
+}
+
+/**
+ * @brief Sets the labels to renumber as the voxels are read (an empty remap turns it off).
+ */
+template <typename T>
+void MPIPreviewExtractor<T>::setRemap(const LabelRemap<T> &remap_in)
+{
+	remap = remap_in;
+}
+
+/**
+ * @brief Reads the rows j0 .. j1 and columns k0 .. k1 of a z plane.
+ * @param fin The file holding the plane.
+ * @param layout Where the plane's rows are stored in the file.
+ * @param dst The voxels read, k fastest.
+ * @throws std::runtime_error if the file cannot be read.
+ */
+template <typename T>
+void MPIPreviewExtractor<T>::readBox(std::ifstream &fin, const SliceLayout &layout, int j0, int j1, int k0, int k1, T *dst) const
+{
+	const size_t row_bytes = (size_t)global.extent.k * sizeof(T);
+	const int width = k1 - k0;
+	for (size_t s = 0; s < layout.strips.size(); ++s)
+	{
+		const SliceStrip &strip = layout.strips[s];
+		int lo = std::max(j0, strip.first_row);
+		int hi = std::min(j1, strip.first_row + strip.num_rows);
+		if (lo >= hi)
+			continue;
+
+		// whole rows are contiguous in the file, parts of rows are read one by one
+		T *rows = dst + (size_t)(lo - j0) * width;
+		if (width == global.extent.k)
+		{
+			fin.seekg(strip.offset + (lo - strip.first_row) * row_bytes);
+			fin.read((char *)rows, (hi - lo) * row_bytes);
+		}
+		for (int r = lo; r < hi && width != global.extent.k; ++r)
+		{
+			fin.seekg(strip.offset + (r - strip.first_row) * row_bytes + k0 * sizeof(T));
+			fin.read((char *)(rows + (size_t)(r - lo) * width), width * sizeof(T));
+		}
+		if (!fin)
+			throw std::runtime_error("Error reading preview voxels!");
+		if (layout.swap_bytes)
+			SwapVoxelBytes((char *)rows, (size_t)(hi - lo) * width * sizeof(T), sizeof(T));
+		if (!remap.empty())
+			remap.apply(rows, rows, (size_t)(hi - lo) * width);
+	}
+}
+
+/**
+ * @brief Adds a whole z plane to every image which needs it.
+ * @param z_projection The calling thread's own projection along z, which the plane is added
+ * to instead of the image of a projection along z (which every plane adds to).
+ */
+template <typename T>
+void MPIPreviewExtractor<T>::addPlane(int i, const T *plane, T *z_projection)
+{
+	const int rows = global.extent.j, columns = global.extent.k;
+	for (size_t p = 0; p < planes.size(); ++p)
+	{
+		const PreviewPlane &pl = planes[p];
+		const Strides<ZFastest> image(boxes[p]);
+		T *out = images[p].data();
+		if (pl.axis == 'z' && pl.position < 0)
+		{
+			for (size_t n = 0; n < (size_t)rows * columns; ++n)
+				z_projection[n] = std::max(z_projection[n], plane[n]);
+		}
+		else if (pl.axis == 'z' && pl.position == i)
+		{
+			std::copy(plane, plane + (size_t)rows * columns, out);
+		}
+		else if (pl.axis == 'y')
+		{
+			// one row of the image per z plane
+			T *row = out + image.offset(i, boxes[p].origin.j, 0);
+			if (pl.position >= 0)
+				std::copy(plane + (size_t)pl.position * columns, plane + (size_t)(pl.position + 1) * columns, row);
+			for (int j = 0; j < rows && pl.position < 0; ++j)
+			{
+				for (int k = 0; k < columns; ++k)
+					row[k] = std::max(row[k], plane[(size_t)j * columns + k]);
+			}
+		}
+		else if (pl.axis == 'x')
+		{
+			T *row = out + image.offset(i, 0, boxes[p].origin.k);
+			for (int j = 0; j < rows; ++j)
+			{
+				const T *in = plane + (size_t)j * columns;
+				row[j] = pl.position >= 0 ? in[pl.position] : *std::max_element(in, in + columns);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Reads the voxels of the requested planes and reduces the images to the root.
+ * @details Must be called by all processes. The z planes of each process's slab are shared
+ * out among its threads. Projections and planes of constant z read whole z planes, which then
+ * fill the other images too; otherwise only the rows of y planes and the voxels of x planes
+ * are read. Each thread projects its planes along z into its own image, and these are merged
+ * before the reduction.
+ * @param fname The RAW file (uncompressed), ignored if slices are given.
+ * @param slices The slice files of a stack, one per z plane (see ExpandSlicePattern), or empty.
+ * @param header The size of the file's header (or of each raw slice's header) in bytes.
+ * @param type The MPI type of T.
+ * @throws std::runtime_error if a file cannot be read.
+ */
+template <typename T>
+void MPIPreviewExtractor<T>::extract(const std::string &fname, const std::vector<std::string> &slices, size_t header, MPI_Datatype type)
+{
+	const int rank = MPIDetails::Rank(), size = MPIDetails::CommSize();
+	const int first = (int)((long)global.extent.i * rank / size);
+	const int last = (int)((long)global.extent.i * (rank + 1) / size);
+	const int rows = global.extent.j, columns = global.extent.k;
+	const unsigned long long plane_bytes = (unsigned long long)rows * columns * sizeof(T);
+
+	std::vector<int> whole_planes(global.extent.i, 0);
+	bool z_projection = false;
+	for (size_t p = 0; p < planes.size(); ++p)
+	{
+		if (planes[p].position < 0)
+			std::fill(whole_planes.begin(), whole_planes.end(), 1);
+		else if (planes[p].axis == 'z')
+			whole_planes[planes[p].position] = 1;
+		z_projection = z_projection || (planes[p].axis == 'z' && planes[p].position < 0);
+	}
+
+	std::mutex projections_lock;
+	std::vector<std::vector<T> > projections; // the projections along z of the threads
+	Threads::ParallelFor(last - first, [&](size_t begin, size_t end)
+	{
+		std::ifstream fin;
+		std::vector<T> plane, projection(z_projection ? (size_t)rows * columns : 0, 0);
+		for (int i = first + (int)begin; i < first + (int)end; ++i)
+		{
+			// a RAW file is one stack of z planes, each a single strip of rows
+			SliceLayout layout;
+			if (slices.empty())
+			{
+				if (!fin.is_open())
+					fin.open(fname.c_str(), std::ios::binary);
+				SliceStrip strip = {0, rows, header + i * plane_bytes};
+				layout.strips.push_back(strip);
+				layout.swap_bytes = false;
+			}
+			else
+			{
+				layout = ReadSliceLayout(slices[i], columns, rows, sizeof(T), header);
+				fin.close();
+				fin.clear();
+				fin.open(slices[i].c_str(), std::ios::binary);
+			}
+			if (!fin.is_open())
+				throw std::runtime_error("Cannot open file " + (slices.empty() ? fname : slices[i]) + "!");
+
+			if (whole_planes[i])
+			{
+				plane.resize((size_t)rows * columns);
+				readBox(fin, layout, 0, rows, 0, columns, plane.data());
+				addPlane(i, plane.data(), projection.data());
+				continue;
+			}
+
+			// only the rows and voxels of the planes, straight into their images
+			for (size_t p = 0; p < planes.size(); ++p)
+			{
+				const Strides<ZFastest> image(boxes[p]);
+				int at = planes[p].position;
+				if (planes[p].axis == 'y')
+					readBox(fin, layout, at, at + 1, 0, columns, &images[p][image.offset(i, at, 0)]);
+				else if (planes[p].axis == 'x')
+					readBox(fin, layout, 0, rows, at, at + 1, &images[p][image.offset(i, 0, at)]);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(projections_lock);
+		projections.push_back(std::move(projection));
+	});
+
+	for (size_t p = 0; p < planes.size() && z_projection; ++p)
+	{
+		if (planes[p].axis != 'z' || planes[p].position >= 0)
+			continue;
+
+		T *out = images[p].data();
+		Threads::ParallelFor(images[p].size(), [&](size_t begin, size_t end)
+		{
+			for (size_t t = 0; t < projections.size(); ++t)
+			{
+				const T *in = projections[t].data();
+				for (size_t n = begin; n < end; ++n)
+					out[n] = std::max(out[n], in[n]);
+			}
+		});
+	}
+
+	for (size_t p = 0; p < images.size(); ++p)
+	{
+		if (rank == 0)
+			MPI_Reduce(MPI_IN_PLACE, images[p].data(), images[p].size(), type, MPI_MAX, 0, MPIDetails::Comm());
+		else
+			MPI_Reduce(images[p].data(), NULL, images[p].size(), type, MPI_MAX, 0, MPIDetails::Comm());
+	}
+}
+
+/**
+ * @brief Writes every image as a .vti and a .pgm file (root only).
+ * @details The files are named after the plane, e.g. root_z0010.vti, or root_mip_z.vti for
+ * projections.
+ * @param fname_root The path and prefix of the files.
+ * @param cell_data Whether the .vti files hold cell data rather than point data.
+ * @return The names of the files written.
+ */
+template <typename T>
+std::vector<std::string> MPIPreviewExtractor<T>::write(const std::string &fname_root, bool cell_data) const
+{
+	std::vector<std::string> written;
+	for (size_t p = 0; p < planes.size(); ++p)
+	{
+		const Domain &box = boxes[p];
+		std::string name = fname_root + "_";
+		if (planes[p].position < 0)
+		{
+			name += std::string("mip_") + planes[p].axis;
+		}
+		else
+		{
+			std::string number = std::to_string(planes[p].position);
+			name += planes[p].axis + std::string(number.size() < 4 ? 4 - number.size() : 0, '0') + number;
+		}
+
+		// VTK's order is i fastest
+		std::vector<MappedVtiFile::Array> arrays(1, MappedVtiFile::Array("MaterialType", VtkTypeName<T>(), box.extent.size() * sizeof(T)));
+		MappedVtiFile vti(name + ".vti", box, cell_data, arrays);
+		T *out = vti.data<T>(0);
+		const Strides<ZFastest> image(box);
+		const Strides<XFastest> vtk(box);
+		for (int i = box.origin.i; i < box.origin.i + box.extent.i; ++i)
+		{
+			for (int j = box.origin.j; j < box.origin.j + box.extent.j; ++j)
+			{
+				for (int k = box.origin.k; k < box.origin.k + box.extent.k; ++k)
+					out[vtk.offset(i, j, k)] = images[p][image.offset(i, j, k)];
+			}
+		}
+		vti.close();
+
+		// the image's rows are its second fastest direction in file order
+		int width = planes[p].axis == 'x' ? box.extent.j : box.extent.k;
+		int height = planes[p].axis == 'z' ? box.extent.j : box.extent.i;
+		WritePgm(name + ".pgm", images[p].data(), sizeof(T), width, height);
+
+		written.push_back(name + ".vti");
+		written.push_back(name + ".pgm");
+	}
+	return written;
+}
+
+#endif /* MPIPREVIEWEXTRACTOR_H_ */
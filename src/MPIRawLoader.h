@@ -6,30 +6,95 @@
 #include <stdexcept>
 #include <memory>
 #include <algorithm>
+#include <vector>
+#include <atomic>
+#include <cstring>
 #include "MPIDomain.h"
+#include "CompressedInput.h"
+#include "XXHash64.h"
+#include "LabelRemap.h"
+#include "SliceStack.h"
 
 /*
  * Class which loads distinct segments of a RAW voxel
- * image into memory on each process. The class does not
- * actually call any MPI routines as the file is read
- * on each process rather than sending data.
+ * image into memory on each process. For uncompressed and
+ * seekable zstd files no MPI routines are called as the file
+ * is read on each process rather than sending data. Other
+ * compressed files can only be decompressed sequentially, so
+ * the root process decompresses them and sends each process
+ * the part it needs (see collectiveRead()). A volume stored as a
+ * stack of 2D slice files is read by opening only the slices of the
+ * process's slab (see setSlices()).
  */
 template <typename T, int Padding, IndexScheme S>
 class MPIRawLoader : public MPIDomain<T, Padding, S>
 {
 public:
-	MPIRawLoader(std::string fname);
+	MPIRawLoader(std::string fname = "");
 	virtual ~MPIRawLoader();
 
+	void setFile(const std::string &fname);
+	void setSlices(const std::vector<std::string> &slices);
+	void setThreads(int threads);
+	bool collectiveRead() const;
 	void read(size_t header);
 
+	// Renumbers the labels as they are read
+	void setRemap(const LabelRemap<T> &remap);
+
 private:
+	void readRaw(size_t header);
+	void readStreamed(size_t header);
+	void readFrames(size_t header, const std::vector<ZstdFrame> &frames);
+	void readSlices(size_t header);
+
+	unsigned long long rangeBegin();
+	unsigned long long rangeEnd();
+	void placeFileRange(const char *bytes, unsigned long long first_byte, size_t num_bytes);
+	void placeFileRange(const char *bytes, unsigned long long first_byte, size_t num_bytes, std::vector<T> &remapped);
+	void remapInPlace(char *bytes, unsigned long long first_byte, size_t num_bytes);
+
 	std::string fname;
+	std::vector<std::string> slices; // one file per plane of constant i, if not empty
+	int threads;
+
+	LabelRemap<T> remap;
+	std::vector<T> remapped_row; // a file row after remapping, see placeFileRange
 };
 
+/**
+ * @brief Hashes a box of a domain's voxels in the order of the RAW file (i slowest, k fastest).
+ * @details Gives the same hash as hashing the file's bytes of the box, whatever the index scheme.
+ * @param box The voxels to hash, within the padded region.
+ */
+template <typename T, int Padding, IndexScheme S>
+uint64_t HashInFileOrder(MPIDomain<T, Padding, S> &dom, const Domain &box)
+{
+	XXHash64 hash;
+	if (S == ZFastest)
+	{
+		dom.forEachSpan(box, [&](const Span<T> &span)
+		{
+			hash.update(span.data, span.length * sizeof(T));
+		});
+	}
+	else
+	{
+		// gather each file row, which runs across the rows in memory
+		std::vector<T> row(box.extent.k);
+		ForEachSpan<ZFastest>(box, 0, [&](const int3 &start, size_t length)
+		{
+			for (size_t n = 0; n < length; ++n)
+				row[n] = dom(start.i, start.j, start.k + (int)n);
+			hash.update(row.data(), length * sizeof(T));
+		});
+	}
+	return hash.digest();
+}
+
 template <typename T, int Padding, IndexScheme S>
 MPIRawLoader<T, Padding, S>::MPIRawLoader(std::string fname)
-	: fname(fname)
+	: fname(fname), threads(1)
 {
 }
 
@@ -38,42 +103,540 @@ MPIRawLoader<T, Padding, S>::~MPIRawLoader()
 {
 }
 
+/**
+ * @brief Changes the file read by the next call to read().
+ * @details Allows the same loader (and its storage) to be reused for a series of files
+ * with identical dimensions.
+ * @param fname_in The path to the .raw file.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::setFile(const std::string &fname_in)
+{
+	fname = fname_in;
+	slices.clear();
+}
+
+/**
+ * @brief Makes the next call to read() read a stack of slice files instead of a single file.
+ * @param slices_in The slice files from the lowest i (z) to the highest, see ExpandSlicePattern.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::setSlices(const std::vector<std::string> &slices_in)
+{
+	slices = slices_in;
+	fname = slices.empty() ? "" : slices[0];
+}
+
+/**
+ * @brief Sets the number of threads used to decompress seekable zstd files and read slices.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::setThreads(int threads_in)
+{
+	threads = std::max(1, threads_in);
+}
+
+/**
+ * @brief Sets the labels to renumber while reading (an empty remap turns it off).
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::setRemap(const LabelRemap<T> &remap_in)
+{
+	remap = remap_in;
+}
+
+/**
+ * @brief Whether read() communicates with other processes.
+ * @details If so, read() must be called by all processes at the same time and from the
+ * thread which initialised MPI.
+ */
+template <typename T, int Padding, IndexScheme S>
+bool MPIRawLoader<T, Padding, S>::collectiveRead() const
+{
+	if (!slices.empty())
+		return false;
+
+	std::vector<ZstdFrame> frames;
+	switch (DetectCompression(fname))
+	{
+	case Uncompressed:
+		return false;
+	case Zstd:
+		return !ReadZstdSeekTable(fname, frames);
+	default:
+		return true;
+	}
+}
+
+/**
+ * @brief Reads a designated segment of a (possibly compressed) binary .raw file into memory.
+ * @details The compression is detected from the file contents. Compressed files are checked
+ * against the expected decompressed size. Slice stacks (see setSlices) are read uncompressed.
+ * @param header The size of the file header (or of each raw slice's header) in bytes to skip
+ * before reading voxel data.
+ * @throws std::runtime_error if the file cannot be read or has the wrong decompressed size.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::read(size_t header)
+{
+	std::vector<ZstdFrame> frames;
+	switch (slices.empty() ? DetectCompression(fname) : Uncompressed)
+	{
+	case Uncompressed:
+		if (!slices.empty())
+			readSlices(header);
+		else
+			readRaw(header);
+		break;
+	case Zstd:
+		if (ReadZstdSeekTable(fname, frames))
+		{
+			readFrames(header, frames);
+			break;
+		}
+		readStreamed(header);
+		break;
+	case Gzip:
+		readStreamed(header);
+		break;
+	}
+}
+
 /**
  * @brief Reads a designated segment of a binary .raw file into memory.
  * @details Each MPI process opens the same file but only reads and stores the
- * portion of the data corresponding to its assigned local domain.
+ * portion of the data corresponding to its assigned padded domain.
  * @param header The size of the file header in bytes to skip before reading voxel data.
- * @throws std::runtime_error if the file cannot be opened.
+ * @throws std::runtime_error if the file cannot be opened or read.
  */
 template <typename T, int Padding, IndexScheme S>
-void MPIRawLoader<T, Padding, S>::read(size_t header)
+void MPIRawLoader<T, Padding, S>::readRaw(size_t header)
 {
 	std::ifstream fin(fname.c_str(), std::ios::binary);
 
 	// check file opened okay
 	if (!fin.is_open())
-		throw std::runtime_error("Cannot open file!");
-
-	// skip header
-	fin.seekg(header);
-
-	// read the file, ignoring parts we are not interested in
-	// (there might be a quicker way of doing this by reading
-	//  whole chunks at a time rather than each number individually)
-	T tmp;
-	for (int i = 0; i < global.extent.i; i++)
-		for (int j = 0; j < global.extent.j; j++)
-			for (int k = 0; k < global.extent.k; k++)
+		throw std::runtime_error("Cannot open file " + fname + "!");
+
+	// the file is ordered with i slowest and k fastest
+	const Strides<ZFastest> file(global.origin, global.extent);
+	const Domain &p = this->padded;
+
+	if (S == ZFastest)
+	{
+		// runs which are contiguous both in the file and in memory are read in one go
+		// (in chunks, which are remapped while they are still in the cache)
+		const size_t chunk = 4 << 20;
+		int contiguity = std::min(file.contiguity(p), this->strides.contiguity(p));
+		ForEachSpan<S>(p, contiguity, [&](const int3 &start, size_t length)
+		{
+			char *dst = (char *)&(*this)(start.i, start.j, start.k);
+			size_t bytes = length * sizeof(T);
+			fin.seekg(header + file.offset(start.i, start.j, start.k) * sizeof(T));
+			if (remap.empty())
+			{
+				fin.read(dst, bytes);
+				return;
+			}
+			for (size_t done = 0; done < bytes; done += chunk)
 			{
-				fin.read((char *)&tmp, (std::streamsize)sizeof(T));
+				size_t n = std::min(chunk, bytes - done);
+				fin.read(dst + done, n);
+				remap.apply((T *)(dst + done), (T *)(dst + done), n / sizeof(T));
+			}
+		});
+	}
+	else
+	{
+		// rows run along different directions in the file and in memory
+		std::vector<char> row(p.extent.k * sizeof(T));
+		ForEachSpan<ZFastest>(p, 0, [&](const int3 &start, size_t length)
+		{
+			unsigned long long first_byte = file.offset(start.i, start.j, start.k) * sizeof(T);
+			fin.seekg(header + first_byte);
+			fin.read(row.data(), length * sizeof(T));
+			placeFileRange(row.data(), first_byte, length * sizeof(T));
+		});
+	}
 
-				Index idx(i, j, k);
+	if (!fin)
+		throw std::runtime_error("Error reading file " + fname + "!");
+}
 
-				if (idx.valid(*this))
+/**
+ * @brief First byte (after the header) of the file which falls into the padded domain.
+ * @details The file is ordered with i slowest and k fastest.
+ */
+template <typename T, int Padding, IndexScheme S>
+unsigned long long MPIRawLoader<T, Padding, S>::rangeBegin()
+{
+	const Domain &p = this->padded;
+	return (((unsigned long long)p.origin.i * global.extent.j + p.origin.j) * global.extent.k + p.origin.k) * sizeof(T);
+}
+
+/**
+ * @brief One past the last byte (after the header) of the file which falls into the padded domain.
+ */
+template <typename T, int Padding, IndexScheme S>
+unsigned long long MPIRawLoader<T, Padding, S>::rangeEnd()
+{
+	const Domain &p = this->padded;
+	int3 last(p.origin.i + p.extent.i - 1, p.origin.j + p.extent.j - 1, p.origin.k + p.extent.k - 1);
+	return (((unsigned long long)last.i * global.extent.j + last.j) * global.extent.k + last.k + 1) * sizeof(T);
+}
+
+/**
+ * @brief Stores the voxels of a contiguous range of the file which fall into the padded domain.
+ * @param bytes The file contents of the range.
+ * @param first_byte The position of the range in the file (after the header), a multiple of sizeof(T).
+ * @param num_bytes The length of the range, a multiple of sizeof(T).
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::placeFileRange(const char *bytes, unsigned long long first_byte, size_t num_bytes)
+{
+	placeFileRange(bytes, first_byte, num_bytes, remapped_row);
+}
+
+/**
+ * @brief placeFileRange() with the caller's buffer for remapped rows, so threads can place ranges concurrently.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::placeFileRange(const char *bytes, unsigned long long first_byte, size_t num_bytes, std::vector<T> &remapped)
+{
+	const Domain &p = this->padded;
+	unsigned long long first = first_byte / sizeof(T);
+	unsigned long long last = first + num_bytes / sizeof(T);
+
+	// walk the range one file row (constant i and j) at a time
+	unsigned long long f = first;
+	while (f < last)
+	{
+		int k0 = f % global.extent.k;
+		int j = (f / global.extent.k) % global.extent.j;
+		int i = f / ((unsigned long long)global.extent.k * global.extent.j);
+		int k1 = std::min((unsigned long long)global.extent.k, k0 + (last - f));
+
+		if (i >= p.origin.i && i < p.origin.i + p.extent.i && j >= p.origin.j && j < p.origin.j + p.extent.j)
+		{
+			int kb = std::max(k0, p.origin.k);
+			int ke = std::min(k1, p.origin.k + p.extent.k);
+			if (kb < ke)
+			{
+				// the voxels kb .. ke of the row, remapped as a whole (rather than per span)
+				const char *row = bytes + (f - first + kb - k0) * sizeof(T);
+				if (!remap.empty())
+				{
+					remapped.resize(ke - kb);
+					remap.apply((const T *)row, remapped.data(), ke - kb);
+					row = (const char *)remapped.data();
+				}
+
+				// a single span for ZFastest, one per voxel for XFastest
+				this->forEachSpan(Domain(int3(i, j, kb), int3(1, 1, ke - kb)), [row, kb](const Span<T> &span)
+				{
+					std::memcpy(span.data, row + (span.start.k - kb) * sizeof(T), span.length * sizeof(T));
+				});
+			}
+		}
+		f += k1 - k0;
+	}
+}
+
+/**
+ * @brief Reads a compressed file which can only be decompressed sequentially.
+ * @details The root process decompresses the file chunk by chunk and sends every process
+ * the part of each chunk which falls into its padded domain, while decompressing the next
+ * chunk. The decompressed size is counted on the root and checked on all processes.
+ * Must be called by all processes.
+ * @param header The size of the (decompressed) file header in bytes.
+ * @throws std::runtime_error if the decompressed size does not match the domain.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::readStreamed(size_t header)
+{
+	const int tag = 10;
+	const size_t chunk_size = (size_t(4) << 20) / sizeof(T) * sizeof(T);
+	const int rank = MPIDetails::Rank();
+	const int comm_size = MPIDetails::CommSize();
+
+	unsigned long long range[2] = {rangeBegin(), rangeEnd()};
+	std::vector<unsigned long long> ranges(2 * comm_size);
+	MPI_Gather(range, 2, MPI_UNSIGNED_LONG_LONG, ranges.data(), 2, MPI_UNSIGNED_LONG_LONG, 0, MPIDetails::Comm());
+
+	unsigned long long total = 0;
+	if (rank == 0)
+	{
+		std::unique_ptr<DecompressionStream> stream = OpenDecompressionStream(fname);
+		bool header_ok = stream->skip(header) == header;
+
+		// two chunks so that one can be decompressed while the other is being sent
+		std::vector<char> chunks[2] = {std::vector<char>(chunk_size), std::vector<char>(chunk_size)};
+		std::vector<MPI_Request> reqs[2];
+		int b = 0;
+		while (header_ok)
+		{
+			MPI_Waitall(reqs[b].size(), reqs[b].data(), MPI_STATUSES_IGNORE);
+			reqs[b].clear();
+
+			size_t n = stream->read(chunks[b].data(), chunk_size);
+			if (n == 0)
+				break;
+
+			for (int p = 0; p < comm_size; ++p)
+			{
+				unsigned long long lo = std::max(total, ranges[2 * p]);
+				unsigned long long hi = std::min(total + n, ranges[2 * p + 1]);
+				if (lo >= hi)
+					continue;
+
+				if (p == 0)
+				{
+					placeFileRange(&chunks[b][lo - total], lo, hi - lo);
+				}
+				else
+				{
+					reqs[b].push_back(MPI_Request());
+					MPI_Isend(&chunks[b][lo - total], hi - lo, MPI_BYTE, p, tag, MPIDetails::Comm(), &reqs[b].back());
+				}
+			}
+			total += n;
+			b = 1 - b;
+		}
+		MPI_Waitall(reqs[0].size(), reqs[0].data(), MPI_STATUSES_IGNORE);
+		MPI_Waitall(reqs[1].size(), reqs[1].data(), MPI_STATUSES_IGNORE);
+
+		// tell processes whose part lies beyond the end of a short file to stop waiting
+		for (int p = 1; p < comm_size; ++p)
+		{
+			if (ranges[2 * p + 1] > total)
+				MPI_Send(NULL, 0, MPI_BYTE, p, tag, MPIDetails::Comm());
+		}
+
+		if (!header_ok)
+			total = 0;
+	}
+	else
+	{
+		std::vector<char> chunk(chunk_size);
+		unsigned long long received = range[0];
+		while (received < range[1])
+		{
+			MPI_Status status;
+			int count;
+			MPI_Recv(chunk.data(), chunk_size, MPI_BYTE, 0, tag, MPIDetails::Comm(), &status);
+			MPI_Get_count(&status, MPI_BYTE, &count);
+			if (count == 0)
+				break;
+
+			placeFileRange(chunk.data(), received, count);
+			received += count;
+		}
+	}
+
+	MPI_Bcast(&total, 1, MPI_UNSIGNED_LONG_LONG, 0, MPIDetails::Comm());
+	unsigned long long expected = (unsigned long long)global.extent.size() * sizeof(T);
+	if (total != expected)
+	{
+		std::stringstream msg;
+		msg << "Decompressed size does not match specified domain dimensions." << std::endl;
+		msg << "\tDecompressed data size: " << total << " bytes (after a " << header << " byte header)." << std::endl;
+		msg << "\tExpected data size: " << expected << " bytes.";
+		throw std::runtime_error(msg.str());
+	}
+}
+
+/**
+ * @brief Reads a seekable zstd file by decompressing only the frames covering the padded domain.
+ * @details The frames are decompressed by the pinned workers of Threads, straight into the
+ * domain's storage when it has the same layout as the file. No MPI routines are called.
+ * @param header The size of the (decompressed) file header in bytes.
+ * @param frames The seek table of the file.
+ * @throws std::runtime_error if the decompressed size does not match the domain.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::readFrames(size_t header, const std::vector<ZstdFrame> &frames)
+{
+	unsigned long long total = frames.empty() ? 0 : frames.back().decompressed_offset + frames.back().decompressed_size;
+	unsigned long long expected = (unsigned long long)global.extent.size() * sizeof(T);
+	if (total != header + expected)
+	{
+		std::stringstream msg;
+		msg << "Decompressed size does not match specified domain dimensions." << std::endl;
+		msg << "\tDecompressed file size: " << total << " bytes (including a " << header << " byte header)." << std::endl;
+		msg << "\tExpected data size: " << expected << " bytes.";
+		throw std::runtime_error(msg.str());
+	}
+
+	const unsigned long long begin = header + rangeBegin();
+	const unsigned long long end = header + rangeEnd();
+
+	// the padded domain of a ZFastest slab is exactly the file range, so decompress in place
+	std::vector<char> scratch;
+	char *dst;
+	if (S == ZFastest && end - begin == (unsigned long long)this->padded.extent.size() * sizeof(T))
+	{
+		dst = (char *)MPIDomain<T, Padding, S>::data.get();
+	}
+	else
+	{
+		scratch.resize(end - begin);
+		dst = scratch.data();
+	}
+
+	std::vector<const ZstdFrame *> needed;
+	for (size_t f = 0; f < frames.size(); ++f)
+	{
+		if (frames[f].decompressed_offset < end && frames[f].decompressed_offset + frames[f].decompressed_size > begin)
+			needed.push_back(&frames[f]);
+	}
+
+	// the frames differ in size, so each worker of the pool takes the next one when it is free
+	std::atomic<size_t> next(0);
+	Threads::ParallelFor(threads, [&](size_t, size_t)
+	{
+		std::vector<char> partial;
+		for (size_t n = next++; n < needed.size(); n = next++)
+		{
+			const ZstdFrame &frame = *needed[n];
+			unsigned long long lo = std::max(begin, frame.decompressed_offset);
+			unsigned long long hi = std::min(end, frame.decompressed_offset + frame.decompressed_size);
+
+			if (lo == frame.decompressed_offset && hi == frame.decompressed_offset + frame.decompressed_size)
+			{
+				DecompressZstdFrame(fname, frame, dst + (lo - begin));
+			}
+			else
+			{
+				// frame sticks out of our range: decompress aside and keep the overlap
+				partial.resize(frame.decompressed_size);
+				DecompressZstdFrame(fname, frame, partial.data());
+				std::memcpy(dst + (lo - begin), partial.data() + (lo - frame.decompressed_offset), hi - lo);
+			}
+
+			// in place, remap while the frame is in the cache (scratch is remapped when placed)
+			if (scratch.empty())
+				remapInPlace(dst + (lo - begin), lo - begin, hi - lo);
+		}
+	});
+
+	if (!scratch.empty())
+	{
+		placeFileRange(scratch.data(), begin - header, end - begin);
+	}
+	else if (!remap.empty() && sizeof(T) > 1)
+	{
+		// voxels split between two frames were left to here
+		for (size_t n = 0; n < needed.size(); ++n)
+		{
+			unsigned long long boundary = needed[n]->decompressed_offset;
+			if (boundary > begin && boundary < end && (boundary - begin) % sizeof(T) != 0)
+			{
+				T *voxel = (T *)(dst + (boundary - begin) / sizeof(T) * sizeof(T));
+				remap.apply(voxel, voxel, 1);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Reads the slices of a stack which fall into the padded domain.
+ * @details Each slice file is one plane of constant i of the RAW file's layout. The slices
+ * are shared out among the pinned workers of Threads, each of which reads only the rows (and, if the
+ * domain does not span the whole width, the columns) of the padded domain from its slices,
+ * and places them in the domain's storage. No MPI routines are called.
+ * @param header The size of the header of each raw slice in bytes (TIFF slices locate their
+ * rows themselves).
+ * @throws std::runtime_error if a slice cannot be read or does not match the x and y extents.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::readSlices(size_t header)
+{
+	if ((int)slices.size() != global.extent.i)
+		throw std::runtime_error("Expected " + std::to_string(global.extent.i) + " slice files, got " + std::to_string(slices.size()) + ".");
+
+	const Strides<ZFastest> file(global.origin, global.extent);
+	const Domain &p = this->padded;
+	const int width = global.extent.k, height = global.extent.j;
+	const size_t row_bytes = (size_t)width * sizeof(T);
+	const size_t span_bytes = (size_t)p.extent.k * sizeof(T);
+	const int first_row = p.origin.j - global.origin.j, end_row = first_row + p.extent.j;
+	const int first_column = p.origin.k - global.origin.k;
+	const bool whole_rows = p.extent.k == width;
+
+	// slices differ in how long they take to read (e.g. cached or not), so each worker of the pool takes
+	// the next one when it is free
+	std::atomic<int> next(0);
+	Threads::ParallelFor(threads, [&](size_t, size_t)
+	{
+		std::vector<char> block;
+		std::vector<T> remapped;
+		for (int n = next++; n < p.extent.i; n = next++)
+		{
+			const int i = p.origin.i + n;
+			const std::string &slice = slices[i - global.origin.i];
+			SliceLayout layout = ReadSliceLayout(slice, width, height, sizeof(T), header);
+			std::ifstream fin(slice.c_str(), std::ios::binary);
+			if (!fin.is_open())
+				throw std::runtime_error("Cannot open slice file " + slice + "!");
+
+			for (size_t s = 0; s < layout.strips.size(); ++s)
+			{
+				const SliceStrip &strip = layout.strips[s];
+				int lo = std::max(first_row, strip.first_row);
+				int hi = std::min(end_row, strip.first_row + strip.num_rows);
+				if (lo >= hi)
+					continue;
+
+				// the rows lo .. hi of the strip, whole or just the domain's columns
+				block.resize((hi - lo) * span_bytes);
+				if (whole_rows)
+				{
+					fin.seekg(strip.offset + (lo - strip.first_row) * row_bytes);
+					fin.read(block.data(), block.size());
+				}
+				for (int r = lo; r < hi && !whole_rows; ++r)
+				{
+					fin.seekg(strip.offset + (r - strip.first_row) * row_bytes + first_column * sizeof(T));
+					fin.read(&block[(r - lo) * span_bytes], span_bytes);
+				}
+				if (!fin)
+					throw std::runtime_error("Error reading slice file " + slice + "!");
+				if (layout.swap_bytes)
+					SwapVoxelBytes(block.data(), block.size(), sizeof(T));
+
+				if (whole_rows)
 				{
-					MPIDomain<T, Padding, S>::data[idx.arrayId(this->padded)] = tmp;
+					placeFileRange(block.data(), file.offset(i, global.origin.j + lo, global.origin.k) * sizeof(T), block.size(), remapped);
+					continue;
 				}
+				for (int r = lo; r < hi; ++r)
+					placeFileRange(&block[(r - lo) * span_bytes], file.offset(i, global.origin.j + r, p.origin.k) * sizeof(T), span_bytes, remapped);
 			}
+		}
+	});
+}
+
+/**
+ * @brief Remaps the whole voxels of a range of the domain's storage.
+ * @details The range may start or end inside a voxel (frames of compressed files do not
+ * respect voxel boundaries); the voxels it only partly covers are left unchanged.
+ * @param bytes The start of the range.
+ * @param first_byte The position of the range in the storage.
+ * @param num_bytes The length of the range.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPIRawLoader<T, Padding, S>::remapInPlace(char *bytes, unsigned long long first_byte, size_t num_bytes)
+{
+	if (remap.empty())
+		return;
+
+	unsigned long long first = (first_byte + sizeof(T) - 1) / sizeof(T);
+	unsigned long long last = (first_byte + num_bytes) / sizeof(T);
+	if (first < last)
+	{
+		T *voxels = (T *)(bytes + (first * sizeof(T) - first_byte));
+		remap.apply(voxels, voxels, last - first);
+	}
 }
 
 #endif /* RAWLOADERMPI_H_ */
@@ -0,0 +1 @@
+#include "MPIRedistributor.h"
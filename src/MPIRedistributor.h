@@ -0,0 +1,419 @@
+#ifndef MPIREDISTRIBUTOR_H_
+#define MPIREDISTRIBUTOR_H_
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <functional>
+#include <mpi.h>
+#include "MPIDetails.h"
+#include "MPIDomain.h"
+
+/*
+ * Class which moves distributed data from one decomposition (and index
+ * scheme) to another, e.g. from the slabs which are contiguous in the RAW
+ * file to the 3D blocks preferred for output or analysis.
+ *
+ * Every process owns a box of the source decomposition and asks for a box
+ * of the target decomposition. Target boxes may overlap each other (e.g.
+ * to include padding), every voxel of a target box is filled from the
+ * process owning it in the source. The plan of who sends which box to
+ * whom is set up once and can then be used for any number of transfers.
+ *
+ * Each box is described by a derived datatype addressing the voxels in
+ * place, both sides walking it in the source's layout order, so neither
+ * side packs into a separate buffer and a change of index scheme is done
+ * by MPI during the transfer. A packed source (see MPIDomain::pack) is sent
+ * packed instead, each plane of a box (along the slowest direction of the
+ * source) starting on a byte boundary: a box of whole source planes is sent
+ * straight from the packed copy, others are packed into a buffer, and
+ * finish() unpacks each box received into the target as soon as it arrives.
+ *
+ * The target of start() may use a different index scheme than DstS, e.g. a
+ * view (see ViewSlab) of the VTK ordered arrays of a mapped file, which the
+ * boxes are then received straight into.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+class MPIRedistributor
+{
+public:
+	MPIRedistributor(const Domain &src_owned, const Domain &dst_box);
+	virtual ~MPIRedistributor();
+
+	// the messages of a transfer which has been started but not finished
+	struct Exchange
+	{
+		std::vector<MPI_Request> reqs;
+		std::vector<MPI_Datatype> types;
+		std::vector<std::vector<unsigned char> > buffers; // packed boxes
+		std::vector<std::function<void()> > unpacks; // by request, run once its packed box has arrived
+	};
+
+	template <typename T, int SrcPad, int DstPad>
+	void redistribute(MPIDomain<T, SrcPad, SrcS> &src, MPIDomain<T, DstPad, DstS> &dst, MPI_Datatype type);
+
+	// Split version of redistribute, so that other work can be done while the data is in flight
+	template <typename T, int SrcPad, int DstPad, IndexScheme S>
+	Exchange start(MPIDomain<T, SrcPad, SrcS> &src, MPIDomain<T, DstPad, S> &dst, MPI_Datatype type);
+	void finish(Exchange &exchange);
+
+	const std::vector<Domain> &sourceBoxes() const;
+	const std::vector<Domain> &targetBoxes() const;
+
+private:
+	// a box moved between this process and another one
+	struct Transfer
+	{
+		int rank;
+		Domain box;
+	};
+
+	template <IndexScheme S>
+	static MPI_Datatype BoxType(const Domain &box, const Strides<S> &strides, MPI_Datatype type);
+	template <typename T, int SrcPad, int DstPad, IndexScheme S>
+	void startPacked(MPIDomain<T, SrcPad, SrcS> &src, MPIDomain<T, DstPad, S> &dst, Exchange &exchange);
+	static int NumPlanes(const Domain &box);
+	static Domain BoxPlane(const Domain &box, int p);
+
+	std::vector<Domain> src_boxes; // owned source box of every process
+	std::vector<Domain> dst_boxes; // target box of every process
+
+	std::vector<Transfer> sends;
+	std::vector<Transfer> recvs;
+	Domain local; // the part this process keeps (copied without MPI)
+};
+
+/**
+ * @brief Plans the redistribution. Must be called by all processes.
+ * @param src_owned The box this process owns in the source decomposition (without padding).
+ * @param dst_box The box this process wants in the target decomposition (with any padding).
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+MPIRedistributor<SrcS, DstS>::MPIRedistributor(const Domain &src_owned, const Domain &dst_box)
+	: src_boxes(MPIDetails::CommSize()), dst_boxes(MPIDetails::CommSize())
+{
+	Domain mine[2] = {src_owned, dst_box};
+	std::vector<Domain> all(2 * MPIDetails::CommSize());
+	MPI_Allgather(mine, 2, MPI_DOMAIN, all.data(), 2, MPI_DOMAIN, MPIDetails::Comm());
+
+	for (int p = 0; p < MPIDetails::CommSize(); ++p)
+	{
+		src_boxes[p] = all[2 * p];
+		dst_boxes[p] = all[2 * p + 1];
+	}
+
+	// start with the next rank so that not every process sends to rank 0 first
+	for (int n = 1; n < MPIDetails::CommSize(); ++n)
+	{
+		int to = (MPIDetails::Rank() + n) % MPIDetails::CommSize();
+		int from = (MPIDetails::Rank() - n + MPIDetails::CommSize()) % MPIDetails::CommSize();
+
+		Transfer send = {to, Intersection(src_owned, dst_boxes[to])};
+		if (send.box.extent.size() > 0)
+			sends.push_back(send);
+
+		Transfer recv = {from, Intersection(src_boxes[from], dst_box)};
+		if (recv.box.extent.size() > 0)
+			recvs.push_back(recv);
+	}
+	local = Intersection(src_owned, dst_box);
+}
+
+template <IndexScheme SrcS, IndexScheme DstS>
+MPIRedistributor<SrcS, DstS>::~MPIRedistributor()
+{
+}
+
+template <IndexScheme SrcS, IndexScheme DstS>
+const std::vector<Domain> &MPIRedistributor<SrcS, DstS>::sourceBoxes() const
+{
+	return src_boxes;
+}
+
+template <IndexScheme SrcS, IndexScheme DstS>
+const std::vector<Domain> &MPIRedistributor<SrcS, DstS>::targetBoxes() const
+{
+	return dst_boxes;
+}
+
+/**
+ * @brief Builds a datatype for the voxels of a box inside an array, visited in source layout order.
+ * @details The datatype starts at the box's first voxel, see Strides::offset.
+ * @param box The voxels.
+ * @param strides The layout of the array holding them.
+ * @param type The datatype of a single voxel.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+template <IndexScheme S>
+MPI_Datatype MPIRedistributor<SrcS, DstS>::BoxType(const Domain &box, const Strides<S> &strides, MPI_Datatype type)
+{
+	MPI_Aint lb, size;
+	MPI_Type_get_extent(type, &lb, &size);
+
+	// counts and byte strides, fastest direction of the source layout first
+	int count[3];
+	MPI_Aint stride[3];
+	if (SrcS == ZFastest)
+	{
+		count[0] = box.extent.k, stride[0] = strides.sk * size;
+		count[1] = box.extent.j, stride[1] = strides.sj * size;
+		count[2] = box.extent.i, stride[2] = strides.si * size;
+	}
+	else
+	{
+		count[0] = box.extent.i, stride[0] = strides.si * size;
+		count[1] = box.extent.j, stride[1] = strides.sj * size;
+		count[2] = box.extent.k, stride[2] = strides.sk * size;
+	}
+
+	MPI_Datatype row, plane, box_type;
+	MPI_Type_create_hvector(count[0], 1, stride[0], type, &row);
+	MPI_Type_create_hvector(count[1], 1, stride[1], row, &plane);
+	MPI_Type_create_hvector(count[2], 1, stride[2], plane, &box_type);
+	MPI_Type_commit(&box_type);
+	MPI_Type_free(&row);
+	MPI_Type_free(&plane);
+	return box_type;
+}
+
+/**
+ * @brief Fills the target box of every process from the source decomposition.
+ * @details Must be called by all processes.
+ * @param src The source domain; the voxels it owns must be valid.
+ * @param dst The target domain; its padded region must be the target box given to the constructor.
+ * @param type The MPI datatype matching T.
+ * @throws std::runtime_error if the domains do not match the plan or the transfer fails.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+template <typename T, int SrcPad, int DstPad>
+void MPIRedistributor<SrcS, DstS>::redistribute(MPIDomain<T, SrcPad, SrcS> &src, MPIDomain<T, DstPad, DstS> &dst, MPI_Datatype type)
+{
+	Exchange exchange = start(src, dst, type);
+	finish(exchange);
+}
+
+/**
+ * @brief Starts filling the target box of every process from the source decomposition.
+ * @details All receives are posted before any send, and the part a process keeps is copied
+ * while the messages are in flight. Neither domain may be touched until finish() has been
+ * called. Several transfers may be in flight at once, as long as every process starts them
+ * in the same order. Must be called by all processes.
+ * @param src The source domain; the voxels it owns must be valid. If it is packed, every
+ * process' source must be packed with the same bits.
+ * @param dst The target domain, in any index scheme; its padded region must be the target box
+ * given to the constructor.
+ * @param type The MPI datatype matching T.
+ * @return The transfer to pass to finish().
+ * @throws std::runtime_error if the domains do not match the plan.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+template <typename T, int SrcPad, int DstPad, IndexScheme S>
+typename MPIRedistributor<SrcS, DstS>::Exchange MPIRedistributor<SrcS, DstS>::start(MPIDomain<T, SrcPad, SrcS> &src, MPIDomain<T, DstPad, S> &dst, MPI_Datatype type)
+{
+	const Domain &mine = dst_boxes[MPIDetails::Rank()];
+	if (!(dst.padded.origin == mine.origin && dst.padded.extent == mine.extent))
+		throw std::runtime_error("Target domain does not match the redistribution plan.");
+
+	Exchange exchange;
+	const int tag = 20;
+
+	if (src.isPacked())
+	{
+		startPacked(src, dst, exchange);
+	}
+	else
+	{
+		for (size_t n = 0; n < recvs.size(); ++n)
+		{
+			const Domain &box = recvs[n].box;
+			exchange.types.push_back(BoxType(box, dst.strides, type));
+			exchange.reqs.push_back(MPI_REQUEST_NULL);
+			MPI_Irecv(&dst(box.origin.i, box.origin.j, box.origin.k), 1, exchange.types.back(), recvs[n].rank, tag, MPIDetails::Comm(), &exchange.reqs.back());
+		}
+		for (size_t n = 0; n < sends.size(); ++n)
+		{
+			const Domain &box = sends[n].box;
+			exchange.types.push_back(BoxType(box, src.strides, type));
+			exchange.reqs.push_back(MPI_REQUEST_NULL);
+			MPI_Isend(&src(box.origin.i, box.origin.j, box.origin.k), 1, exchange.types.back(), sends[n].rank, tag, MPIDetails::Comm(), &exchange.reqs.back());
+		}
+	}
+
+	// the local part, row by row (whole spans when both layouts agree)
+	if (local.extent.size() > 0)
+	{
+		if (SrcS == S)
+		{
+			int contiguity = std::min(src.strides.contiguity(local), dst.strides.contiguity(local));
+			ForEachSpan<SrcS>(local, contiguity, [&](const int3 &start, size_t length)
+			{
+				std::memcpy(&dst(start.i, start.j, start.k), &src(start.i, start.j, start.k), length * sizeof(T));
+			});
+		}
+		else
+		{
+			dst.forEachRow(local, [&](const Span<T> &row)
+			{
+				for (size_t n = 0; n < row.length; ++n)
+				{
+					const int3 &s = row.start;
+					row.data[n] = S == ZFastest ? src(s.i, s.j, s.k + (int)n) : src(s.i + (int)n, s.j, s.k);
+				}
+			});
+		}
+	}
+
+	return exchange;
+}
+
+/**
+ * @brief The planes of a box along the slowest direction of the source layout.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+int MPIRedistributor<SrcS, DstS>::NumPlanes(const Domain &box)
+{
+	return SrcS == ZFastest ? box.extent.i : box.extent.k;
+}
+
+/**
+ * @brief Plane p of a box along the slowest direction of the source layout.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+Domain MPIRedistributor<SrcS, DstS>::BoxPlane(const Domain &box, int p)
+{
+	Domain plane = box;
+	if (SrcS == ZFastest)
+	{
+		plane.origin.i += p;
+		plane.extent.i = 1;
+	}
+	else
+	{
+		plane.origin.k += p;
+		plane.extent.k = 1;
+	}
+	return plane;
+}
+
+/**
+ * @brief Posts the messages of start() for a packed source, as packed planes.
+ * @details A send box spanning whole planes of the source is sent straight from its packed
+ * copy (see MPIDomain::packedPlanes); the planes of other boxes are packed from the voxels
+ * into a buffer. Received boxes are unpacked into the target by finish(), a plane at a time,
+ * each as soon as it has arrived.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+template <typename T, int SrcPad, int DstPad, IndexScheme S>
+void MPIRedistributor<SrcS, DstS>::startPacked(MPIDomain<T, SrcPad, SrcS> &src, MPIDomain<T, DstPad, S> &dst, Exchange &exchange)
+{
+	const int tag = 21;
+	const int bits = src.packedBits();
+
+	// the buffers are sized up front, as the messages point into them
+	exchange.buffers.resize(recvs.size() + sends.size());
+	for (size_t n = 0; n < recvs.size(); ++n)
+	{
+		const Domain &box = recvs[n].box;
+		const size_t plane_size = box.extent.size() / NumPlanes(box), plane_bytes = PackedBytes(plane_size, bits);
+		std::vector<unsigned char> &buffer = exchange.buffers[n];
+		buffer.resize(NumPlanes(box) * plane_bytes);
+		exchange.reqs.push_back(MPI_REQUEST_NULL);
+		MPI_Irecv(buffer.data(), (int)buffer.size(), MPI_BYTE, recvs[n].rank, tag, MPIDetails::Comm(), &exchange.reqs.back());
+
+		const unsigned char *packed = buffer.data();
+		exchange.unpacks.push_back([&dst, box, packed, plane_size, plane_bytes, bits]()
+		{
+			std::vector<T> scratch;
+			for (int p = 0; p < NumPlanes(box); ++p)
+			{
+				const Domain plane = BoxPlane(box, p);
+				const unsigned char *from = packed + p * plane_bytes;
+				if (SrcS == S && dst.strides.contiguity(plane) >= 1)
+				{
+					UnpackLabels(from, 0, plane_size, bits, &dst(plane.origin.i, plane.origin.j, plane.origin.k));
+					continue;
+				}
+
+				// the plane's rows, in source layout order, are scattered into the target
+				scratch.resize(plane_size);
+				UnpackLabels(from, 0, plane_size, bits, scratch.data());
+				const T *row = scratch.data();
+				ForEachSpan<SrcS>(plane, 0, [&](const int3 &s, size_t length)
+				{
+					for (size_t v = 0; v < length; ++v)
+					{
+						if (SrcS == ZFastest)
+							dst(s.i, s.j, s.k + (int)v) = row[v];
+						else
+							dst(s.i + (int)v, s.j, s.k) = row[v];
+					}
+					row += length;
+				});
+			}
+		});
+	}
+	for (size_t n = 0; n < sends.size(); ++n)
+	{
+		const Domain &box = sends[n].box;
+		const size_t plane_size = box.extent.size() / NumPlanes(box), plane_bytes = PackedBytes(plane_size, bits);
+		const unsigned char *planes = src.packedPlanes(box);
+		std::vector<unsigned char> &buffer = exchange.buffers[recvs.size() + n];
+		if (!planes)
+		{
+			// each plane is packed from its voxels, gathered from its rows if they are apart
+			std::vector<T> scratch;
+			buffer.resize(NumPlanes(box) * plane_bytes);
+			for (int p = 0; p < NumPlanes(box); ++p)
+			{
+				const Domain plane = BoxPlane(box, p);
+				const T *from = &src(plane.origin.i, plane.origin.j, plane.origin.k);
+				if (src.strides.contiguity(plane) < 1)
+				{
+					scratch.resize(plane_size);
+					T *to = scratch.data();
+					src.forEachRow(plane, [&](const Span<T> &row)
+					{
+						std::memcpy(to, row.data, row.length * sizeof(T));
+						to += row.length;
+					});
+					from = scratch.data();
+				}
+				PackLabels(from, plane_size, bits, buffer.data() + p * plane_bytes);
+			}
+			planes = buffer.data();
+		}
+		exchange.reqs.push_back(MPI_REQUEST_NULL);
+		MPI_Isend(planes, (int)(NumPlanes(box) * plane_bytes), MPI_BYTE, sends[n].rank, tag, MPIDetails::Comm(), &exchange.reqs.back());
+	}
+}
+
+/**
+ * @brief Waits for a transfer started by start() to complete.
+ * @details The messages are completed one at a time, and a packed box is unpacked into the
+ * target as soon as it has arrived, while the others are still in flight.
+ * @throws std::runtime_error if the transfer fails.
+ */
+template <IndexScheme SrcS, IndexScheme DstS>
+void MPIRedistributor<SrcS, DstS>::finish(Exchange &exchange)
+{
+	int status = MPI_SUCCESS;
+	for (size_t done = 0; done < exchange.reqs.size() && status == MPI_SUCCESS; ++done)
+	{
+		int n;
+		status = MPI_Waitany(exchange.reqs.size(), exchange.reqs.data(), &n, MPI_STATUS_IGNORE);
+		if (status == MPI_SUCCESS && n != MPI_UNDEFINED && n < (int)exchange.unpacks.size() && exchange.unpacks[n])
+			exchange.unpacks[n]();
+	}
+	for (size_t n = 0; n < exchange.types.size(); ++n)
+		MPI_Type_free(&exchange.types[n]);
+	exchange.reqs.clear();
+	exchange.types.clear();
+	exchange.unpacks.clear();
+	exchange.buffers.clear();
+
+	if (status != MPI_SUCCESS)
+		throw std::runtime_error("MPI error redistributing the domain.");
+}
+
+#endif /* MPIREDISTRIBUTOR_H_ */
@@ -0,0 +1 @@
+#include "MPISurfaceExtractor.h"
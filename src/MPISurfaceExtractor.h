@@ -0,0 +1,218 @@
+#ifndef MPISURFACEEXTRACTOR_H_
+#define MPISURFACEEXTRACTOR_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <vtkSmartPointer.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkPolyData.h>
+#include <vtkXMLPolyDataWriter.h>
+#include "MPIDomain.h"
+
+/*
+ * Class which extracts the boundary surface of a single material
+ * from the distributed domain as a set of voxel faces (two triangles
+ * per face). Each process only visits the voxels it owns and looks at
+ * neighbours through the padding layer, so a face shared by two
+ * processes is emitted exactly once: by the owner of the voxel that
+ * holds the material. The padding must be up to date (exchangePadding)
+ * before calling extract().
+ */
+template <typename T, int Padding, IndexScheme S>
+class MPISurfaceExtractor
+{
+public:
+	MPISurfaceExtractor(MPIDomain<T, Padding, S> &material_data);
+	virtual ~MPISurfaceExtractor();
+
+	void setCellData(bool cell_data);
+	void extract(T material);
+	void writeVtp(const std::string &fname);
+
+	size_t numTriangles() const;
+
+	static void WritePvtp(const std::string &fname_root, int num_pieces);
+
+private:
+	bool isMaterial(int i, int j, int k, T material);
+	vtkIdType corner(int i, int j, int k);
+	void addFace(int i0, int j0, int k0, int di1, int dj1, int dk1, int di2, int dj2, int dk2);
+
+	MPIDomain<T, Padding, S> &dom;
+
+	// position of a voxel's lower corner relative to its index
+	double corner_shift;
+
+	vtkSmartPointer<vtkPoints> points;
+	vtkSmartPointer<vtkCellArray> triangles;
+
+	// maps a local corner id onto its point id (only corners on the surface are stored)
+	std::unordered_map<long long, vtkIdType> corner_ids;
+};
+
+template <typename T, int Padding, IndexScheme S>
+MPISurfaceExtractor<T, Padding, S>::MPISurfaceExtractor(MPIDomain<T, Padding, S> &material_data)
+	: dom(material_data), corner_shift(-0.5)
+{
+}
+
+template <typename T, int Padding, IndexScheme S>
+MPISurfaceExtractor<T, Padding, S>::~MPISurfaceExtractor()
+{
+}
+
+/**
+ * @brief Matches the surface coordinates to the voxel convention of the .vti output.
+ * @details Point data voxels are centred on their index, cell data voxels start at it.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPISurfaceExtractor<T, Padding, S>::setCellData(bool cell_data)
+{
+	corner_shift = cell_data ? 0.0 : -0.5;
+}
+
+template <typename T, int Padding, IndexScheme S>
+bool MPISurfaceExtractor<T, Padding, S>::isMaterial(int i, int j, int k, T material)
+{
+	// everything outside of the global domain is treated as "not this material"
+	// so that surfaces are closed at the edges of the image
+	SubIndex<S> idx(i, j, k);
+	if (!idx.valid(global))
+		return false;
+
+	return dom[idx] == material;
+}
+
+/**
+ * @brief Returns the point id of a voxel corner, creating the point if it does not exist yet.
+ * @details Corner (i, j, k) is the lower corner of voxel (i, j, k), which sits half a voxel
+ * below the voxel centre in the point data convention (see setCellData).
+ */
+template <typename T, int Padding, IndexScheme S>
+vtkIdType MPISurfaceExtractor<T, Padding, S>::corner(int i, int j, int k)
+{
+	long long key = ((long long)(i - dom.origin.i) * (dom.extent.j + 1) + (j - dom.origin.j)) * (dom.extent.k + 1) + (k - dom.origin.k);
+
+	typename std::unordered_map<long long, vtkIdType>::iterator it = corner_ids.find(key);
+	if (it != corner_ids.end())
+		return it->second;
+
+	vtkIdType id = points->InsertNextPoint(i + corner_shift, j + corner_shift, k + corner_shift);
+	corner_ids[key] = id;
+	return id;
+}
+
+/**
+ * @brief Adds a quad as two triangles.
+ * @details The quad is spanned from corner (i0, j0, k0) by the two edge directions
+ * d1 and d2; the face normal is d1 x d2.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPISurfaceExtractor<T, Padding, S>::addFace(int i0, int j0, int k0, int di1, int dj1, int dk1, int di2, int dj2, int dk2)
+{
+	vtkIdType c[4];
+	c[0] = corner(i0, j0, k0);
+	c[1] = corner(i0 + di1, j0 + dj1, k0 + dk1);
+	c[2] = corner(i0 + di1 + di2, j0 + dj1 + dj2, k0 + dk1 + dk2);
+	c[3] = corner(i0 + di2, j0 + dj2, k0 + dk2);
+
+	vtkIdType tri[3];
+	tri[0] = c[0];
+	tri[1] = c[1];
+	tri[2] = c[2];
+	triangles->InsertNextCell(3, tri);
+	tri[1] = c[2];
+	tri[2] = c[3];
+	triangles->InsertNextCell(3, tri);
+}
+
+/**
+ * @brief Extracts the faces separating a material from everything else on this process.
+ * @details Faces are oriented so that their normals point out of the material.
+ * @param material The material label to extract.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPISurfaceExtractor<T, Padding, S>::extract(T material)
+{
+	points = vtkSmartPointer<vtkPoints>::New();
+	triangles = vtkSmartPointer<vtkCellArray>::New();
+	corner_ids.clear();
+
+	for (int i = dom.origin.i; i < (dom.origin.i + dom.extent.i); ++i)
+	{
+		for (int j = dom.origin.j; j < (dom.origin.j + dom.extent.j); ++j)
+		{
+			for (int k = dom.origin.k; k < (dom.origin.k + dom.extent.k); ++k)
+			{
+				if (!isMaterial(i, j, k, material))
+					continue;
+
+				if (!isMaterial(i - 1, j, k, material))
+					addFace(i, j, k, 0, 0, 1, 0, 1, 0);
+				if (!isMaterial(i + 1, j, k, material))
+					addFace(i + 1, j, k, 0, 1, 0, 0, 0, 1);
+				if (!isMaterial(i, j - 1, k, material))
+					addFace(i, j, k, 1, 0, 0, 0, 0, 1);
+				if (!isMaterial(i, j + 1, k, material))
+					addFace(i, j + 1, k, 0, 0, 1, 1, 0, 0);
+				if (!isMaterial(i, j, k - 1, material))
+					addFace(i, j, k, 0, 1, 0, 1, 0, 0);
+				if (!isMaterial(i, j, k + 1, material))
+					addFace(i, j, k + 1, 1, 0, 0, 0, 1, 0);
+			}
+		}
+	}
+}
+
+template <typename T, int Padding, IndexScheme S>
+size_t MPISurfaceExtractor<T, Padding, S>::numTriangles() const
+{
+	return triangles ? (size_t)triangles->GetNumberOfCells() : 0;
+}
+
+/**
+ * @brief Writes the surface extracted on this process to a .vtp piece file.
+ * @param fname The name of the .vtp file.
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPISurfaceExtractor<T, Padding, S>::writeVtp(const std::string &fname)
+{
+	vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+	polyData->SetPoints(points);
+	polyData->SetPolys(triangles);
+
+	vtkSmartPointer<vtkXMLPolyDataWriter> writer = vtkSmartPointer<vtkXMLPolyDataWriter>::New();
+	writer->SetFileName(fname.c_str());
+	writer->SetInputConnection(polyData->GetProducerPort());
+	writer->Write();
+}
+
+/**
+ * @brief Writes the master .pvtp file referencing the .vtp piece of every process.
+ * @param fname_root The base filename, pieces are expected at fname_root_<rank>.vtp.
+ * @param num_pieces The number of pieces (one per process).
+ */
+template <typename T, int Padding, IndexScheme S>
+void MPISurfaceExtractor<T, Padding, S>::WritePvtp(const std::string &fname_root, int num_pieces)
+{
+	std::ofstream fout((fname_root + ".pvtp").c_str());
+
+	fout << "<?xml version=\"1.0\"?>" << std::endl;
+	fout << "<VTKFile type=\"PPolyData\" version=\"0.1\">" << std::endl;
+	fout << "\t<PPolyData GhostLevel=\"0\">" << std::endl;
+	fout << "\t\t<PPoints>" << std::endl;
+	fout << "\t\t\t<PDataArray type=\"Float32\" NumberOfComponents=\"3\"/>" << std::endl;
+	fout << "\t\t</PPoints>" << std::endl;
+
+	std::string root_basename = fname_root.substr(fname_root.find_last_of("/\\") + 1);
+	for (int proc = 0; proc < num_pieces; ++proc)
+	{
+		fout << "\t\t<Piece Source=\"" << root_basename << "_" << proc << ".vtp\"/>" << std::endl;
+	}
+	fout << "\t</PPolyData>" << std::endl;
+	fout << "</VTKFile>" << std::endl;
+}
+
+#endif /* MPISURFACEEXTRACTOR_H_ */
@@ -0,0 +1,196 @@
+#include "MappedVtiFile.h"
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// every array (after its size header) starts on a multiple of this in the file
+static const size_t ARRAY_ALIGNMENT = 64;
+
+static size_t RoundUp(size_t n, size_t multiple)
+{
+	return (n + multiple - 1) / multiple * multiple;
+}
+
+static void ThrowFileError(const std::string &what, const std::string &fname)
+{
+	std::stringstream msg;
+	msg << "Cannot " << what << " " << fname << ": " << std::strerror(errno);
+	throw std::runtime_error(msg.str());
+}
+
+template <typename H>
+static void WriteSizeHeader(char *dst, size_t bytes)
+{
+	H size = (H)bytes;
+	std::memcpy(dst, &size, sizeof(size));
+}
+
+MappedVtiFile::Array::Array(const std::string &name, const std::string &type, size_t bytes)
+	: name(name), type(type), bytes(bytes)
+{
+}
+
+/**
+ * @brief Creates (or replaces) the file and maps its arrays.
+ * @param fname The .vti file name.
+ * @param piece The voxels of the piece. With point data they are the points of the grid,
+ * with cell data its cells (so the grid has one more point in each direction).
+ * @param cell_data Whether the arrays are cell rather than point data.
+ * @param arrays The arrays, each of piece.extent.size() values in VTK (i fastest) order.
+ * @throws std::runtime_error if the file cannot be created, sized or mapped.
+ */
+MappedVtiFile::MappedVtiFile(const std::string &fname, const Domain &piece, bool cell_data, const std::vector<Array> &arrays)
+	: fname(fname), fd(-1), map(NULL), map_size(0), size_header(0)
+{
+	std::string header, footer;
+	layout(piece, cell_data, arrays, int3(), int3(1, 1, 1), header, footer);
+
+	fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		ThrowFileError("create", fname);
+	if (ftruncate(fd, map_size) != 0)
+	{
+		::close(fd);
+		ThrowFileError("resize", fname);
+	}
+	void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		::close(fd);
+		ThrowFileError("map", fname);
+	}
+	map = (char *)p;
+
+	fill(arrays, header, footer);
+}
+
+/**
+ * @brief Builds the .vti in memory instead of a file, e.g. to send it elsewhere (see bytes()).
+ * @param piece See the file constructor.
+ * @param cell_data Whether the arrays are cell rather than point data.
+ * @param arrays The arrays, each of piece.extent.size() values in VTK (i fastest) order.
+ * @param origin Where the grid's index 0 lies, e.g. the first voxel of a subsampled box.
+ * @param spacing The distance between the grid's points, e.g. the step of a subsampled box.
+ */
+MappedVtiFile::MappedVtiFile(const Domain &piece, bool cell_data, const std::vector<Array> &arrays, const int3 &origin, const int3 &spacing)
+	: fd(-1), map(NULL), map_size(0), size_header(0)
+{
+	std::string header, footer;
+	layout(piece, cell_data, arrays, origin, spacing, header, footer);
+	memory.resize(map_size);
+	map = memory.data();
+	fill(arrays, header, footer);
+}
+
+/**
+ * @brief Lays out the file: its XML header and footer, its size and where each array starts.
+ */
+void MappedVtiFile::layout(const Domain &piece, bool cell_data, const std::vector<Array> &arrays, const int3 &origin, const int3 &spacing, std::string &header, std::string &footer)
+{
+	bool large = false;
+	for (size_t n = 0; n < arrays.size(); ++n)
+		large = large || arrays[n].bytes > UINT_MAX;
+	size_header = large ? sizeof(unsigned long long) : sizeof(unsigned int);
+
+	// offsets of the size headers, relative to the start of the appended data
+	std::vector<size_t> offsets(arrays.size());
+	size_t appended_size = 0;
+	for (size_t n = 0; n < arrays.size(); ++n)
+	{
+		offsets[n] = RoundUp(appended_size, ARRAY_ALIGNMENT);
+		appended_size = offsets[n] + size_header + arrays[n].bytes;
+	}
+
+	int last = cell_data ? 0 : 1;
+	std::stringstream extent;
+	extent << piece.origin.i << " " << piece.origin.i + piece.extent.i - last << " "
+		   << piece.origin.j << " " << piece.origin.j + piece.extent.j - last << " "
+		   << piece.origin.k << " " << piece.origin.k + piece.extent.k - last;
+	std::string attributes = cell_data ? "CellData" : "PointData";
+
+	std::stringstream xml;
+	xml << "<?xml version=\"1.0\"?>\n";
+	xml << "<VTKFile type=\"ImageData\" " << (large ? "version=\"1.0\" header_type=\"UInt64\"" : "version=\"0.1\"") << " byte_order=\"LittleEndian\">\n";
+	xml << "\t<ImageData WholeExtent=\"" << extent.str() << "\" Origin=\"" << origin.i << " " << origin.j << " " << origin.k
+		<< "\" Spacing=\"" << spacing.i << " " << spacing.j << " " << spacing.k << "\">\n";
+	xml << "\t\t<Piece Extent=\"" << extent.str() << "\">\n";
+	xml << "\t\t\t<" << attributes;
+	if (!arrays.empty())
+		xml << " Scalars=\"" << arrays[0].name << "\"";
+	xml << ">\n";
+	for (size_t n = 0; n < arrays.size(); ++n)
+		xml << "\t\t\t\t<DataArray type=\"" << arrays[n].type << "\" Name=\"" << arrays[n].name << "\" format=\"appended\" offset=\"" << offsets[n] << "\"/>\n";
+	xml << "\t\t\t</" << attributes << ">\n";
+	xml << "\t\t</Piece>\n";
+	xml << "\t</ImageData>\n";
+	xml << "\t<AppendedData encoding=\"raw\">\n";
+
+	// pad before the '_' which starts the appended data so the first array is aligned
+	header = xml.str();
+	size_t appended_start = RoundUp(header.size() + 1 + size_header, ARRAY_ALIGNMENT) - size_header;
+	header.append(appended_start - 1 - header.size(), ' ');
+	header.push_back('_');
+	footer = "\n\t</AppendedData>\n</VTKFile>\n";
+	map_size = appended_start + appended_size + footer.size();
+
+	data_offsets.clear();
+	for (size_t n = 0; n < arrays.size(); ++n)
+		data_offsets.push_back(appended_start + offsets[n] + size_header);
+}
+
+/**
+ * @brief Writes the header, footer and array sizes around the (still unwritten) arrays.
+ */
+void MappedVtiFile::fill(const std::vector<Array> &arrays, const std::string &header, const std::string &footer)
+{
+	std::memcpy(map, header.data(), header.size());
+	for (size_t n = 0; n < arrays.size(); ++n)
+	{
+		char *size_dst = map + data_offsets[n] - size_header;
+		if (size_header == sizeof(unsigned long long))
+			WriteSizeHeader<unsigned long long>(size_dst, arrays[n].bytes);
+		else
+			WriteSizeHeader<unsigned int>(size_dst, arrays[n].bytes);
+	}
+	std::memcpy(map + map_size - footer.size(), footer.data(), footer.size());
+}
+
+MappedVtiFile::~MappedVtiFile()
+{
+	if (map && fd >= 0)
+		munmap(map, map_size);
+	if (fd >= 0)
+		::close(fd);
+}
+
+/**
+ * @brief Returns the mapped values of an array, to be filled in VTK (i fastest) order.
+ */
+void *MappedVtiFile::data(size_t array)
+{
+	return map + data_offsets[array];
+}
+
+/**
+ * @brief Unmaps and closes the file, leaving the written data to the page cache.
+ * @throws std::runtime_error if the file cannot be unmapped or closed.
+ */
+void MappedVtiFile::close()
+{
+	if (fd < 0)
+		return;
+	if (map && munmap(map, map_size) != 0)
+		ThrowFileError("unmap", fname);
+	map = NULL;
+	if (fd >= 0 && ::close(fd) != 0)
+	{
+		fd = -1;
+		ThrowFileError("close", fname);
+	}
+	fd = -1;
+}
@@ -0,0 +1,105 @@
+#ifndef MAPPEDVTIFILE_H_
+#define MAPPEDVTIFILE_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "Domain.h"
+
+/*
+ * Writer of a VTK image data (.vti) piece whose arrays are memory
+ * mapped from the file itself. The small XML header is written by hand
+ * and the raw appended data is mapped, so callers copy the voxels
+ * straight into the page cache rather than into a VTK array which a
+ * vtkXMLImageDataWriter then serialises again.
+ *
+ * The arrays are stored uncompressed. Each one starts on a 64 byte
+ * boundary of the file, so the mapped arrays are aligned for any type.
+ * Arrays of 4 GiB or more need UInt64 size headers, which are only
+ * understood by VTK 6.3 (file version 1.0) and later.
+ *
+ * The same layout can be built in memory instead, for a .vti which is
+ * sent rather than written (see bytes()).
+ */
+class MappedVtiFile
+{
+public:
+	struct Array
+	{
+		Array(const std::string &name, const std::string &type, size_t bytes);
+
+		std::string name;
+		std::string type;
+		size_t bytes;
+	};
+
+	MappedVtiFile(const std::string &fname, const Domain &piece, bool cell_data, const std::vector<Array> &arrays);
+	MappedVtiFile(const Domain &piece, bool cell_data, const std::vector<Array> &arrays, const int3 &origin = int3(), const int3 &spacing = int3(1, 1, 1));
+	virtual ~MappedVtiFile();
+
+	void *data(size_t array);
+	template <typename T>
+	T *data(size_t array)
+	{
+		return (T *)data(array);
+	}
+
+	void close();
+
+	// the whole .vti, once its arrays are filled
+	const char *bytes() const
+	{
+		return map;
+	}
+	size_t size() const
+	{
+		return map_size;
+	}
+
+private:
+	MappedVtiFile(const MappedVtiFile &);
+	MappedVtiFile &operator=(const MappedVtiFile &);
+
+	void layout(const Domain &piece, bool cell_data, const std::vector<Array> &arrays, const int3 &origin, const int3 &spacing, std::string &header, std::string &footer);
+	void fill(const std::vector<Array> &arrays, const std::string &header, const std::string &footer);
+
+	std::string fname;
+	int fd;
+	char *map;
+	size_t map_size;
+	size_t size_header; // bytes of each array's size header
+	std::vector<size_t> data_offsets;
+	std::vector<char> memory; // the .vti when it is built in memory
+};
+
+/**
+ * @brief The name VTK's XML formats use for a voxel type.
+ */
+template <typename T>
+const char *VtkTypeName();
+
+template <>
+inline const char *VtkTypeName<unsigned char>()
+{
+	return "UInt8";
+}
+
+template <>
+inline const char *VtkTypeName<unsigned short>()
+{
+	return "UInt16";
+}
+
+template <>
+inline const char *VtkTypeName<unsigned int>()
+{
+	return "UInt32";
+}
+
+template <>
+inline const char *VtkTypeName<float>()
+{
+	return "Float32";
+}
+
+#endif /* MAPPEDVTIFILE_H_ */
@@ -4,49 +4,104 @@
 #include <sstream>
 #include <iomanip>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <climits>
 #include <sys/stat.h>
-#include <vtkSmartPointer.h>
-#include <vtkImageData.h>
-#include <vtkPointData.h>
-#include <vtkXMLImageDataWriter.h>
-#include <vtkUnsignedShortArray.h>
-#include <vtkUnsignedCharArray.h>
 #include "MPIDetails.h"
+#include "Threads.h"
+#ifdef USE_VTK
+#include "MPISurfaceExtractor.h"
+#endif
+#include "XXHash64.h"
+#include "MappedVtiFile.h"
+#include "SliceStack.h"
 
 using namespace std;
 
-Preprocessor::Preprocessor()
+/**
+ * @param comm The processes which share the work, all of which must construct the
+ * preprocessor together (e.g. a simulation's communicator when raw2vtk is used as a library).
+ */
+Preprocessor::Preprocessor(MPI_Comm comm)
 {
+    MPIDetails::AcquireComm(comm);
+    Domain::BuildMPIDataType();
+
     mpi_rank = MPIDetails::Rank();
     mpi_comm_size = MPIDetails::CommSize();
+    cell_data = false;
+    output_blocks = false;
+    io_aggregators = -1;
+    brick_size = 0;
+    my_piece = mpi_rank;
+    material_loaded = false;
+    shared_read = false;
+    node_leader = false;
+    incremental = false;
+    pack_bits = 0;
 }
 
-Preprocessor::~Preprocessor() {}
+Preprocessor::~Preprocessor()
+{
+    MPIDetails::ReleaseComm();
+}
 
 /**
  * @brief Decomposes the global domain among processes.
- * @details This template is specialised for different IndexScheme enums (e.g., ZFastest)
- * to perform a 1D decomposition along the appropriate axis (i.e. ZFastest implies decomposing along X axis,
- * XFastest implies decomposing along Z axis).
+ * @details A 1D decomposition along the slowest direction of the IndexScheme, so that each slab
+ * is contiguous in memory (i.e. ZFastest implies decomposing along X axis, XFastest implies
+ * decomposing along Z axis), see SlabDecomposition.
  */
-template <>
-void Preprocessor::decomposeDomain<ZFastest>()
+template <IndexScheme S>
+void Preprocessor::decomposeDomain()
 {
-    local_domain = global_domain;
-    int block_size = global_domain.extent.i / mpi_comm_size;
-    local_domain.origin.i = mpi_rank * block_size;
-
-    // This ensures the last process gets all remaining voxels
-    local_domain.extent.i = (mpi_rank == mpi_comm_size - 1) ? (global_domain.extent.i - local_domain.origin.i) : block_size;
+    local_domain = SlabDecomposition<S>(global_domain, mpi_rank, mpi_comm_size);
 }
 
-template <>
-void Preprocessor::decomposeDomain<XFastest>()
+/**
+ * @brief Assigns every process to the group of an I/O aggregator.
+ * @details Groups are runs of consecutive ranks, so that their slabs merge into one box. With
+ * num_aggregators = 0 each node is a group, unless the ranks of a node are not consecutive,
+ * in which case there is one group per node but the ranks are split evenly instead.
+ * @param num_aggregators The number of groups, or 0 for one per node.
+ * @return The group of every rank; the first rank of each group is its aggregator.
+ */
+static std::vector<int> AggregatorGroups(int num_aggregators, int mpi_rank, int mpi_comm_size)
 {
-    local_domain = global_domain;
-    int block_size = global_domain.extent.k / mpi_comm_size;
-    local_domain.origin.k = mpi_rank * block_size;
-    local_domain.extent.k = (mpi_rank == mpi_comm_size - 1) ? (global_domain.extent.k - local_domain.origin.k) : block_size;
+    std::vector<int> groups(mpi_comm_size);
+    if (num_aggregators == 0)
+    {
+        // Every rank learns the (world) rank of its node's first process
+        int leader = mpi_rank;
+        MPI_Bcast(&leader, 1, MPI_INT, 0, MPIDetails::NodeComm());
+        std::vector<int> leaders(mpi_comm_size);
+        MPI_Allgather(&leader, 1, MPI_INT, leaders.data(), 1, MPI_INT, MPIDetails::Comm());
+
+        bool consecutive = true;
+        groups[0] = 0;
+        for (int p = 1; p < mpi_comm_size; ++p)
+        {
+            groups[p] = groups[p - 1] + (leaders[p] != leaders[p - 1]);
+            consecutive = consecutive && (leaders[p] == leaders[p - 1] || leaders[p] == p);
+        }
+        if (consecutive)
+        {
+            return groups;
+        }
+        num_aggregators = 0;
+        for (int p = 0; p < mpi_comm_size; ++p)
+        {
+            num_aggregators += (leaders[p] == p);
+        }
+    }
+
+    num_aggregators = std::min(num_aggregators, mpi_comm_size);
+    for (int p = 0; p < mpi_comm_size; ++p)
+    {
+        groups[p] = (int)((long long)p * num_aggregators / mpi_comm_size);
+    }
+    return groups;
 }
 
 /**
@@ -59,11 +114,163 @@ void Preprocessor::setupDomain(int3 gextent)
     global_domain.extent = gextent;
 
     decomposeDomain<IDX_SCHEME>();
+    setupDomain(gextent, local_domain);
+}
+
+/**
+ * @brief Sets up the global domain with the slab of each process chosen by the caller.
+ * @details For a simulation which already holds its voxels decomposed into slabs along the
+ * slowest direction (i for ZFastest), so that setMaterialData can use them in place. Must be
+ * called by all processes.
+ * @param gextent The dimensions (i, j, k) of the entire dataset.
+ * @param local The slab of this process: the slabs must span the other two directions and
+ * follow each other in rank order.
+ * @throws std::runtime_error if the slabs do not tile the domain that way.
+ */
+void Preprocessor::setupDomain(int3 gextent, const Domain &local)
+{
+    global_domain.origin = int3();
+    global_domain.extent = gextent;
+    local_domain = local;
+    from_caller.reset();
 
     MPIDomain<double, 0, IDX_SCHEME>::SetGlobal(int3(), gextent);
     MPISubIndex<IDX_SCHEME>::Init(local_domain, mpi_rank, mpi_comm_size);
 
-    material_data.setup(local_domain.origin, local_domain.extent);
+    // every process checks all slabs, so all of them fail together
+    int next = 0;
+    for (int proc = 0; proc < mpi_comm_size; ++proc)
+    {
+        const Domain &slab = MPISubIndex<IDX_SCHEME>::all_local_domains[proc];
+        // the slab of this one's thickness after the slabs of the lower ranks
+        Domain expected = global_domain;
+        int &origin = IDX_SCHEME == ZFastest ? expected.origin.i : expected.origin.k;
+        int &extent = IDX_SCHEME == ZFastest ? expected.extent.i : expected.extent.k;
+        origin = next;
+        extent = IDX_SCHEME == ZFastest ? slab.extent.i : slab.extent.k;
+        if (!(slab.origin == expected.origin) || !(slab.extent == expected.extent) || extent < 0)
+        {
+            std::stringstream msg;
+            msg << "The domain of process " << proc << " (" << slab.origin << " + " << slab.extent << ") is not the next slab of " << gextent << ".";
+            throw std::runtime_error(msg.str());
+        }
+        next += extent;
+    }
+    if (next != (IDX_SCHEME == ZFastest ? gextent.i : gextent.k))
+    {
+        throw std::runtime_error("The slabs of the processes do not cover the domain.");
+    }
+
+    material_loaded = false;
+    if (shared_read)
+    {
+        // The node's window holds the padded slabs of all its processes, so padding planes
+        // shared with a neighbour on the same node are the neighbour's own voxels
+        material_data.setExtents(local_domain.origin, local_domain.extent);
+
+        MPI_Comm node_comm = MPIDetails::NodeComm();
+        int node_rank, node_size;
+        MPI_Comm_rank(node_comm, &node_rank);
+        MPI_Comm_size(node_comm, &node_size);
+        node_leader = node_rank == 0;
+
+        std::vector<Domain> node_slabs(node_size);
+        MPI_Allgather(&material_data.padded, 1, MPI_DOMAIN, node_slabs.data(), 1, MPI_DOMAIN, node_comm);
+        Domain node_box = node_slabs[0];
+        for (int n = 1; n < node_size; ++n)
+        {
+            node_box = BoundingBox(node_box, node_slabs[n]);
+        }
+
+        material_window.reset(new MPINodeWindow<RAWType, IDX_SCHEME>(node_box, node_comm));
+        read_window.reset();
+        SlabPtr<RAWType> view = material_window->view(material_data.padded);
+        material_data.take(view);
+        node_loader.setExtents(node_box.origin, node_box.extent, node_box);
+    }
+    else
+    {
+        // The material buffer is allocated by the first read (see startRawFileRead), or is
+        // the caller's (see setMaterialData); the loader gets its buffer when a read starts
+        material_data.setExtents(local_domain.origin, local_domain.extent);
+        loader.setExtents(local_domain.origin, local_domain.extent);
+    }
+
+    // Each piece is written from this process' slab, or from a block or group of slabs
+    // which the slabs are redistributed into
+    if (output_blocks && io_aggregators >= 0)
+    {
+        throw std::runtime_error("Output blocks cannot be combined with I/O aggregators.");
+    }
+    if (brick_size > 0 && (output_blocks || io_aggregators >= 0 || incremental))
+    {
+        throw std::runtime_error("Bricks cannot be combined with output blocks, I/O aggregators or incremental output.");
+    }
+    if (brick_size > 0)
+    {
+        // Brick n is written by rank n % size in round n / size
+        int3 grid = BrickGrid(brickTiling().extent, brick_size);
+        long long num_bricks = (long long)grid.i * grid.j * grid.k;
+        if (num_bricks > INT_MAX)
+        {
+            throw std::runtime_error("Too many bricks; use a larger brick size.");
+        }
+        piece_boxes.resize(num_bricks);
+        for (int n = 0; n < (int)num_bricks; ++n)
+        {
+            piece_boxes[n] = pieceBox(GridBrick(brickTiling(), brick_size, n));
+            const Domain &box = piece_boxes[n];
+            int last = cell_data ? 0 : 1;
+            if ((box.extent.i <= last && global_domain.extent.i > 1) || (box.extent.j <= last && global_domain.extent.j > 1) || (box.extent.k <= last && global_domain.extent.k > 1))
+            {
+                throw std::runtime_error("Brick " + std::to_string(n) + " would have no thickness.");
+            }
+        }
+        brick_rounds.clear();
+        for (int first = 0; first < (int)num_bricks; first += mpi_comm_size)
+        {
+            int n = first + mpi_rank;
+            brick_rounds.push_back(std::unique_ptr<MPIRedistributor<IDX_SCHEME, IDX_SCHEME> >(new MPIRedistributor<IDX_SCHEME, IDX_SCHEME>(local_domain, n < num_bricks ? piece_boxes[n] : Domain())));
+        }
+        my_piece = -1;
+    }
+    else if (output_blocks)
+    {
+        Domain block = BlockDecomposition(global_domain, mpi_rank, mpi_comm_size);
+        to_pieces.reset(new MPIRedistributor<IDX_SCHEME, IDX_SCHEME>(local_domain, pieceBox(block)));
+        piece_boxes = to_pieces->targetBoxes();
+        my_piece = mpi_rank;
+    }
+    else if (io_aggregators >= 0)
+    {
+        // Piece n holds the slabs of group n and is written by the group's first rank
+        std::vector<int> groups = AggregatorGroups(io_aggregators, mpi_rank, mpi_comm_size);
+        std::vector<Domain> merged(groups.back() + 1);
+        for (int proc = 0; proc < mpi_comm_size; ++proc)
+        {
+            const Domain &slab = MPISubIndex<IDX_SCHEME>::all_local_domains[proc];
+            merged[groups[proc]] = (proc == 0 || groups[proc] != groups[proc - 1]) ? slab : BoundingBox(merged[groups[proc]], slab);
+        }
+
+        piece_boxes.resize(merged.size());
+        for (size_t n = 0; n < merged.size(); ++n)
+        {
+            piece_boxes[n] = pieceBox(merged[n]);
+        }
+
+        bool aggregator = mpi_rank == 0 || groups[mpi_rank] != groups[mpi_rank - 1];
+        my_piece = aggregator ? groups[mpi_rank] : -1;
+        to_pieces.reset(new MPIRedistributor<IDX_SCHEME, IDX_SCHEME>(local_domain, aggregator ? piece_boxes[my_piece] : Domain()));
+    }
+    else
+    {
+        piece_boxes.resize(mpi_comm_size);
+        for (int proc = 0; proc < mpi_comm_size; ++proc)
+        {
+            piece_boxes[proc] = pieceBox(MPISubIndex<IDX_SCHEME>::all_local_domains[proc]);
+        }
+        my_piece = mpi_rank;
+    }
 
     if (mpi_rank == 0)
     {
@@ -72,150 +279,1576 @@ void Preprocessor::setupDomain(int3 gextent)
 }
 
 /**
- * @brief Manages the reading of the raw image file into the distributed domain.
- * @details Verifies that the file size matches the expected domain size and then
- * uses MPIRawLoader to perform the parallel read.
- * @param filename The path to the .raw input file.
- * @param header_size The size of the file header in bytes.
- * @throws std::runtime_error if the file size does not match the domain dimensions.
+ * @brief Selects whether voxels are written as cell data rather than point data.
+ * @details As point data each voxel is a grid point, so neighbouring pieces have to overlap by
+ * one plane. As cell data each voxel is a cell of a grid one point larger in each direction,
+ * so pieces tile exactly and every process writes only the voxels it owns.
  */
-void Preprocessor::readRawFile(const std::string &filename, size_t header_size)
+void Preprocessor::setCellData(bool cell_data_in)
 {
-    if (mpi_rank == 0)
+    cell_data = cell_data_in;
+}
+
+/**
+ * @brief Selects whether the .vti pieces are 3D blocks rather than the slabs the file is read in.
+ * @details Blocks have less surface than slabs, so there is less overlap between the pieces and
+ * each piece is closer to a cube, which suits viewers that load or stream pieces separately.
+ * The slabs are redistributed into blocks before every write.
+ */
+void Preprocessor::setOutputBlocks(bool output_blocks_in)
+{
+    output_blocks = output_blocks_in;
+}
+
+/**
+ * @brief Selects whether the output is written as cubic bricks of a fixed size.
+ * @details The bricks tile the global domain from its origin (as point data its cells, see
+ * brickTiling), so their extents and names only depend on the domain and the brick size:
+ * identical inputs give identical bricks whatever the number of processes, and readers can load
+ * just the bricks their view intersects (listed with their extents in a .bricks index next to
+ * the .pvti). The slabs are redistributed into one brick per process at a time, straight into
+ * the mapped file of the brick.
+ * @param size The edge length of a brick in voxels, or 0 for one piece per process.
+ * @throws std::runtime_error if the size is negative.
+ */
+void Preprocessor::setBrickSize(int size)
+{
+    if (size < 0)
     {
-        std::cout << "Reading RAW file: " << filename << std::endl;
+        throw std::runtime_error("The brick size must not be negative.");
+    }
+    brick_size = size;
+}
+
+/**
+ * @brief Selects how many processes write .vti pieces.
+ * @details At high process counts one file per process puts a lot of load on the file system's
+ * metadata servers. With aggregators, consecutive processes are grouped (by default one group
+ * per node) and the first process of each group writes one piece holding the whole group's slabs,
+ * which the others send it. The .pvti then lists one piece per group.
+ * @param num_aggregators The number of groups, 0 for one per node or -1 for every process to write.
+ */
+void Preprocessor::setIoAggregators(int num_aggregators)
+{
+    io_aggregators = num_aggregators;
+}
+
+/**
+ * @brief Selects whether each node's slabs are read once into memory shared by its processes.
+ * @details Instead of every process opening the file and reading its own padded slab, the first
+ * process of each node reads the slabs of all the node's processes into an MPI shared memory
+ * window, and the processes view their slabs in place. This cuts the file opens and the page
+ * cache traffic by the number of processes per node, and padding planes shared with a process
+ * on the same node are not read or stored twice. Only files which every process can read
+ * independently (uncompressed or seekable zstd) can be read this way.
+ */
+void Preprocessor::setSharedRead(bool shared_read_in)
+{
+    shared_read = shared_read_in;
+}
+
+/**
+ * @brief Selects whether only the pieces whose input or options changed are rewritten.
+ * @details A piece's hash covers the voxels it writes, as they are after remapping and
+ * filtering (all voxels if components are labelled or distances computed, as they depend on the
+ * whole domain), and the options which affect it (see pieceHashes). It is stored in a manifest
+ * next to the .pvti. Pieces whose hash matches the manifest of the previous conversion, and
+ * whose file still exists, are not written again.
+ */
+void Preprocessor::setIncremental(bool incremental_in)
+{
+    incremental = incremental_in;
+}
+
+/**
+ * @brief Sets the bits the material labels are packed into while they are at rest.
+ * @details Once filtered and analysed, the material domain gets a bit-packed copy (see
+ * MPIDomain::pack) when its voxels are redistributed to the output pieces, which then move
+ * 2 (or 4) bits per voxel. The voxel buffer is kept for the next file, so packing does not
+ * lower the memory used; the labels are read and filtered at their full width.
+ * @param bits 2, 4 or 8, or 0 to keep the voxels as they are.
+ * @throws std::runtime_error if bits is not one of these.
+ */
+void Preprocessor::setPackBits(int bits)
+{
+    if (bits != 0 && bits != 2 && bits != 4 && bits != 8)
+    {
+        throw std::runtime_error("Labels are packed with 2, 4 or 8 bits.");
     }
+    pack_bits = bits;
+}
 
-    struct stat filestatus;
-    if (stat(filename.c_str(), &filestatus) != 0)
+/**
+ * @brief Packs the material domain, if packing is selected (see setPackBits) and the voxels
+ * are redistributed to the output pieces.
+ * @details Must be called by all processes. A label which does not fit on any process fails
+ * every process.
+ * @throws std::runtime_error if a label does not fit in the bits.
+ */
+void Preprocessor::packMaterials()
+{
+    if (pack_bits == 0 || material_data.isPacked() || (!to_pieces && brick_rounds.empty()))
     {
-        throw std::runtime_error("Cannot get file status for " + filename);
+        return;
     }
 
-    if ((filestatus.st_size - header_size) != global_domain.extent.size() * sizeof(RAWType))
+    std::string error;
+    try
+    {
+        material_data.pack(pack_bits);
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what();
+    }
+    int failed = !error.empty();
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPIDetails::Comm());
+    if (failed)
     {
-        std::stringstream msg;
-        msg << "File size does not match specified domain dimensions." << std::endl;
-        msg << "\tFile size on disk: " << filestatus.st_size << " bytes." << std::endl;
-        msg << "\tExpected data size: " << global_domain.extent.size() * sizeof(RAWType) << " bytes.";
-        throw std::runtime_error(msg.str());
+        throw std::runtime_error(error.empty() ? "The labels of another process do not fit in the packed bits." : error);
     }
+}
 
-    MPIRawLoader<RAWType, 1, IDX_SCHEME> reader(filename);
-    reader.setup(local_domain.origin, local_domain.extent);
-    reader.read(header_size);
-    material_data.take(reader.getData());
+/**
+ * @brief Sets the material labels to renumber while the RAW files are read.
+ * @details The labels are remapped by the loader as the voxels arrive (see LabelRemap), so
+ * every later stage, and the hashes of incremental output, see the new labels.
+ * @param spec A file with one "from to" pair per line, or inline pairs "from:to,from:to".
+ * @throws std::runtime_error if the pairs cannot be parsed.
+ */
+void Preprocessor::setRemap(const std::string &spec)
+{
+    remap = LabelRemap<RAWType>(spec);
+    if (remap.empty())
+    {
+        throw std::runtime_error("No label pairs given to remap.");
+    }
+    loader.setRemap(remap);
+    node_loader.setRemap(remap);
 
     if (mpi_rank == 0)
     {
-        std::cout << "RAW file reading complete." << std::endl;
+        std::cout << "Remapping labels with a " << remap.lookup().size() - 1 << " entry table (" << RemapKernelName(sizeof(RAWType)) << ")." << std::endl;
     }
 }
 
 /**
- * @brief Writes the data to a set of VTK files.
- * @details The root process writes a master .pvti file that references individual .vti
- * part files written by each process.
- * @param fname_root The base filename for the output files (e.g., "./output/material").
+ * @brief The voxels written for a piece owning the given voxels.
+ * @details As point data, pieces overlap their upper neighbours by one plane in each direction.
  */
-void Preprocessor::writeVtkFile(const std::string &fname_root)
+Domain Preprocessor::pieceBox(const Domain &owned) const
 {
-    // Write the master .pvti file on the root process
-    if (mpi_rank == 0)
+    if (cell_data)
     {
-        std::stringstream pvti_fname;
-        pvti_fname << fname_root << ".pvti";
-        std::ofstream fout(pvti_fname.str());
+        return owned;
+    }
 
-        fout << "<?xml version=\"1.0\"?>" << std::endl;
-        fout << "<VTKFile type=\"PImageData\" version=\"0.1\">" << std::endl;
-        fout << "\t<PImageData WholeExtent=\"0 " << global_domain.extent.i - 1
-             << " 0 " << global_domain.extent.j - 1 << " 0 "
-             << global_domain.extent.k - 1 << "\" ";
-        fout << "GhostLevel=\"0\" Origin=\"0 0 0\" Spacing=\"1 1 1\">" << std::endl;
-        fout << "\t\t<PPointData Scalars=\"MaterialType\">" << std::endl;
+    Domain box = owned;
+    if (box.origin.i + box.extent.i < global_domain.extent.i)
+        box.extent.i++;
+    if (box.origin.j + box.extent.j < global_domain.extent.j)
+        box.extent.j++;
+    if (box.origin.k + box.extent.k < global_domain.extent.k)
+        box.extent.k++;
+    return box;
+}
 
-#if DATA_TYPE == 16
-        fout << "\t\t\t<PDataArray type=\"UInt16\" Name=\"MaterialType\"/>" << std::endl;
-#elif DATA_TYPE == 8
-        fout << "\t\t\t<PDataArray type=\"UInt8\" Name=\"MaterialType\"/>" << std::endl;
-#endif
+/**
+ * @brief The box the bricks tile (see GridBrick).
+ * @details As cell data the bricks tile every voxel. As point data they tile the cells between
+ * the points, one fewer along each direction, and each brick adds the plane it shares with its
+ * upper neighbour (see pieceBox); tiling the points instead would leave a last brick of a single
+ * plane, i.e. of no thickness, whenever the extent is one more than a multiple of the brick size.
+ */
+Domain Preprocessor::brickTiling() const
+{
+    if (cell_data)
+    {
+        return global_domain;
+    }
+    return Domain(global_domain.origin, int3(std::max(global_domain.extent.i - 1, 1), std::max(global_domain.extent.j - 1, 1), std::max(global_domain.extent.k - 1, 1)));
+}
 
-        fout << "\t\t</PPointData>" << std::endl;
+/**
+ * @brief The voxels every process would hold and write in a run with the current settings.
+ * @details Mirrors setupDomain without any communication. Nodes are assumed to hold
+ * procs_per_node consecutive ranks.
+ */
+std::vector<Preprocessor::ProcessPlan> Preprocessor::planProcesses(int num_procs, int procs_per_node) const
+{
+    std::vector<ProcessPlan> procs(num_procs);
+    int3 axis = IDX_SCHEME == ZFastest ? int3(1, 0, 0) : int3(0, 0, 1);
+    for (int p = 0; p < num_procs; ++p)
+    {
+        procs[p].owned = SlabDecomposition<IDX_SCHEME>(global_domain, p, num_procs);
+        procs[p].padded = Intersection(global_domain, Domain(procs[p].owned.origin - axis, procs[p].owned.extent + axis + axis));
+    }
 
-        // Write the references to the part files with their corresponding extent
-        for (int proc = 0; proc < mpi_comm_size; ++proc)
+    if (brick_size > 0)
+    {
+        // the largest brick, for the processes which write at least one
+        Domain brick = pieceBox(GridBrick(brickTiling(), brick_size, 0));
+        int3 grid = BrickGrid(brickTiling().extent, brick_size);
+        long long num_bricks = (long long)grid.i * grid.j * grid.k;
+        for (int p = 0; p < num_procs && p < num_bricks; ++p)
         {
-            std::stringstream piece_fname;
-            std::string root_basename = fname_root.substr(fname_root.find_last_of("/\\") + 1);
-            piece_fname << root_basename << "_" << proc << ".vti";
-
-            const Domain &piece_dom = MPISubIndex<IDX_SCHEME>::all_local_domains[proc];
-            int max_i = piece_dom.origin.i + piece_dom.extent.i - 1;
-
-            // Add the one-voxel overlap for all pieces except the very last one
-            if (proc != mpi_comm_size - 1)
+            procs[p].output = brick;
+            procs[p].piece = brick;
+        }
+    }
+    else if (output_blocks)
+    {
+        int3 grid = BlockGrid(global_domain.extent, num_procs);
+        for (int p = 0; p < num_procs; ++p)
+        {
+            procs[p].output = pieceBox(GridBlock(global_domain, grid, p));
+            procs[p].piece = procs[p].output;
+        }
+    }
+    else if (io_aggregators >= 0)
+    {
+        int num_groups = io_aggregators == 0 ? (num_procs + procs_per_node - 1) / procs_per_node : std::min(io_aggregators, num_procs);
+        for (int p = 0; p < num_procs;)
+        {
+            // the group's first process writes the slabs of the whole group
+            int group = io_aggregators == 0 ? p / procs_per_node : (int)((long long)p * num_groups / num_procs);
+            Domain merged = procs[p].owned;
+            int q = p + 1;
+            for (; q < num_procs && (io_aggregators == 0 ? q / procs_per_node : (int)((long long)q * num_groups / num_procs)) == group; ++q)
             {
-                max_i++;
+                merged = BoundingBox(merged, procs[q].owned);
             }
+            procs[p].output = pieceBox(merged);
+            procs[p].piece = procs[p].output;
+            p = q;
+        }
+    }
+    else
+    {
+        for (int p = 0; p < num_procs; ++p)
+        {
+            procs[p].piece = pieceBox(procs[p].owned);
+        }
+    }
+    return procs;
+}
 
-            fout << "\t\t<Piece Extent=\"";
-            fout << piece_dom.origin.i << " " << max_i << " ";
-            fout << piece_dom.origin.j << " " << piece_dom.origin.j + piece_dom.extent.j - 1 << " ";
-            fout << piece_dom.origin.k << " " << piece_dom.origin.k + piece_dom.extent.k - 1 << "\" ";
-            fout << "Source=\"" << piece_fname.str() << "\"/>" << std::endl;
+// The number of voxels of a domain, without the 32 bit limit of int3::size
+static double Voxels(const Domain &d)
+{
+    return (double)d.extent.i * d.extent.j * d.extent.k;
+}
+
+/**
+ * @brief Predicts the peak memory of the processes of a planned run.
+ * @details Counts the material buffers (two when reading the next file while writing), the
+ * component ids with the temporary union-find arrays of labelling, the distances with the
+ * squared distances of the slab and pencil they are computed in, and the packed boxes of the
+ * redistributed output (see setPackBits). Pieces are copied, or received, straight into their
+ * mapped files, which only occupy the page cache. Memory used by MPI and the program itself is
+ * not included.
+ * @param procs The processes, see planProcesses.
+ * @param run The run.
+ * @param proc_peak Set to the largest peak of a single process (excluding shared windows).
+ * @return The largest peak of a node, in bytes.
+ */
+double Preprocessor::nodeMemory(const std::vector<ProcessPlan> &procs, const RunPlan &run, double &proc_peak) const
+{
+    const double voxel = sizeof(RAWType);
+    const double id = run.components ? sizeof(unsigned int) : 0;
+    const int buffers = run.num_files > 1 ? 2 : 1;
+
+    double node_peak = 0;
+    double node_total = 0;
+    Domain node_box;
+    proc_peak = 0;
+    for (size_t p = 0; p < procs.size(); ++p)
+    {
+        const ProcessPlan &proc = procs[p];
+        double material = shared_read ? 0 : buffers * voxel * Voxels(proc.padded);
+        double components = id * Voxels(proc.padded);
+        double distances = run.distances ? sizeof(float) * Voxels(proc.padded) + 2 * sizeof(unsigned int) * Voxels(proc.owned) : 0;
+        double labelling = 2 * id * Voxels(proc.owned);
+        double writing = pack_bits / 8.0 * Voxels(proc.output);
+        double filtering = 0;
+        if (!filter_steps.empty())
+        {
+            // two slab buffers with halo planes on both sides
+            int thickness = IDX_SCHEME == ZFastest ? proc.owned.extent.i : proc.owned.extent.k;
+            filtering = 2 * voxel * Voxels(proc.owned) * (1 + 2.0 * MaxRadius(filter_steps) / std::max(thickness, 1));
+        }
+        double peak = material + components + distances + std::max(std::max(labelling, writing), filtering);
+        proc_peak = std::max(proc_peak, peak);
+
+        // with shared reads the node's window holds the padded slabs of all its processes
+        bool first = p % run.procs_per_node == 0;
+        node_total = (first ? 0 : node_total) + peak;
+        node_box = first ? proc.padded : BoundingBox(node_box, proc.padded);
+        if (p + 1 == procs.size() || (p + 1) % run.procs_per_node == 0)
+        {
+            double window = shared_read ? buffers * voxel * Voxels(node_box) : 0;
+            node_peak = std::max(node_peak, node_total + window);
         }
-        fout << "\t</PImageData>" << std::endl;
-        fout << "</VTKFile>" << std::endl;
-        fout.close();
     }
+    return node_peak;
+}
 
-    // Ensure all processes wait for rank 0 to finish writing the master file
-    MPI_Barrier(MPI_COMM_WORLD);
+// Prints a number of bytes in the largest binary unit which keeps it above 1
+static std::string FormatBytes(double bytes)
+{
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+    int u = 0;
+    while (bytes >= 1024 && u < 5)
+    {
+        bytes /= 1024;
+        ++u;
+    }
+    std::stringstream out;
+    out << std::fixed << std::setprecision(u == 0 ? 0 : 2) << bytes << " " << units[u];
+    return out.str();
+}
 
-    // Each process writes its own .vti part file using the "safe" copy method
-    std::stringstream vti_fname;
-    vti_fname << fname_root << "_" << mpi_rank << ".vti";
+/**
+ * @brief Prints what a run would do, without allocating or reading anything.
+ * @details Reports the extents and memory of the processes, the load imbalance and the files
+ * written for each RAW file. Given the memory of a node, also recommends the fewest processes
+ * (in whole nodes) whose data fits. Takes milliseconds even for huge domains, as only the
+ * decomposition is computed.
+ * @param gextent The dimensions (i, j, k) of the entire dataset.
+ * @param run The processes and options of the run.
+ * @param out Where to print the plan.
+ */
+void Preprocessor::plan(int3 gextent, const RunPlan &run, std::ostream &out)
+{
+    if (run.num_procs < 1 || run.procs_per_node < 1)
+    {
+        throw std::runtime_error("A plan needs at least one process and one process per node.");
+    }
+    if (output_blocks && io_aggregators >= 0)
+    {
+        throw std::runtime_error("Output blocks cannot be combined with I/O aggregators.");
+    }
+    if (brick_size > 0 && (output_blocks || io_aggregators >= 0 || incremental))
+    {
+        throw std::runtime_error("Bricks cannot be combined with output blocks, I/O aggregators or incremental output.");
+    }
 
-    int off_pos = (mpi_rank == mpi_comm_size - 1) ? 0 : 1;
+    global_domain.origin = int3();
+    global_domain.extent = gextent;
 
-    vtkSmartPointer<vtkImageData> imageData = vtkSmartPointer<vtkImageData>::New();
-    imageData->SetExtent(local_domain.origin.i, local_domain.origin.i + local_domain.extent.i - 1 + off_pos,
-                         local_domain.origin.j, local_domain.origin.j + local_domain.extent.j - 1,
-                         local_domain.origin.k, local_domain.origin.k + local_domain.extent.k - 1);
+    std::vector<ProcessPlan> procs = planProcesses(run.num_procs, run.procs_per_node);
+    double proc_peak;
+    double node_peak = nodeMemory(procs, run, proc_peak);
+    const double voxel = sizeof(RAWType);
+    const double id = (run.components ? sizeof(unsigned int) : 0) + (run.distances ? sizeof(float) : 0);
 
-    size_t num_voxels_to_write = (size_t)(local_domain.extent.i + off_pos) * local_domain.extent.j * local_domain.extent.k;
+    out << "Plan for " << run.num_procs << " processes (" << run.procs_per_node << " per node), global domain " << gextent << std::endl;
 
-    // Create the appropriate VTK array and allocate memory inside it
-#if DATA_TYPE == 16
-    vtkSmartPointer<vtkUnsignedShortArray> type_arr = vtkSmartPointer<vtkUnsignedShortArray>::New();
-#elif DATA_TYPE == 8
-    vtkSmartPointer<vtkUnsignedCharArray> type_arr = vtkSmartPointer<vtkUnsignedCharArray>::New();
-#endif
-    type_arr->SetName("MaterialType");
-    type_arr->SetNumberOfComponents(1);
-    type_arr->SetNumberOfValues(num_voxels_to_write);
+    // Processes with the same extents are listed once, with their first rank
+    out << "Processes:" << std::endl;
+    std::vector<size_t> firsts;
+    std::vector<int> counts;
+    for (size_t p = 0; p < procs.size(); ++p)
+    {
+        size_t n = 0;
+        for (; n < firsts.size(); ++n)
+        {
+            const ProcessPlan &a = procs[firsts[n]];
+            if (a.owned.extent == procs[p].owned.extent && a.padded.extent == procs[p].padded.extent && a.piece.extent == procs[p].piece.extent)
+                break;
+        }
+        if (n == firsts.size())
+        {
+            firsts.push_back(p);
+            counts.push_back(0);
+        }
+        counts[n]++;
+    }
+    for (size_t n = 0; n < firsts.size(); ++n)
+    {
+        const ProcessPlan &proc = procs[firsts[n]];
+        out << "\t" << counts[n] << " x (first rank " << firsts[n] << "): owns " << proc.owned.extent << " = " << FormatBytes(voxel * Voxels(proc.owned))
+            << ", stores " << proc.padded.extent << " = " << FormatBytes(voxel * Voxels(proc.padded));
+        if (Voxels(proc.piece) > 0)
+            out << ", writes " << proc.piece.extent << " = " << FormatBytes((voxel + id) * Voxels(proc.piece));
+        else
+            out << ", writes nothing";
+        out << std::endl;
+    }
 
-    // Loop through all voxels to be written (including the overlap)
-    // and copy the data from your simulation buffer to the VTK buffer.
-    size_t count = 0;
-    for (int k = local_domain.origin.k; k < (local_domain.origin.k + local_domain.extent.k); ++k)
+    // Voxel buffers are indexed with 32 bit sizes (int3::size)
+    for (size_t p = 0; p < procs.size(); ++p)
     {
-        for (int j = local_domain.origin.j; j < (local_domain.origin.j + local_domain.extent.j); ++j)
+        if (std::max(Voxels(procs[p].padded), Voxels(procs[p].output)) > 4294967295.0)
         {
-            for (int i = local_domain.origin.i; i < (local_domain.origin.i + local_domain.extent.i + off_pos); ++i)
-            {
-                Index idx(i, j, k);
-                type_arr->SetValue(count, material_data[idx]);
-                count++;
-            }
+            out << "Warning: rank " << p << " would hold more than 2^32 voxels in one domain, which is not supported; use more processes" << std::endl;
+            break;
+        }
+    }
+
+    // Load imbalance: the slowest process against the average, for reading and for writing
+    double owned_max = 0, owned_sum = 0, piece_max = 0, piece_sum = 0, piece_bytes = 0;
+    int num_pieces = 0;
+    for (size_t p = 0; p < procs.size(); ++p)
+    {
+        owned_max = std::max(owned_max, Voxels(procs[p].owned));
+        owned_sum += Voxels(procs[p].owned);
+        piece_max = std::max(piece_max, Voxels(procs[p].piece));
+        piece_sum += Voxels(procs[p].piece);
+        num_pieces += Voxels(procs[p].piece) > 0;
+    }
+    double largest_piece = piece_max;
+    if (brick_size > 0)
+    {
+        // Brick n is written by process n % num_procs (see setupDomain)
+        int3 grid = BrickGrid(brickTiling().extent, brick_size);
+        num_pieces = grid.i * grid.j * grid.k;
+        std::vector<double> written(procs.size(), 0);
+        piece_sum = 0;
+        for (int n = 0; n < num_pieces; ++n)
+        {
+            double brick = Voxels(pieceBox(GridBrick(brickTiling(), brick_size, n)));
+            written[n % procs.size()] += brick;
+            piece_sum += brick;
+        }
+        piece_max = *std::max_element(written.begin(), written.end());
+    }
+    piece_bytes = (voxel + id) * piece_sum;
+    out << "Load imbalance (max / mean): reading " << std::setprecision(3) << owned_max / (owned_sum / procs.size())
+        << ", writing " << piece_max / (piece_sum / procs.size()) << std::endl;
+
+    out << "Peak memory: " << FormatBytes(proc_peak) << " per process";
+    if (shared_read)
+        out << " plus the node's shared slabs";
+    out << ", " << FormatBytes(node_peak) << " per node" << std::endl;
+
+    // Pieces are written uncompressed, so only their few hundred byte headers are left out
+    int index_files = brick_size > 0 ? 2 : 1;
+    out << "Output per RAW file: " << num_pieces << (brick_size > 0 ? " .vti bricks" : " .vti pieces") << " of up to " << FormatBytes((voxel + id) * largest_piece)
+        << " (" << FormatBytes(piece_bytes) << " in total) and 1 .pvti" << (brick_size > 0 ? " with a .bricks index" : "") << std::endl;
+    out << "Output for " << run.num_files << " RAW file(s): " << run.num_files * (num_pieces + index_files) + (run.num_files > 1 ? 1 : 0)
+        << " files, up to " << FormatBytes(piece_bytes * run.num_files) << std::endl;
+
+    if (run.node_memory > 0)
+    {
+        // The fewest whole nodes whose processes fit, assuming memory falls with more processes
+        int max_procs = IDX_SCHEME == ZFastest ? gextent.i : gextent.k;
+        int max_nodes = (max_procs + run.procs_per_node - 1) / run.procs_per_node;
+        int lo = 1, hi = max_nodes + 1;
+        while (lo < hi)
+        {
+            int nodes = lo + (hi - lo) / 2;
+            int num_procs = std::min(nodes * run.procs_per_node, max_procs);
+            double ignored;
+            if (nodeMemory(planProcesses(num_procs, run.procs_per_node), run, ignored) <= run.node_memory)
+                hi = nodes;
+            else
+                lo = nodes + 1;
+        }
+
+        if (lo > max_nodes)
+        {
+            out << "Recommendation: the data does not fit into " << FormatBytes(run.node_memory) << " per node even with one plane per process" << std::endl;
+        }
+        else
+        {
+            out << "Recommendation: " << std::min(lo * run.procs_per_node, max_procs) << " processes (" << lo << " nodes of " << run.procs_per_node
+                << ") for " << FormatBytes(run.node_memory) << " per node" << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Sets the number of threads each process uses for reading.
+ * @details Must be called by all processes: the processes of a node which are bound to the same
+ * CPUs find each other, so that they pin their threads to different CPUs (see Threads::ShareCpus).
+ */
+void Preprocessor::setThreads(int threads)
+{
+    Threads::SetCount(threads);
+
+    MPI_Comm node = MPIDetails::NodeComm();
+    int node_rank, node_size;
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_size(node, &node_size);
+
+    std::vector<int> cpus = Threads::AllowedCpus();
+    int num_cpus = cpus.size();
+    std::vector<int> all_num_cpus(node_size), displs(node_size, 0);
+    MPI_Allgather(&num_cpus, 1, MPI_INT, all_num_cpus.data(), 1, MPI_INT, node);
+    for (int p = 1; p < node_size; ++p)
+        displs[p] = displs[p - 1] + all_num_cpus[p - 1];
+
+    std::vector<int> all_cpus(displs[node_size - 1] + all_num_cpus[node_size - 1]);
+    MPI_Allgatherv(cpus.data(), num_cpus, MPI_INT, all_cpus.data(), all_num_cpus.data(), displs.data(), MPI_INT, node);
+
+    int index = 0, sharing = 0;
+    for (int p = 0; p < node_size; ++p)
+    {
+        if (all_num_cpus[p] == num_cpus && std::equal(cpus.begin(), cpus.end(), all_cpus.begin() + displs[p]))
+        {
+            if (p < node_rank)
+                index++;
+            sharing++;
         }
     }
+    Threads::ShareCpus(index, sharing);
 
-    imageData->GetPointData()->AddArray(type_arr);
+    loader.setThreads(threads);
+    node_loader.setThreads(threads);
+}
 
-    vtkSmartPointer<vtkXMLImageDataWriter> writer = vtkSmartPointer<vtkXMLImageDataWriter>::New();
-    writer->SetFileName(vti_fname.str().c_str());
-    writer->SetInputConnection(imageData->GetProducerPort());
-    writer->Write();
+/**
+ * @brief Manages the reading of the raw image file into the distributed domain.
+ * @details Verifies that the file size matches the expected domain size and then
+ * uses MPIRawLoader to perform the parallel read. gzip and zstd compressed files are
+ * recognised and decompressed on the fly. The input may also be a stack of 2D slice files
+ * named by a pattern (see ExpandSlicePattern), of which each process reads only its own.
+ * @param filename The path to the .raw input file, or a slice pattern.
+ * @param header_size The size of the file header in bytes.
+ * @throws std::runtime_error if the file size does not match the domain dimensions.
+ */
+void Preprocessor::readRawFile(const std::string &filename, size_t header_size)
+{
+    startRawFileRead(filename, header_size);
+    finishRawFileRead();
+}
+
+/**
+ * @brief Checks that an uncompressed file holds the whole domain.
+ * @details Compressed files are checked against their decompressed size by the loader.
+ * @throws std::runtime_error if the file size does not match the domain dimensions.
+ */
+void Preprocessor::checkFileSize(const std::string &filename, size_t header_size)
+{
+    if (DetectCompression(filename) == Uncompressed)
+    {
+        struct stat filestatus;
+        if (stat(filename.c_str(), &filestatus) != 0)
+        {
+            throw std::runtime_error("Cannot get file status for " + filename);
+        }
+
+        if ((filestatus.st_size - header_size) != global_domain.extent.size() * sizeof(RAWType))
+        {
+            std::stringstream msg;
+            msg << "File size does not match specified domain dimensions." << std::endl;
+            msg << "\tFile size on disk: " << filestatus.st_size << " bytes." << std::endl;
+            msg << "\tExpected data size: " << global_domain.extent.size() * sizeof(RAWType) << " bytes.";
+            throw std::runtime_error(msg.str());
+        }
+    }
+}
+
+/**
+ * @brief Lists the slice files named by a pattern, one per plane along z.
+ * @details The pattern is expanded on the root process (so the file system is only searched
+ * once) and the list broadcast. Must be called by all processes.
+ * @throws std::runtime_error on all processes if the pattern does not name num_slices files.
+ */
+static std::vector<std::string> SliceFiles(const std::string &pattern, int num_slices, int mpi_rank)
+{
+    std::string names, error;
+    if (mpi_rank == 0)
+    {
+        try
+        {
+            std::vector<std::string> slices = ExpandSlicePattern(pattern, num_slices);
+            for (size_t n = 0; n < slices.size(); ++n)
+            {
+                names += slices[n] + '\n';
+            }
+        }
+        catch (const std::exception &e)
+        {
+            error = e.what();
+        }
+    }
+
+    // the error (if any), then the names
+    std::string message = error + '\0' + names;
+    unsigned long long length = message.size();
+    MPI_Bcast(&length, 1, MPI_UNSIGNED_LONG_LONG, 0, MPIDetails::Comm());
+    message.resize(length);
+    MPI_Bcast(&message[0], length, MPI_CHAR, 0, MPIDetails::Comm());
+
+    size_t split = message.find('\0');
+    if (split > 0)
+    {
+        throw std::runtime_error(message.substr(0, split));
+    }
+
+    std::vector<std::string> slices;
+    std::istringstream list(message.substr(split + 1));
+    std::string name;
+    while (std::getline(list, name))
+    {
+        slices.push_back(name);
+    }
+    return slices;
+}
+
+/**
+ * @brief startRawFileRead() for shared reads: the node's first process reads into the next window.
+ * @details Errors on the reading process are only raised by finishRawFileRead(), together on
+ * all processes of the node, so that none of them is left waiting for the others.
+ */
+void Preprocessor::startSharedRead(const std::string &filename, size_t header_size, const std::vector<std::string> &slices)
+{
+    // As for private buffers, the first read goes straight into the material window
+    if (!material_loaded)
+    {
+        std::swap(read_window, material_window);
+    }
+    if (!read_window)
+    {
+        read_window.reset(new MPINodeWindow<RAWType, IDX_SCHEME>(material_window->box(), MPIDetails::NodeComm()));
+    }
+
+    if (!node_leader)
+    {
+        pending_read = std::async(std::launch::deferred, []() {});
+        return;
+    }
+
+    try
+    {
+        if (slices.empty())
+        {
+            checkFileSize(filename, header_size);
+        }
+
+        SlabPtr<RAWType> view = read_window->view(read_window->box());
+        node_loader.take(view);
+        node_loader.setFile(filename);
+        if (!slices.empty())
+        {
+            node_loader.setSlices(slices);
+        }
+        if (node_loader.collectiveRead())
+        {
+            throw std::runtime_error("Shared reads need an uncompressed or seekable zstd file: " + filename);
+        }
+        pending_read = std::async(std::launch::async, &MPIRawLoader<RAWType, 0, IDX_SCHEME>::read, &node_loader, header_size);
+    }
+    catch (...)
+    {
+        std::exception_ptr error = std::current_exception();
+        pending_read = std::async(std::launch::deferred, [error]() { std::rethrow_exception(error); });
+    }
+}
+
+/**
+ * @brief Starts reading a raw image file in the background.
+ * @details The file is checked on the calling thread, then read into the loader's buffer by
+ * a worker thread so that the current contents of the material domain can still be processed
+ * and written. The read does not make any MPI calls, except for compressed files which can only
+ * be decompressed on the root process; these are read in finishRawFileRead() instead.
+ * Slice patterns are expanded collectively, so all processes must call this together.
+ * Must be followed by finishRawFileRead().
+ * @param filename The path to the .raw input file, or a slice pattern.
+ * @param header_size The size of the file header in bytes.
+ * @throws std::runtime_error if the file size does not match the domain dimensions.
+ */
+void Preprocessor::startRawFileRead(const std::string &filename, size_t header_size)
+{
+    if (mpi_rank == 0)
+    {
+        std::cout << "Reading RAW file: " << filename << std::endl;
+    }
+
+    std::vector<std::string> slices;
+    if (IsSlicePattern(filename))
+    {
+        slices = SliceFiles(filename, global_domain.extent.i, mpi_rank);
+    }
+
+    if (shared_read)
+    {
+        startSharedRead(filename, header_size, slices);
+        return;
+    }
+
+    if (slices.empty())
+    {
+        checkFileSize(filename, header_size);
+    }
+
+    // Until the first read completes the material buffer holds nothing worth keeping, so the
+    // loader reads straight into it. Later reads need a second buffer, which is then swapped
+    // back and forth rather than reallocated.
+    if (!material_loaded)
+    {
+        std::swap(loader.getData(), material_data.getData());
+    }
+    loader.allocate();
+    loader.setFile(filename);
+    if (!slices.empty())
+    {
+        loader.setSlices(slices);
+    }
+
+    // A read which communicates (rank 0 decompressing for everyone) has to stay on this thread,
+    // so it is deferred until finishRawFileRead
+    std::launch policy = loader.collectiveRead() ? std::launch::deferred : std::launch::async;
+    pending_read = std::async(policy, &MPIRawLoader<RAWType, 1, IDX_SCHEME>::read, &loader, header_size);
+}
+
+/**
+ * @brief Waits for the read started by startRawFileRead() and makes it the current material data.
+ * @details The buffers of the loader and the material domain are swapped rather than
+ * reallocated, so repeated reads reuse the same two buffers.
+ * @throws std::runtime_error if no read is pending or the read failed.
+ */
+void Preprocessor::finishRawFileRead()
+{
+    if (!pending_read.valid())
+    {
+        throw std::runtime_error("No RAW file read has been started.");
+    }
+    if (shared_read)
+    {
+        // A failed read is reported on every process of the node
+        std::string error;
+        try
+        {
+            pending_read.get();
+        }
+        catch (const std::exception &e)
+        {
+            error = e.what();
+        }
+        int failed = !error.empty();
+        MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPIDetails::NodeComm());
+        if (failed)
+        {
+            throw std::runtime_error(error.empty() ? "Reading the RAW file failed on the first process of this node." : error);
+        }
+
+        // Wait for the node's first process to have read the slabs of the whole node
+        read_window->sync();
+        std::swap(read_window, material_window);
+        SlabPtr<RAWType> view = material_window->view(material_data.padded);
+        material_data.take(view);
+    }
+    else
+    {
+        pending_read.get();
+        material_data.clearPacked();
+        std::swap(material_data.getData(), loader.getData());
+    }
+    material_loaded = true;
+
+    // The loader reads the padded region, so the ghost layer (and the overlap written to each
+    // .vti piece) already holds the neighbouring process' first plane without an exchange
+
+    if (mpi_rank == 0)
+    {
+        std::cout << "RAW file reading complete." << std::endl;
+    }
+}
+
+/**
+ * @brief Makes voxels held by the caller (e.g. a simulation's field) the current material data.
+ * @details Replaces reading a RAW file, so a simulation can write and analyse its state without
+ * writing the volume to disk and reading it back. If every process stores exactly its padded
+ * slab (the slabs given to setupDomain, plus one plane of each neighbour, which the caller has
+ * to keep up to date), the caller's memory is used in place without copying; filters then
+ * change it. Otherwise the voxels are redistributed from the caller's decomposition into the
+ * slabs, e.g. from 3D blocks. The caller's memory must not change until the step is written.
+ * Must be called by all processes, after setupDomain.
+ * @param owned The voxels this process owns; the boxes of all processes tile the domain.
+ * @param stored The box the data holds, containing owned (e.g. with the caller's ghost layers).
+ * @param data The voxels of stored, laid out in IDX_SCHEME order (k fastest).
+ * @throws std::runtime_error if the boxes do not fit the domain, or with options which only
+ * apply to files (shared reads and label remapping).
+ */
+void Preprocessor::setMaterialData(const Domain &owned, const Domain &stored, RAWType *data)
+{
+    if (shared_read || !remap.empty())
+    {
+        throw std::runtime_error("Shared reads and label remapping only apply to RAW files, not to data in memory.");
+    }
+
+    Domain inside = Intersection(Intersection(owned, stored), global_domain);
+    int checks[3];
+    checks[0] = !(inside.origin == owned.origin) || !(inside.extent == owned.extent); // a bad box
+    checks[1] = !(stored.origin == material_data.padded.origin) || !(stored.extent == material_data.padded.extent) || !(owned.origin == local_domain.origin) || !(owned.extent == local_domain.extent); // a copy is needed
+    checks[2] = !from_caller || !(owned.origin == caller_owned.origin) || !(owned.extent == caller_owned.extent); // the plan changed
+    MPI_Allreduce(MPI_IN_PLACE, checks, 3, MPI_INT, MPI_MAX, MPIDetails::Comm());
+
+    unsigned long long owned_size = owned.extent.size(), total_size = 0;
+    MPI_Allreduce(&owned_size, &total_size, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPIDetails::Comm());
+    if (checks[0] || total_size != global_domain.extent.size())
+    {
+        throw std::runtime_error("The boxes handed over do not tile the domain, or do not contain the voxels owned.");
+    }
+
+    SlabPtr<RAWType> view = ViewSlab(data, stored.extent.size());
+    if (!checks[1])
+    {
+        material_data.take(view);
+    }
+    else
+    {
+        if (checks[2])
+        {
+            from_caller.reset(new MPIRedistributor<IDX_SCHEME, IDX_SCHEME>(owned, material_data.padded));
+            caller_owned = owned;
+        }
+        MPIDomain<RAWType, 0, IDX_SCHEME> source;
+        source.setExtents(owned.origin, owned.extent, stored);
+        source.take(view);
+        material_data.allocate();
+        material_data.clearPacked();
+        from_caller->redistribute(source, material_data, MPI_RAW_TYPE);
+    }
+    material_loaded = true;
+
+    if (mpi_rank == 0)
+    {
+        std::cout << "Material data handed over " << (checks[1] ? "(redistributed)." : "(in place).") << std::endl;
+    }
+}
+
+/**
+ * @brief Copies a box of a domain into a buffer ordered with i fastest, as VTK expects.
+ * @param dom The domain, the box must lie inside its padded region.
+ * @param box The voxels to copy.
+ * @param out Destination for box.extent.size() values.
+ */
+template <typename V, int P>
+static void CopyInVtkOrder(MPIDomain<V, P, IDX_SCHEME> &dom, const Domain &box, V *out)
+{
+    const Strides<XFastest> vtk(box);
+    if (IDX_SCHEME == XFastest)
+    {
+        // memory and VTK order agree, so every span is a single copy
+        dom.forEachSpan(box, [&](const Span<V> &span)
+        {
+            std::memcpy(out + vtk.offset(span.start.i, span.start.j, span.start.k), span.data, span.length * sizeof(V));
+        });
+        return;
+    }
+
+    // Rows run along k in memory but along i in VTK order. Transposing a few k at a time keeps
+    // the destination rows in cache while successive memory rows (i) are scattered into them.
+    const int tile = 64;
+    for (int j = box.origin.j; j < box.origin.j + box.extent.j; ++j)
+    {
+        for (int kt = box.origin.k; kt < box.origin.k + box.extent.k; kt += tile)
+        {
+            Domain tile_box(int3(box.origin.i, j, kt), int3(box.extent.i, 1, std::min(tile, box.origin.k + box.extent.k - kt)));
+            dom.forEachRow(tile_box, [&](const Span<V> &row)
+            {
+                V *dst = out + vtk.offset(row.start.i, row.start.j, row.start.k);
+                for (size_t n = 0; n < row.length; ++n)
+                {
+                    dst[n * vtk.sk] = row.data[n];
+                }
+            });
+        }
+    }
+}
+
+/**
+ * @brief Makes a domain a view of an array of a .vti piece, in VTK order, as a redistribution target.
+ * @param out The array, or NULL (with an empty piece) for processes which write nothing.
+ */
+template <typename V>
+static void ViewVtkArray(MPIDomain<V, 0, XFastest> &view, const Domain &piece, V *out)
+{
+    view.setExtents(piece.origin, piece.extent, piece);
+    SlabPtr<V> slab = ViewSlab(out, out ? (size_t)piece.extent.i * piece.extent.j * piece.extent.k : 0);
+    view.take(slab);
+}
+
+/**
+ * @brief Computes the hash of every .vti piece from its voxels and the options.
+ * @details Must be called by all processes. Every process hashes the part of each piece within
+ * the voxels it owns, in file order (see HashInFileOrder), and sends it to the process writing
+ * the piece, which combines the parts of the processes the piece takes voxels from. A piece
+ * therefore only changes when its own voxels change, not when its neighbours' do. See
+ * setIncremental.
+ * @return The hash of each piece, indexed like piece_boxes.
+ */
+std::vector<unsigned long long> Preprocessor::pieceHashes()
+{
+    // Component ids and distances depend on every voxel of the domain
+    auto reach = [&](int piece) { return components || distances ? global_domain : piece_boxes[piece]; };
+
+    std::vector<int> writer_pieces(mpi_comm_size);
+    MPI_Allgather(&my_piece, 1, MPI_INT, writer_pieces.data(), 1, MPI_INT, MPIDetails::Comm());
+    std::vector<unsigned long long> parts(mpi_comm_size, 0), my_parts(mpi_comm_size, 0);
+    for (int proc = 0; proc < mpi_comm_size; ++proc)
+    {
+        if (writer_pieces[proc] >= 0)
+        {
+            Domain part = Intersection(local_domain, reach(writer_pieces[proc]));
+            parts[proc] = part.extent.size() > 0 ? HashInFileOrder(material_data, part) : 0;
+        }
+    }
+    MPI_Alltoall(parts.data(), 1, MPI_UNSIGNED_LONG_LONG, my_parts.data(), 1, MPI_UNSIGNED_LONG_LONG, MPIDetails::Comm());
+
+    // (piece, hash) of the piece this process writes
+    unsigned long long entry[2] = {(unsigned long long)piece_boxes.size(), 0};
+    if (my_piece >= 0)
+    {
+        const Domain &piece = piece_boxes[my_piece];
+        std::stringstream options;
+        options << "raw2vtk " << DATA_TYPE << " " << cell_data << " " << global_domain << " " << piece;
+        if (components)
+        {
+            options << " components";
+            for (size_t n = 0; n < component_phases.size(); ++n)
+            {
+                options << " " << (int)component_phases[n];
+            }
+        }
+        if (distances)
+        {
+            options << " distances";
+            for (size_t n = 0; n < distance_phases.size(); ++n)
+            {
+                options << " " << (int)distance_phases[n];
+            }
+            options << " to";
+            for (size_t n = 0; n < distance_targets.size(); ++n)
+            {
+                options << " " << (int)distance_targets[n];
+            }
+        }
+        if (!filter_steps.empty())
+        {
+            options << " filter " << filter_spec;
+        }
+
+        XXHash64 hash;
+        hash.update(options.str().data(), options.str().size());
+        for (int proc = 0; proc < mpi_comm_size; ++proc)
+        {
+            if (Intersection(MPISubIndex<IDX_SCHEME>::all_local_domains[proc], reach(my_piece)).extent.size() > 0)
+            {
+                hash.update(&my_parts[proc], sizeof(my_parts[proc]));
+            }
+        }
+        entry[0] = my_piece;
+        entry[1] = hash.digest();
+    }
+
+    std::vector<unsigned long long> entries(2 * mpi_comm_size);
+    MPI_Allgather(entry, 2, MPI_UNSIGNED_LONG_LONG, entries.data(), 2, MPI_UNSIGNED_LONG_LONG, MPIDetails::Comm());
+
+    std::vector<unsigned long long> hashes(piece_boxes.size());
+    for (int proc = 0; proc < mpi_comm_size; ++proc)
+    {
+        if (entries[2 * proc] < piece_boxes.size())
+        {
+            hashes[entries[2 * proc]] = entries[2 * proc + 1];
+        }
+    }
+    return hashes;
+}
+
+/**
+ * @brief Reads the piece hashes of a previous conversion on the root process and shares them.
+ * @details Must be called by all processes.
+ * @return The hash of each piece, empty if there is no (readable) manifest.
+ */
+static std::vector<unsigned long long> ReadManifest(const std::string &fname, int mpi_rank)
+{
+    std::vector<unsigned long long> hashes;
+    if (mpi_rank == 0)
+    {
+        std::ifstream fin(fname.c_str());
+        std::string line;
+        while (std::getline(fin, line))
+        {
+            if (line.empty() || line[0] == '#')
+            {
+                continue;
+            }
+            std::stringstream fields(line);
+            size_t piece;
+            unsigned long long hash;
+            if (!(fields >> piece >> std::hex >> hash) || piece != hashes.size())
+            {
+                // not a manifest we wrote, so every piece is rewritten
+                hashes.clear();
+                break;
+            }
+            hashes.push_back(hash);
+        }
+    }
+
+    unsigned long long count = hashes.size();
+    MPI_Bcast(&count, 1, MPI_UNSIGNED_LONG_LONG, 0, MPIDetails::Comm());
+    hashes.resize(count);
+    MPI_Bcast(hashes.data(), count, MPI_UNSIGNED_LONG_LONG, 0, MPIDetails::Comm());
+    return hashes;
+}
+
+/**
+ * @brief Writes the piece hashes of a conversion, see ReadManifest.
+ */
+static void WriteManifest(const std::string &fname, const std::vector<unsigned long long> &hashes)
+{
+    std::ofstream fout(fname.c_str());
+    fout << "# raw2vtk manifest: piece and xxHash64 of its input and options" << std::endl;
+    for (size_t n = 0; n < hashes.size(); ++n)
+    {
+        fout << n << " " << std::hex << std::setw(16) << std::setfill('0') << hashes[n] << std::dec << std::endl;
+    }
+}
+
+/**
+ * @brief Writes the data to a set of VTK files.
+ * @details The root process writes a master .pvti file that references individual .vti
+ * part files written by each process.
+ * @param fname_root The base filename for the output files (e.g., "./output/material").
+ */
+void Preprocessor::writeVtkFile(const std::string &fname_root)
+{
+    // Write the master .pvti file on the root process
+    if (mpi_rank == 0)
+    {
+        std::stringstream pvti_fname;
+        pvti_fname << fname_root << ".pvti";
+        std::ofstream fout(pvti_fname.str());
+
+        fout << "<?xml version=\"1.0\"?>" << std::endl;
+        fout << "<VTKFile type=\"PImageData\" version=\"0.1\">" << std::endl;
+        // In cell data mode the grid has one more point than voxels in each direction
+        int last = cell_data ? 0 : 1;
+        std::string attributes = cell_data ? "PCellData" : "PPointData";
+
+        fout << "\t<PImageData WholeExtent=\"0 " << global_domain.extent.i - last
+             << " 0 " << global_domain.extent.j - last << " 0 "
+             << global_domain.extent.k - last << "\" ";
+        fout << "GhostLevel=\"0\" Origin=\"0 0 0\" Spacing=\"1 1 1\">" << std::endl;
+        fout << "\t\t<" << attributes << " Scalars=\"MaterialType\">" << std::endl;
+        fout << "\t\t\t<PDataArray type=\"" << VtkTypeName<RAWType>() << "\" Name=\"MaterialType\"/>" << std::endl;
+
+        if (components)
+        {
+            fout << "\t\t\t<PDataArray type=\"UInt32\" Name=\"ComponentId\"/>" << std::endl;
+        }
+        if (distances)
+        {
+            fout << "\t\t\t<PDataArray type=\"" << VtkTypeName<float>() << "\" Name=\"Distance\"/>" << std::endl;
+        }
+
+        fout << "\t\t</" << attributes << ">" << std::endl;
+
+        // Write the references to the part files with their corresponding extent
+        std::string root_basename = fname_root.substr(fname_root.find_last_of("/\\") + 1);
+        for (size_t n = 0; n < piece_boxes.size(); ++n)
+        {
+
+            // Point data pieces include the overlap with the next piece (see pieceBox),
+            // cell data pieces share their boundary points instead
+            const Domain &piece_dom = piece_boxes[n];
+
+            fout << "\t\t<Piece Extent=\"";
+            fout << piece_dom.origin.i << " " << piece_dom.origin.i + piece_dom.extent.i - last << " ";
+            fout << piece_dom.origin.j << " " << piece_dom.origin.j + piece_dom.extent.j - last << " ";
+            fout << piece_dom.origin.k << " " << piece_dom.origin.k + piece_dom.extent.k - last << "\" ";
+            fout << "Source=\"" << pieceFileName(root_basename, n) << "\"/>" << std::endl;
+        }
+        fout << "\t</PImageData>" << std::endl;
+        fout << "</VTKFile>" << std::endl;
+        fout.close();
+    }
+
+    // Ensure all processes wait for rank 0 to finish writing the master file
+    MPI_Barrier(MPIDetails::Comm());
+
+    // Bricks are written in rounds of one brick per process
+    if (brick_size > 0)
+    {
+        writeBricks(fname_root);
+        return;
+    }
+
+    // Each process (or aggregator) writes its own .vti part file
+    std::string vti_fname = pieceFileName(fname_root, my_piece);
+
+    // With incremental output, pieces with the same hash as in the previous conversion's
+    // manifest are kept as they are
+    bool writes = my_piece >= 0;
+    std::vector<unsigned long long> piece_hashes;
+    if (incremental)
+    {
+        piece_hashes = pieceHashes();
+        std::vector<unsigned long long> previous = ReadManifest(fname_root + ".manifest", mpi_rank);
+        struct stat filestatus;
+        writes = writes && !(previous.size() == piece_hashes.size() && previous[my_piece] == piece_hashes[my_piece] && stat(vti_fname.c_str(), &filestatus) == 0);
+    }
+
+    // Point data pieces include the first plane of the next piece, cell data pieces only
+    // hold their own voxels (as the cells of a grid one point larger)
+    writePiece(vti_fname, writes ? piece_boxes[my_piece] : Domain(), writes, to_pieces.get());
+
+    // The manifest is only updated once every piece has been written (the reduction
+    // completes on the root after all processes have contributed)
+    if (incremental)
+    {
+        int rewritten = writes;
+        int total_rewritten = 0;
+        MPI_Reduce(&rewritten, &total_rewritten, 1, MPI_INT, MPI_SUM, 0, MPIDetails::Comm());
+        if (mpi_rank == 0)
+        {
+            WriteManifest(fname_root + ".manifest", piece_hashes);
+            std::cout << "Incremental output: rewrote " << total_rewritten << " of " << piece_hashes.size() << " pieces." << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief The file name of a .vti piece.
+ * @details Pieces are numbered in the order of piece_boxes, bricks are named after their
+ * position in the brick grid (e.g. material_domain_2_0_1.vti) so that the names do not depend
+ * on the number of processes.
+ * @param fname_root The base filename of the output (with or without its directory).
+ * @param piece The index of the piece.
+ */
+std::string Preprocessor::pieceFileName(const std::string &fname_root, int piece) const
+{
+    std::stringstream fname;
+    fname << fname_root << "_";
+    if (brick_size > 0)
+    {
+        int3 grid = BrickGrid(brickTiling().extent, brick_size);
+        fname << piece / (grid.j * grid.k) << "_" << piece / grid.k % grid.j << "_" << piece % grid.k;
+    }
+    else
+    {
+        fname << piece;
+    }
+    fname << ".vti";
+    return fname.str();
+}
+
+/**
+ * @brief Writes one .vti piece from the domain buffers of the processes.
+ * @details Must be called by all processes. The voxels are copied straight into the mapped
+ * arrays of the file, or received straight into them if a redistributor is given.
+ * @param vti_fname The file to write.
+ * @param piece The voxels written (including any overlap with the next piece).
+ * @param writes Whether this process writes a piece (the others may still send voxels).
+ * @param redistributor Fills the piece from the slabs, or NULL to write from the slab.
+ */
+void Preprocessor::writePiece(const std::string &vti_fname, const Domain &piece, bool writes, MPIRedistributor<IDX_SCHEME, IDX_SCHEME> *redistributor)
+{
+    // The voxels are copied straight into the mapped arrays of the file
+    std::unique_ptr<MappedVtiFile> vti;
+    RAWType *type_out = NULL;
+    unsigned int *component_out = NULL;
+    float *distance_out = NULL;
+    if (writes)
+    {
+        size_t num_voxels_to_write = (size_t)piece.extent.i * piece.extent.j * piece.extent.k;
+        std::vector<MappedVtiFile::Array> arrays(1, MappedVtiFile::Array("MaterialType", VtkTypeName<RAWType>(), num_voxels_to_write * sizeof(RAWType)));
+        if (components)
+        {
+            arrays.push_back(MappedVtiFile::Array("ComponentId", VtkTypeName<unsigned int>(), num_voxels_to_write * sizeof(unsigned int)));
+        }
+        if (distances)
+        {
+            arrays.push_back(MappedVtiFile::Array("Distance", VtkTypeName<float>(), num_voxels_to_write * sizeof(float)));
+        }
+        vti.reset(new MappedVtiFile(vti_fname, piece, cell_data, arrays));
+        type_out = vti->data<RAWType>(0);
+        if (components)
+        {
+            component_out = vti->data<unsigned int>(1);
+        }
+        if (distances)
+        {
+            distance_out = vti->data<float>(arrays.size() - 1);
+        }
+    }
+
+    // Copy all voxels to be written (including the overlap) from the domain buffers to the file
+    if (redistributor)
+    {
+        // The boxes of the other processes are received straight into the mapped arrays (views
+        // in VTK order), so the piece is never staged. All transfers are started at once and
+        // finished one message at a time, packed boxes being unpacked into the file as they arrive.
+        MPIDomain<RAWType, 0, XFastest> type_view;
+        MPIDomain<unsigned int, 0, XFastest> component_view;
+        MPIDomain<float, 0, XFastest> distance_view;
+        ViewVtkArray(type_view, piece, type_out);
+        MPIRedistributor<IDX_SCHEME, IDX_SCHEME>::Exchange material_exch = redistributor->start(material_data, type_view, MPI_RAW_TYPE);
+        MPIRedistributor<IDX_SCHEME, IDX_SCHEME>::Exchange component_exch;
+        if (components)
+        {
+            ViewVtkArray(component_view, piece, component_out);
+            component_exch = redistributor->start(*components, component_view, MPI_UNSIGNED);
+        }
+        MPIRedistributor<IDX_SCHEME, IDX_SCHEME>::Exchange distance_exch;
+        if (distances)
+        {
+            ViewVtkArray(distance_view, piece, distance_out);
+            distance_exch = redistributor->start(*distances, distance_view, MPI_FLOAT);
+        }
+
+        redistributor->finish(material_exch);
+        if (components)
+        {
+            redistributor->finish(component_exch);
+        }
+        if (distances)
+        {
+            redistributor->finish(distance_exch);
+        }
+    }
+    else if (writes)
+    {
+        CopyInVtkOrder(material_data, piece, type_out);
+        if (components)
+        {
+            CopyInVtkOrder(*components, piece, component_out);
+        }
+        if (distances)
+        {
+            CopyInVtkOrder(*distances, piece, distance_out);
+        }
+    }
+
+    // Processes which only sent their voxels to an aggregator (or keep their piece) write nothing
+    if (vti)
+    {
+        vti->close();
+    }
+}
+
+/**
+ * @brief Writes the bricks of the output and the brick index.
+ * @details Must be called by all processes. Brick n is written by process n % size in round
+ * n / size, each round redistributing the slabs into one brick per process (see setBrickSize).
+ * The index lists the position, extent and file of every brick.
+ * @param fname_root The base filename for the output files (e.g., "./output/material").
+ */
+void Preprocessor::writeBricks(const std::string &fname_root)
+{
+    std::string root_basename = fname_root.substr(fname_root.find_last_of("/\\") + 1);
+    if (mpi_rank == 0)
+    {
+        std::ofstream fout((fname_root + ".bricks").c_str());
+        int last = cell_data ? 0 : 1;
+        int3 grid = BrickGrid(brickTiling().extent, brick_size);
+        fout << "# raw2vtk brick index: brick size, whole extent and " << (cell_data ? "cell" : "point") << " data, then the position, extent and file of each brick" << std::endl;
+        fout << brick_size << " " << global_domain.extent.i << " " << global_domain.extent.j << " " << global_domain.extent.k << " " << (cell_data ? "cell" : "point") << std::endl;
+        for (size_t n = 0; n < piece_boxes.size(); ++n)
+        {
+            const Domain &box = piece_boxes[n];
+            fout << n / (grid.j * grid.k) << " " << n / grid.k % grid.j << " " << n % grid.k << " "
+                 << box.origin.i << " " << box.origin.i + box.extent.i - last << " "
+                 << box.origin.j << " " << box.origin.j + box.extent.j - last << " "
+                 << box.origin.k << " " << box.origin.k + box.extent.k - last << " "
+                 << pieceFileName(root_basename, n) << std::endl;
+        }
+    }
+
+    for (size_t round = 0; round < brick_rounds.size(); ++round)
+    {
+        int n = (int)round * mpi_comm_size + mpi_rank;
+        bool writes = n < (int)piece_boxes.size();
+        writePiece(pieceFileName(fname_root, n), writes ? piece_boxes[n] : Domain(), writes, brick_rounds[round].get());
+    }
+}
+
+/**
+ * @brief Sets the morphological filters run on every file read.
+ * @param spec The filters, see ParseFilterChain.
+ * @throws std::runtime_error if the filters cannot be parsed.
+ */
+void Preprocessor::setFilters(const std::string &spec)
+{
+    filter_steps = ParseFilterChain(spec);
+    filter_spec = spec;
+    filter.reset();
+}
+
+/**
+ * @brief Runs the morphological filters on the owned voxels of the material domain.
+ * @details Must be called by all processes. The padding is refreshed afterwards, so the
+ * filtered materials are what is labelled, written and meshed.
+ */
+void Preprocessor::filterMaterials()
+{
+    if (filter_steps.empty())
+    {
+        return;
+    }
+    if (!filter)
+    {
+        filter.reset(new MPIMorphologyFilter<RAWType, IDX_SCHEME>(filter_steps));
+    }
+
+    // With shared reads the node's processes hold their neighbours' planes in the shared window,
+    // so their writes have to be visible before the padding exchange (which then receives the
+    // planes already there). A packed copy would no longer match the voxels.
+    material_data.clearPacked();
+    filter->apply(material_data, MPI_RAW_TYPE);
+    if (shared_read)
+    {
+        material_window->sync();
+    }
+    material_data.exchangePadding(MPI_RAW_TYPE);
+
+    if (mpi_rank == 0)
+    {
+        std::cout << "Filtered the materials (" << filter_spec << ")." << std::endl;
+    }
+}
+
+/**
+ * @brief Labels the connected components of the given materials.
+ * @details See MPIComponentLabeler; the component ids are added to the VTK output as
+ * a UInt32 "ComponentId" array.
+ * @param phases The material labels to compute components for (e.g. Pore and Air).
+ */
+void Preprocessor::labelComponents(const std::vector<RAWType> &phases)
+{
+    // the labels are kept between calls so that a series of files reuses their storage
+    if (!components)
+    {
+        components.reset(new MPIComponentLabeler<RAWType, 1, IDX_SCHEME>(material_data));
+    }
+    components->label(phases);
+    component_phases = phases;
+
+    if (mpi_rank == 0)
+    {
+        std::cout << "Connected component labelling complete: " << components->numComponents() << " components." << std::endl;
+    }
+}
+
+/**
+ * @brief Computes the Euclidean distance from the given materials to the nearest target.
+ * @details See MPIDistanceTransform; the distances are added to the VTK output as
+ * a Float32 "Distance" array.
+ * @param phases The materials to compute distances for (e.g. Pore).
+ * @param targets The materials to measure the distance to (e.g. Rock), every other material if empty.
+ */
+void Preprocessor::computeDistances(const std::vector<RAWType> &phases, const std::vector<RAWType> &targets)
+{
+    if (!distances)
+    {
+        distances.reset(new MPIDistanceTransform<RAWType, 1, IDX_SCHEME>(material_data));
+    }
+    distances->compute(phases, targets);
+    distance_phases = phases;
+    distance_targets = targets;
+
+    if (mpi_rank == 0)
+    {
+        std::cout << "Distance transform complete." << std::endl;
+    }
+}
+
+/**
+ * @brief Writes the material and voxel count of every labelled component.
+ * @param fname The name of the CSV file.
+ * @throws std::runtime_error if labelComponents has not been called.
+ */
+void Preprocessor::writeComponentCounts(const std::string &fname)
+{
+    if (!components)
+    {
+        throw std::runtime_error("No connected components have been labelled.");
+    }
+    components->writeCounts(fname);
+}
+
+/**
+ * @brief Extracts the boundary surface of every material and writes it as parallel VTK polydata.
+ * @details Each process extracts the voxel faces of its local domain, using the padding layer
+ * for neighbours on other processes. Root writes one .pvtp per material which references the
+ * .vtp piece written by every process.
+ * @param fname_root The base filename for the output files (e.g., "./output/material_surface").
+ * @throws std::runtime_error if built without VTK (USE_VTK).
+ */
+void Preprocessor::writeSurfaceFiles(const std::string &fname_root)
+{
+#ifndef USE_VTK
+    (void)fname_root;
+    throw std::runtime_error("Surfaces require a build with USE_VTK=1.");
+#else
+    MPISurfaceExtractor<RAWType, 1, IDX_SCHEME> extractor(material_data);
+    extractor.setCellData(cell_data);
+
+    for (int m = 0; m < NumPixelTypes; ++m)
+    {
+        std::string material_root = fname_root + "_" + PixelTypeName(AllPixelTypes[m]);
+
+        extractor.extract(AllPixelTypes[m]);
+
+        std::stringstream vtp_fname;
+        vtp_fname << material_root << "_" << mpi_rank << ".vtp";
+        extractor.writeVtp(vtp_fname.str());
+
+        unsigned long long local_triangles = extractor.numTriangles();
+        unsigned long long total_triangles = 0;
+        MPI_Reduce(&local_triangles, &total_triangles, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPIDetails::Comm());
+
+        if (mpi_rank == 0)
+        {
+            MPISurfaceExtractor<RAWType, 1, IDX_SCHEME>::WritePvtp(material_root, mpi_comm_size);
+            std::cout << "Surface of " << PixelTypeName(AllPixelTypes[m]) << ": " << total_triangles << " triangles." << std::endl;
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Writes orthogonal planes and projections of a RAW file as 2D .vti and .pgm images.
+ * @details Only the voxels of the requested planes are read (all of them for projections),
+ * by every process from its own slab of z planes, see MPIPreviewExtractor. Nothing of the
+ * size of the domain is allocated, so setupDomain need not be called. The labels are
+ * remapped (see setRemap); other processing options do not apply. Must be called by all
+ * processes.
+ * @param gextent The global extent of the domain, as for setupDomain.
+ * @param filename The path to the uncompressed .raw file, or a slice pattern.
+ * @param header_size The size of the file header (or of each raw slice's header) in bytes.
+ * @param planes The planes and projections to write, see ParsePreviewPlanes.
+ * @param fname_root The path and prefix of the image files.
+ * @throws std::runtime_error if the file is compressed or does not match the domain.
+ */
+void Preprocessor::writePreviews(int3 gextent, const std::string &filename, size_t header_size, const std::vector<PreviewPlane> &planes, const std::string &fname_root)
+{
+    global_domain.origin = int3();
+    global_domain.extent = gextent;
+
+    std::vector<std::string> slices;
+    if (IsSlicePattern(filename))
+    {
+        slices = SliceFiles(filename, global_domain.extent.i, mpi_rank);
+    }
+    else if (DetectCompression(filename) != Uncompressed)
+    {
+        throw std::runtime_error("Previews need an uncompressed RAW file (or slice stack) to read single planes from: " + filename);
+    }
+    else
+    {
+        checkFileSize(filename, header_size);
+    }
+
+    MPIPreviewExtractor<RAWType> extractor(global_domain, planes);
+    extractor.setRemap(remap);
+    extractor.extract(filename, slices, header_size, MPI_RAW_TYPE);
+
+    if (mpi_rank == 0)
+    {
+        std::vector<std::string> written = extractor.write(fname_root, cell_data);
+        std::cout << "Previews of " << filename << ":" << std::endl;
+        for (size_t n = 0; n < written.size(); ++n)
+        {
+            std::cout << "\t" << written[n] << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Serves subvolume queries on a memory mapped RAW file, see SubvolumeServer.
+ * @details Only the root process serves, on as many threads as set by setThreads, from
+ * bricks of the size set by setBrickSize (64 voxels if none). The labels are remapped (see
+ * setRemap) and .vti answers follow setCellData. Returns once a client asks the server to
+ * shut down.
+ * @param gextent The global extent of the domain, as for setupDomain.
+ * @param filename The path to the uncompressed .raw file.
+ * @param header_size The size of the file header in bytes.
+ * @param address A UNIX socket path, or a TCP port number on localhost.
+ * @param pack_bits The bits each cached voxel is packed into (2, 4 or 8), or 0 to keep the voxels as they are.
+ * @param cache_bytes The bytes of decoded (packed) bricks kept in memory.
+ * @param max_answer_bytes The largest answer to a GET (0 for no limit), see SubvolumeServer::setMaxAnswerBytes.
+ * @throws std::runtime_error if the file is compressed or does not match the domain.
+ */
+void Preprocessor::serveSubvolumes(int3 gextent, const std::string &filename, size_t header_size, const std::string &address, int pack_bits, size_t cache_bytes, size_t max_answer_bytes)
+{
+    if (mpi_rank != 0)
+    {
+        return;
+    }
+    if (DetectCompression(filename) != Uncompressed)
+    {
+        throw std::runtime_error("The server maps the RAW file, so it must be uncompressed: " + filename);
+    }
+    if (mpi_comm_size > 1)
+    {
+        std::cout << "Only rank 0 serves; the other " << mpi_comm_size - 1 << " processes are idle." << std::endl;
+    }
+
+    global_domain.origin = int3();
+    global_domain.extent = gextent;
+    SubvolumeServer<RAWType> server(filename, header_size, global_domain, brick_size > 0 ? brick_size : 64, pack_bits > 0 ? pack_bits : 8 * (int)sizeof(RAWType), cache_bytes);
+    server.setRemap(remap);
+    server.setCellData(cell_data);
+    server.setMaxAnswerBytes(max_answer_bytes);
+    server.serve(address, Threads::Count());
+}
+
+/**
+ * @brief Runs the filters and analyses on the current material data and writes its output.
+ * @details One step of a conversion (or of a simulation handing over its data, see
+ * setMaterialData): the VTK files, then the component counts and surfaces if selected.
+ * With packing (see setPackBits) the materials are packed once, after the analyses.
+ * Must be called by all processes.
+ * @param outputs The analyses to run and what to write.
+ * @param out_dir The directory of the output files, which must exist.
+ * @param step Appended to the output file names, e.g. "_0003" for a time series.
+ * @return The .pvti file written, relative to out_dir (for writePvdFile).
+ */
+std::string Preprocessor::processStep(const StepOutputs &outputs, const std::string &out_dir, const std::string &step)
+{
+    filterMaterials();
+
+    if (!outputs.components.empty())
+    {
+        labelComponents(outputs.components);
+    }
+    if (!outputs.distance_phases.empty())
+    {
+        computeDistances(outputs.distance_phases, outputs.distance_targets);
+    }
+
+    packMaterials();
+    writeVtkFile(out_dir + "/material_domain" + step);
+
+    if (!outputs.components.empty())
+    {
+        writeComponentCounts(out_dir + "/material_components" + step + ".csv");
+    }
+    if (outputs.surfaces)
+    {
+        writeSurfaceFiles(out_dir + "/material_surface" + step);
+    }
+    return "material_domain" + step + ".pvti";
+}
+
+/**
+ * @brief Writes a .pvd collection file referencing a series of outputs as time steps.
+ * @details Only the root process writes the file.
+ * @param fname The name of the .pvd file.
+ * @param datasets The files of each time step, relative to the .pvd file.
+ */
+void Preprocessor::writePvdFile(const std::string &fname, const std::vector<std::string> &datasets)
+{
+    if (mpi_rank != 0)
+    {
+        return;
+    }
+
+    std::ofstream fout(fname.c_str());
+    fout << "<?xml version=\"1.0\"?>" << std::endl;
+    fout << "<VTKFile type=\"Collection\" version=\"0.1\">" << std::endl;
+    fout << "\t<Collection>" << std::endl;
+    for (size_t n = 0; n < datasets.size(); ++n)
+    {
+        fout << "\t\t<DataSet timestep=\"" << n << "\" group=\"\" part=\"0\" file=\"" << datasets[n] << "\"/>" << std::endl;
+    }
+    fout << "\t</Collection>" << std::endl;
+    fout << "</VTKFile>" << std::endl;
 }
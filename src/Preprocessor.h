@@ -2,37 +2,230 @@
 #define PREPROCESSOR_H_
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <ostream>
 #include "compiler_opts.h"
 #include "MPIDomain.h"
 #include "MPIRawLoader.h"
+#include "MPIComponentLabeler.h"
+#include "MPIDistanceTransform.h"
+#include "MPIRedistributor.h"
+#include "MPIMorphologyFilter.h"
+#include "MPINodeWindow.h"
+#include "MPIPreviewExtractor.h"
+#include "SubvolumeServer.h"
+
+// A run whose memory use and output are predicted rather than carried out (see Preprocessor::plan)
+struct RunPlan
+{
+    int num_procs;      // MPI processes
+    int procs_per_node; // MPI processes sharing a node's memory
+    size_t num_files;   // RAW files converted (more than one reads the next file while writing)
+    bool components;    // connected components are labelled
+    bool distances;     // the distance transform is computed
+    double node_memory; // bytes of memory per node, 0 if unknown
+};
+
+// The analyses and outputs of each step of a conversion (see Preprocessor::processStep)
+struct StepOutputs
+{
+    std::vector<RAWType> components;       // materials whose connected components are labelled (none if empty)
+    std::vector<RAWType> distance_phases;  // materials whose distances are computed (none if empty)
+    std::vector<RAWType> distance_targets; // materials the distances are measured to (every other material if empty)
+    bool surfaces;                         // the boundary surface of each material is extracted
+};
 
 class Preprocessor
 {
 public:
-    Preprocessor();
+    // Shares the work among the processes of comm, e.g. a simulation's communicator when
+    // raw2vtk is linked into it as a library. The communicator is process-wide (see
+    // MPIDetails::AcquireComm): Preprocessors alive at the same time must share it
+    explicit Preprocessor(MPI_Comm comm = MPI_COMM_WORLD);
     virtual ~Preprocessor();
 
     // Sets up the global domain and decomposes it for each MPI process
     void setupDomain(int3 global_extent);
 
-    // Reads the raw image data from the specified file
+    // Sets up the global domain with the slab of each process given by the caller, e.g. the
+    // decomposition of a simulation whose voxels are handed over with setMaterialData
+    void setupDomain(int3 global_extent, const Domain &local);
+
+    // Writes voxels as cell data (pieces without overlap) instead of point data
+    void setCellData(bool cell_data);
+
+    // Writes the .vti pieces as 3D blocks (redistributed from the slabs read) rather than slabs;
+    // must be called before setupDomain
+    void setOutputBlocks(bool output_blocks);
+
+    // Has only num_aggregators processes (0 for one per node) write .vti pieces, each merging
+    // the slabs of its neighbours; must be called before setupDomain
+    void setIoAggregators(int num_aggregators);
+
+    // Writes the output as cubic bricks of a fixed size, whose layout and names do not depend on
+    // the number of processes, plus an index of the bricks; must be called before setupDomain
+    void setBrickSize(int brick_size);
+
+    // Has one process per node read the node's slabs into memory shared by the node's processes;
+    // must be called before setupDomain
+    void setSharedRead(bool shared_read);
+
+    // Only rewrites the .vti pieces whose input or options changed since the last conversion
+    // into the same files (recorded in a manifest next to the .pvti)
+    void setIncremental(bool incremental);
+
+    // Sends the material labels bit-packed into 2, 4 or 8 bits (0 for unpacked) when they are
+    // redistributed to the output pieces
+    void setPackBits(int bits);
+
+    // Renumbers the material labels while reading, from a file of pairs or "from:to,from:to"
+    void setRemap(const std::string &spec);
+
+    // Prints the decomposition, memory use and output of a run without allocating or reading anything
+    void plan(int3 global_extent, const RunPlan &run, std::ostream &out);
+
+    // Writes orthogonal planes and maximum intensity projections of a RAW file (or slice stack)
+    // as small 2D images, reading only the voxels they need rather than converting the volume
+    void writePreviews(int3 global_extent, const std::string &filename, size_t header_size, const std::vector<PreviewPlane> &planes, const std::string &fname_root);
+
+    // Serves subvolume queries on a RAW file from a cache of (bit-packed) bricks until asked to
+    // shut down (on the root process; the others return at once)
+    void serveSubvolumes(int3 global_extent, const std::string &filename, size_t header_size, const std::string &address, int pack_bits, size_t cache_bytes, size_t max_answer_bytes);
+
+    // Sets the number of threads each process uses for reading
+    void setThreads(int threads);
+
+    // Reads the raw image data from the specified file (optionally gzip or zstd compressed)
     void readRawFile(const std::string &filename, size_t header_size);
 
+    // Split version of readRawFile which reads in the background while the current data is processed
+    void startRawFileRead(const std::string &filename, size_t header_size);
+    void finishRawFileRead();
+
+    // Uses voxels held by the caller instead of reading a RAW file: in place if each process
+    // stores its padded slab, otherwise redistributed from the caller's decomposition
+    void setMaterialData(const Domain &owned, const Domain &stored, RAWType *data);
+
+    // Filters, analyses and writes the current material data as one step of the output,
+    // returning the .pvti written
+    std::string processStep(const StepOutputs &outputs, const std::string &out_dir, const std::string &step);
+
     // Writes the material domain to a VTK file set
     void writeVtkFile(const std::string &fname_root);
 
+    // Sets the chain of morphological filters run by filterMaterials, e.g. "median:1,open:2:cube"
+    void setFilters(const std::string &spec);
+
+    // Runs the filters on the material domain (before it is labelled and written)
+    void filterMaterials();
+
+    // Labels the connected components of the given materials (written with the VTK files)
+    void labelComponents(const std::vector<RAWType> &phases);
+
+    // Computes the distance from every voxel of the given materials to the nearest voxel of the
+    // targets (every other material if empty), written with the VTK files
+    void computeDistances(const std::vector<RAWType> &phases, const std::vector<RAWType> &targets);
+
+    // Writes the material and voxel count of every labelled component to a CSV file
+    void writeComponentCounts(const std::string &fname);
+
+    // Extracts the boundary surface of each material and writes one .pvtp per material
+    void writeSurfaceFiles(const std::string &fname_root);
+
+    // Writes a .pvd collection referencing a series of outputs as time steps (root only)
+    void writePvdFile(const std::string &fname, const std::vector<std::string> &datasets);
+
 private:
     template <IndexScheme S>
     void decomposeDomain();
 
+    Domain pieceBox(const Domain &owned) const;
+    Domain brickTiling() const;
+    std::string pieceFileName(const std::string &fname_root, int piece) const;
+    void writePiece(const std::string &vti_fname, const Domain &piece, bool writes, MPIRedistributor<IDX_SCHEME, IDX_SCHEME> *redistributor);
+    void writeBricks(const std::string &fname_root);
+
+    // The voxels a process holds and writes in a planned run (see plan)
+    struct ProcessPlan
+    {
+        Domain owned;  // read from the file
+        Domain padded; // stored, including the padding
+        Domain output; // redistributed for writing (with output_blocks or io_aggregators)
+        Domain piece;  // written to its .vti piece (empty if it writes none)
+    };
+    std::vector<unsigned long long> pieceHashes();
+
+    std::vector<ProcessPlan> planProcesses(int num_procs, int procs_per_node) const;
+    double nodeMemory(const std::vector<ProcessPlan> &procs, const RunPlan &run, double &proc_peak) const;
+
+    void checkFileSize(const std::string &filename, size_t header_size);
+    void startSharedRead(const std::string &filename, size_t header_size, const std::vector<std::string> &slices);
+    void packMaterials();
+
     int mpi_rank;
     int mpi_comm_size;
 
     Domain local_domain;  // The part of the domain this process owns
     Domain global_domain; // The full simulation domain
 
+    bool cell_data; // Write voxels as cell data rather than point data
+    bool output_blocks; // Write 3D blocks rather than the slabs
+    int io_aggregators; // Number of processes writing pieces (0 for one per node, -1 for all)
+    int brick_size;     // Edge length of the output bricks (0 to write one piece per process)
+
+    // The voxels written to each .vti piece, and the piece written by this process (-1 for none)
+    std::vector<Domain> piece_boxes;
+    int my_piece;
+
     // Data storage for the material types from the RAW file
     MPIDomain<RAWType, 1, IDX_SCHEME> material_data;
+
+    // Reads the next RAW file; its buffer is swapped with material_data once the read completes
+    MPIRawLoader<RAWType, 1, IDX_SCHEME> loader;
+    std::future<void> pending_read;
+    bool material_loaded; // material_data holds a file which has been read
+
+    // With shared_read, material_data views a window holding the slabs of the whole node, which
+    // the node's first process (node_leader) reads; the next file is read into read_window
+    bool shared_read;
+    bool node_leader;
+    std::unique_ptr<MPINodeWindow<RAWType, IDX_SCHEME> > material_window;
+    std::unique_ptr<MPINodeWindow<RAWType, IDX_SCHEME> > read_window;
+    MPIRawLoader<RAWType, 0, IDX_SCHEME> node_loader;
+
+    // Connected component ids, only present once labelComponents has been called
+    std::unique_ptr<MPIComponentLabeler<RAWType, 1, IDX_SCHEME> > components;
+    std::vector<RAWType> component_phases;
+
+    // Distances to the nearest target material, only present once computeDistances has been called
+    std::unique_ptr<MPIDistanceTransform<RAWType, 1, IDX_SCHEME> > distances;
+    std::vector<RAWType> distance_phases;
+    std::vector<RAWType> distance_targets;
+
+    // Labels renumbered while reading (also applied to previews)
+    LabelRemap<RAWType> remap;
+
+    // Morphological filters, kept between calls so that a series of files reuses their storage
+    std::string filter_spec;
+    std::vector<MorphologyStep> filter_steps;
+    std::unique_ptr<MPIMorphologyFilter<RAWType, IDX_SCHEME> > filter;
+
+    // Whether only the pieces whose voxels or options changed are written, see pieceHashes
+    bool incremental;
+
+    // Bits the material labels are packed into at rest (0 for unpacked), see setPackBits
+    int pack_bits;
+
+    // Fills the slabs from the decomposition of voxels handed over by the caller, planned for
+    // the boxes it owned last (see setMaterialData)
+    std::unique_ptr<MPIRedistributor<IDX_SCHEME, IDX_SCHEME> > from_caller;
+    Domain caller_owned;
+
+    // The output pieces and how they are filled from the slabs (only with output_blocks or io_aggregators)
+    std::unique_ptr<MPIRedistributor<IDX_SCHEME, IDX_SCHEME> > to_pieces;
+    std::vector<std::unique_ptr<MPIRedistributor<IDX_SCHEME, IDX_SCHEME> > > brick_rounds; // one brick per process each
 };
 
 #endif /* PREPROCESSOR_H_ */
\ No newline at end of file
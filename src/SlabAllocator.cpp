@@ -0,0 +1,129 @@
+#include "SlabAllocator.h"
+#include <new>
+#include <cstring>
+#include <sys/mman.h>
+
+using namespace std;
+
+bool SlabAllocator::huge_pages = true;
+
+static const size_t HugePage2M = size_t(1) << 21;
+static const size_t HugePage1G = size_t(1) << 30;
+
+SlabAllocator::SlabAllocator()
+{
+}
+
+SlabAllocator::~SlabAllocator()
+{
+}
+
+/**
+ * @brief Enables or disables huge pages for subsequent allocations.
+ */
+void SlabAllocator::SetHugePages(bool enable)
+{
+	huge_pages = enable;
+}
+
+static size_t RoundUp(size_t bytes, size_t page)
+{
+	return (bytes + page - 1) / page * page;
+}
+
+/**
+ * @brief Allocates (uninitialised) memory for a buffer.
+ * @details Small buffers come from the heap. Larger ones are mapped, trying 1 GB and then
+ * 2 MB huge pages before falling back to normal pages with transparent huge pages requested.
+ * @param bytes The size of the buffer.
+ * @param source Set to how the memory was obtained, needed to free it.
+ * @throws std::bad_alloc if no memory could be allocated.
+ */
+void *SlabAllocator::Allocate(size_t bytes, SlabSource &source)
+{
+	if (bytes < HugePage2M)
+	{
+		source = SlabHeap;
+		return ::operator new(bytes == 0 ? 1 : bytes);
+	}
+
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (huge_pages)
+	{
+#ifdef MAP_HUGE_1GB
+		if (bytes >= HugePage1G)
+		{
+			p = mmap(NULL, RoundUp(bytes, HugePage1G), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+			if (p != MAP_FAILED)
+			{
+				source = SlabHuge1G;
+				return p;
+			}
+		}
+#endif
+		p = mmap(NULL, RoundUp(bytes, HugePage2M), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			source = SlabHuge2M;
+			return p;
+		}
+	}
+#endif
+
+	p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		throw bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+	if (huge_pages)
+		madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+	source = SlabMapped;
+	return p;
+}
+
+/**
+ * @brief Frees memory obtained from Allocate.
+ * @param p The memory.
+ * @param bytes The size passed to Allocate.
+ * @param source How the memory was obtained.
+ */
+void SlabAllocator::Free(void *p, size_t bytes, SlabSource source)
+{
+	if (p == NULL)
+		return;
+
+	switch (source)
+	{
+	case SlabHeap:
+		::operator delete(p);
+		break;
+	case SlabMapped:
+		munmap(p, bytes);
+		break;
+	case SlabHuge2M:
+		munmap(p, RoundUp(bytes, HugePage2M));
+		break;
+	case SlabHuge1G:
+		munmap(p, RoundUp(bytes, HugePage1G));
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief Zeroes a buffer using the worker threads.
+ * @details Each worker touches the block it will be given by Threads::ParallelFor, whose blocks
+ * always run on the same pinned workers, so with first-touch placement the pages end up on the
+ * NUMA node of the worker which processes them later.
+ */
+void SlabAllocator::FirstTouch(void *p, size_t bytes)
+{
+	char *bytes_p = (char *)p;
+	Threads::ParallelFor(bytes, [bytes_p](size_t begin, size_t end)
+	{
+		memset(bytes_p + begin, 0, end - begin);
+	});
+}
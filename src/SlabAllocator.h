@@ -0,0 +1,108 @@
+#ifndef SLABALLOCATOR_H_
+#define SLABALLOCATOR_H_
+
+#include <memory>
+#include <cstddef>
+#include "Threads.h"
+
+/*
+ * Allocation of the (large) voxel buffers held by MPIDomain.
+ *
+ * Buffers of at least one huge page are mapped with 1 GB or 2 MB
+ * huge pages when the system has them reserved, otherwise with
+ * normal pages and a request for transparent huge pages. Every
+ * buffer is zeroed by the worker threads (see Threads) right after
+ * allocation, so its pages are placed on the NUMA node of the threads
+ * which process them rather than wherever the first write happens.
+ *
+ * The deleter of a SlabPtr remembers how and how much memory was
+ * allocated, which lets MPIDomain reuse a buffer that is already
+ * large enough instead of allocating a new one. Views wrap memory
+ * owned by someone else and never free it.
+ */
+
+enum SlabSource
+{
+	SlabNone,
+	SlabHeap,
+	SlabMapped,
+	SlabHuge2M,
+	SlabHuge1G,
+	SlabView
+};
+
+class SlabAllocator
+{
+public:
+	static void *Allocate(size_t bytes, SlabSource &source);
+	static void Free(void *p, size_t bytes, SlabSource source);
+	static void FirstTouch(void *p, size_t bytes);
+
+	static void SetHugePages(bool enable);
+
+private:
+	SlabAllocator();
+	virtual ~SlabAllocator();
+
+	static bool huge_pages;
+};
+
+template <typename T>
+struct SlabDeleter
+{
+	SlabDeleter()
+		: count(0), source(SlabNone)
+	{
+	}
+
+	SlabDeleter(size_t count, SlabSource source)
+		: count(count), source(source)
+	{
+	}
+
+	void operator()(T *p) const
+	{
+		SlabAllocator::Free(p, count * sizeof(T), source);
+	}
+
+	size_t count; // number of elements the buffer holds
+	SlabSource source;
+};
+
+template <typename T>
+using SlabPtr = std::unique_ptr<T[], SlabDeleter<T> >;
+
+/**
+ * @brief Allocates a zero initialised buffer, first touched by the worker threads.
+ * @param count The number of elements.
+ */
+template <typename T>
+SlabPtr<T> AllocateSlab(size_t count)
+{
+	SlabSource source;
+	void *p = SlabAllocator::Allocate(count * sizeof(T), source);
+	SlabAllocator::FirstTouch(p, count * sizeof(T));
+	return SlabPtr<T>((T *)p, SlabDeleter<T>(count, source));
+}
+
+/**
+ * @brief Wraps memory owned elsewhere; it is not freed when the SlabPtr goes away.
+ * @param p The memory, which must outlive the view.
+ * @param count The number of elements.
+ */
+template <typename T>
+SlabPtr<T> ViewSlab(T *p, size_t count)
+{
+	return SlabPtr<T>(p, SlabDeleter<T>(count, SlabView));
+}
+
+/**
+ * @brief Gets the number of elements a buffer can hold (0 if there is none).
+ */
+template <typename T>
+size_t SlabCapacity(const SlabPtr<T> &slab)
+{
+	return slab ? slab.get_deleter().count : 0;
+}
+
+#endif /* SLABALLOCATOR_H_ */
@@ -0,0 +1,232 @@
+#include "SliceStack.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <glob.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/**
+ * @brief Whether a file name is a pattern naming the slices of a stack.
+ * @details Patterns hold a printf style integer conversion (e.g. %04d) or glob wildcards.
+ */
+bool IsSlicePattern(const string &fname)
+{
+	size_t percent = fname.find('%');
+	if (percent != string::npos)
+	{
+		size_t conversion = fname.find_first_not_of("0123456789", percent + 1);
+		if (conversion != string::npos && fname[conversion] == 'd')
+			return true;
+	}
+	return fname.find_first_of("*?[") != string::npos;
+}
+
+static bool FileExists(const string &fname)
+{
+	struct stat filestatus;
+	return stat(fname.c_str(), &filestatus) == 0;
+}
+
+static string FormatSlice(const string &pattern, int number)
+{
+	vector<char> name(pattern.size() + 32);
+	snprintf(name.data(), name.size(), pattern.c_str(), number);
+	return string(name.data());
+}
+
+/**
+ * @brief Lists the slice files of a stack, from the lowest z to the highest.
+ * @param pattern A printf style pattern, whose slices are numbered from 0 or (if there is no
+ * slice 0) from 1, or a glob pattern, whose matches are taken in sorted order.
+ * @param num_slices The number of slices expected (the z extent).
+ * @throws std::runtime_error if the pattern does not name exactly num_slices existing files.
+ */
+vector<string> ExpandSlicePattern(const string &pattern, int num_slices)
+{
+	vector<string> slices;
+	if (pattern.find('%') != string::npos)
+	{
+		int first = FileExists(FormatSlice(pattern, 0)) ? 0 : 1;
+		for (int n = 0; n < num_slices; ++n)
+		{
+			slices.push_back(FormatSlice(pattern, first + n));
+			if (!FileExists(slices.back()))
+				throw runtime_error("Missing slice file " + slices.back() + " (" + to_string(num_slices) + " slices expected from " + pattern + ").");
+		}
+		return slices;
+	}
+
+	glob_t matches;
+	if (glob(pattern.c_str(), 0, NULL, &matches) == 0)
+	{
+		for (size_t n = 0; n < matches.gl_pathc; ++n)
+			slices.push_back(matches.gl_pathv[n]);
+	}
+	globfree(&matches);
+	if ((int)slices.size() != num_slices)
+		throw runtime_error("The pattern " + pattern + " matches " + to_string(slices.size()) + " slice files, expected " + to_string(num_slices) + ".");
+	return slices;
+}
+
+/*
+ * The few parts of a TIFF file needed to locate the strips of a grey scale image
+ */
+class TiffReader
+{
+public:
+	TiffReader(const string &fname, ifstream &fin) : fname(fname), fin(fin)
+	{
+		char order[2];
+		fin.read(order, 2);
+		big_endian = order[0] == 'M';
+		if (!fin || order[0] != order[1] || (order[0] != 'I' && order[0] != 'M') || get(2) != 42)
+			throw runtime_error(fname + " is not a (classic) TIFF file.");
+	}
+
+	// an unsigned integer of the given size at the current position
+	unsigned long get(int bytes)
+	{
+		unsigned char b[4] = {0, 0, 0, 0};
+		fin.read((char *)b, bytes);
+		unsigned long v = 0;
+		for (int n = 0; n < bytes; ++n)
+			v |= (unsigned long)b[big_endian ? bytes - 1 - n : n] << (8 * n);
+		return v;
+	}
+
+	// the values of a SHORT or LONG field whose 12 byte entry starts at the current position
+	vector<unsigned long> values()
+	{
+		int type = get(2);
+		unsigned long count = get(4);
+		int size = type == 3 ? 2 : type == 4 ? 4 : 0;
+		if (size == 0)
+			throw runtime_error("Unsupported TIFF field type in " + fname + ".");
+
+		streampos next = fin.tellg() + streamoff(4);
+		if (count * size > 4)
+			fin.seekg(get(4));
+		vector<unsigned long> v(count);
+		for (unsigned long n = 0; n < count; ++n)
+			v[n] = get(size);
+		fin.seekg(next);
+		return v;
+	}
+
+	bool big_endian;
+
+private:
+	const string &fname;
+	ifstream &fin;
+};
+
+/**
+ * @brief Finds where the rows of a slice file are stored and checks its size.
+ * @details TIFF files are recognised by their magic bytes, anything else is taken to be raw
+ * voxels after a header.
+ * @param fname The slice file.
+ * @param width The number of voxels in a row (the x extent).
+ * @param height The number of rows (the y extent).
+ * @param voxel_bytes The size of a voxel.
+ * @param header The size of the header of a raw slice in bytes.
+ * @throws std::runtime_error if the file cannot be read or does not hold a slice of the given size.
+ */
+SliceLayout ReadSliceLayout(const string &fname, int width, int height, size_t voxel_bytes, size_t header)
+{
+	ifstream fin(fname.c_str(), ios::binary);
+	if (!fin.is_open())
+		throw runtime_error("Cannot open slice file " + fname + "!");
+
+	SliceLayout layout;
+	layout.swap_bytes = false;
+	const unsigned long long row_bytes = (unsigned long long)width * voxel_bytes;
+
+	char magic[4] = {0, 0, 0, 0};
+	fin.read(magic, 4);
+	bool tiff = fin.gcount() == 4 && ((magic[0] == 'I' && magic[1] == 'I' && magic[2] == 42 && magic[3] == 0) || (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && magic[3] == 42));
+	fin.clear();
+	fin.seekg(0);
+
+	if (!tiff)
+	{
+		struct stat filestatus;
+		if (stat(fname.c_str(), &filestatus) != 0)
+			throw runtime_error("Cannot get file status for " + fname);
+		if ((unsigned long long)filestatus.st_size != header + row_bytes * height)
+		{
+			stringstream msg;
+			msg << "Slice file size does not match the x and y extents." << endl;
+			msg << "\tFile size on disk of " << fname << ": " << filestatus.st_size << " bytes." << endl;
+			msg << "\tExpected size: " << header + row_bytes * height << " bytes (including a " << header << " byte header).";
+			throw runtime_error(msg.str());
+		}
+		SliceStrip strip = {0, height, header};
+		layout.strips.push_back(strip);
+		return layout;
+	}
+
+	// the first image of the file
+	TiffReader tiff_file(fname, fin);
+	layout.swap_bytes = tiff_file.big_endian && voxel_bytes > 1;
+	fin.seekg(tiff_file.get(4));
+	int num_entries = tiff_file.get(2);
+	unsigned long tiff_width = 0, tiff_height = 0, bits = 1, compression = 1, samples = 1, rows_per_strip = 0;
+	vector<unsigned long> offsets, counts;
+	for (int e = 0; e < num_entries && fin; ++e)
+	{
+		streampos entry = fin.tellg();
+		int tag = tiff_file.get(2);
+		switch (tag)
+		{
+		case 256: tiff_width = tiff_file.values()[0]; break;
+		case 257: tiff_height = tiff_file.values()[0]; break;
+		case 258: bits = tiff_file.values()[0]; break;
+		case 259: compression = tiff_file.values()[0]; break;
+		case 273: offsets = tiff_file.values(); break;
+		case 277: samples = tiff_file.values()[0]; break;
+		case 278: rows_per_strip = tiff_file.values()[0]; break;
+		case 279: counts = tiff_file.values(); break;
+		case 322: throw runtime_error("Tiled TIFF files are not supported: " + fname);
+		}
+		fin.seekg(entry + streamoff(12));
+	}
+	if (!fin)
+		throw runtime_error("Error reading the TIFF header of " + fname + "!");
+
+	if ((int)tiff_width != width || (int)tiff_height != height || bits != 8 * voxel_bytes || samples != 1)
+	{
+		stringstream msg;
+		msg << "Slice " << fname << " is " << tiff_width << " x " << tiff_height << " with " << samples << " sample(s) of " << bits
+			<< " bits, expected " << width << " x " << height << " with one sample of " << 8 * voxel_bytes << " bits.";
+		throw runtime_error(msg.str());
+	}
+	if (compression != 1)
+		throw runtime_error("Compressed TIFF files are not supported: " + fname);
+
+	if (rows_per_strip == 0 || rows_per_strip > (unsigned long)height)
+		rows_per_strip = height;
+	if (offsets.size() != (height + rows_per_strip - 1) / rows_per_strip || counts.size() != offsets.size())
+		throw runtime_error("Unexpected number of strips in " + fname + ".");
+
+	for (size_t s = 0; s < offsets.size(); ++s)
+	{
+		SliceStrip strip = {(int)(s * rows_per_strip), (int)min((unsigned long)height - s * rows_per_strip, rows_per_strip), offsets[s]};
+		if (counts[s] < strip.num_rows * row_bytes)
+			throw runtime_error("A strip of " + fname + " is shorter than its rows.");
+		layout.strips.push_back(strip);
+	}
+	return layout;
+}
+
+/**
+ * @brief Reverses the byte order of every voxel of a range.
+ */
+void SwapVoxelBytes(char *bytes, size_t num_bytes, size_t voxel_bytes)
+{
+	for (size_t v = 0; v + voxel_bytes <= num_bytes; v += voxel_bytes)
+		reverse(bytes + v, bytes + v + voxel_bytes);
+}
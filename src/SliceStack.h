@@ -0,0 +1,41 @@
+#ifndef SLICESTACK_H_
+#define SLICESTACK_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/*
+ * Helpers for volumes stored as a stack of 2D slice files, one per plane
+ * of constant z (the slowest direction of a RAW file), as many CT
+ * reconstructions are delivered. The stack is named by a printf style
+ * pattern (e.g. "scan_%04d.tif", numbered from 0 or 1) or a glob pattern
+ * (e.g. "scan_*.raw", sorted by name).
+ *
+ * Each slice is either raw voxels (after a header) or an uncompressed
+ * baseline TIFF with one sample per pixel of the voxel size. A slice is
+ * described by the strips of rows it stores, so that a process can read
+ * just the rows and columns of its own domain.
+ */
+
+bool IsSlicePattern(const std::string &fname);
+std::vector<std::string> ExpandSlicePattern(const std::string &pattern, int num_slices);
+
+// consecutive rows of a slice stored one after the other in its file
+struct SliceStrip
+{
+	int first_row;
+	int num_rows;
+	unsigned long long offset;
+};
+
+struct SliceLayout
+{
+	std::vector<SliceStrip> strips;
+	bool swap_bytes; // stored with the other byte order (big endian TIFF)
+};
+
+SliceLayout ReadSliceLayout(const std::string &fname, int width, int height, size_t voxel_bytes, size_t header);
+void SwapVoxelBytes(char *bytes, size_t num_bytes, size_t voxel_bytes);
+
+#endif /* SLICESTACK_H_ */
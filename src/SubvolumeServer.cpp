@@ -0,0 +1,151 @@
+#include "SubvolumeServer.h"
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static bool IsPort(const std::string &address)
+{
+	return !address.empty() && address.find_first_not_of("0123456789") == std::string::npos;
+}
+
+/**
+ * @brief Opens a listening socket.
+ * @param address A UNIX socket path (an existing socket file is replaced), or a TCP port
+ * number, bound to localhost only.
+ * @throws std::runtime_error if the socket cannot be bound.
+ */
+int ListenOn(const std::string &address)
+{
+	int fd;
+	if (IsPort(address))
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		sockaddr_in in;
+		std::memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(std::atoi(address.c_str()));
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (fd < 0 || bind(fd, (sockaddr *)&in, sizeof(in)) != 0)
+			throw std::runtime_error("Cannot listen on localhost port " + address + ": " + std::strerror(errno));
+	}
+	else
+	{
+		sockaddr_un un;
+		std::memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(un.sun_path))
+			throw std::runtime_error("Socket path too long: " + address);
+		std::strcpy(un.sun_path, address.c_str());
+		unlink(address.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (sockaddr *)&un, sizeof(un)) != 0)
+			throw std::runtime_error("Cannot listen on " + address + ": " + std::strerror(errno));
+	}
+	if (listen(fd, 64) != 0)
+		throw std::runtime_error("Cannot listen on " + address + ": " + std::strerror(errno));
+	return fd;
+}
+
+/**
+ * @brief Closes a listening socket (and removes a UNIX socket's file).
+ */
+void StopListening(int fd, const std::string &address)
+{
+	close(fd);
+	if (!IsPort(address))
+		unlink(address.c_str());
+}
+
+/**
+ * @brief Ends the connections of a socket, waking threads blocked on it (e.g. in accept).
+ */
+void ShutdownSocket(int fd)
+{
+	shutdown(fd, SHUT_RDWR);
+}
+
+/**
+ * @brief Reads the next line (without its newline) from a connection.
+ * @param pending Bytes received after the previous line, kept between calls.
+ * @return false once the connection is closed.
+ */
+bool ReadLine(int fd, std::string &pending, std::string &line)
+{
+	size_t newline;
+	while ((newline = pending.find('\n')) == std::string::npos)
+	{
+		char buffer[4096];
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			return false;
+		pending.append(buffer, n);
+	}
+	line = pending.substr(0, newline);
+	if (!line.empty() && line[line.size() - 1] == '\r')
+		line.erase(line.size() - 1);
+	pending.erase(0, newline + 1);
+	return true;
+}
+
+/**
+ * @brief Sends all of the data, unless the connection is closed.
+ */
+bool SendAll(int fd, const std::string &data)
+{
+	size_t sent = 0;
+	while (sent < data.size())
+	{
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+// latencies kept for the percentiles
+static const size_t RECENT_LATENCIES = 4096;
+
+LatencyLog::LatencyLog()
+	: count(0), total(0), longest(0), next(0)
+{
+}
+
+/**
+ * @brief Records the latency of a query.
+ */
+void LatencyLog::add(double microseconds)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	count++;
+	total += microseconds;
+	longest = std::max(longest, microseconds);
+	if (recent.size() < RECENT_LATENCIES)
+		recent.push_back(microseconds);
+	else
+		recent[next] = microseconds;
+	next = (next + 1) % RECENT_LATENCIES;
+}
+
+/**
+ * @brief The number of queries and their mean, median, 99th percentile (of the last few
+ * thousand) and longest latency, as a line of text.
+ */
+std::string LatencyLog::summary() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<double> sorted(recent);
+	std::sort(sorted.begin(), sorted.end());
+	double median = sorted.empty() ? 0 : sorted[sorted.size() / 2];
+	double p99 = sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)];
+
+	std::stringstream text;
+	text << "queries " << count << " latency_us mean " << (long long)(count ? total / count : 0) << " p50 " << (long long)median
+		 << " p99 " << (long long)p99 << " max " << (long long)longest << "\n";
+	return text.str();
+}
@@ -0,0 +1,579 @@
+#ifndef SUBVOLUMESERVER_H_
+#define SUBVOLUMESERVER_H_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "Domain.h"
+#include "BrickCache.h"
+#include "LabelPacking.h"
+#include "LabelRemap.h"
+#include "MappedVtiFile.h"
+
+/*
+ * A long running local server which answers subvolume queries on a RAW
+ * file, so that small regions of a huge scan can be pulled repeatedly
+ * without converting it. The file is memory mapped; queries are served
+ * from an LRU cache of decoded (copied, remapped and bit-packed) bricks,
+ * so regions which are asked for again, or overlap, do not touch the file.
+ *
+ * Clients connect to a UNIX socket (a path) or to a TCP port on
+ * localhost (a number) and send one request per line:
+ *
+ *   GET x0 y0 z0 nx ny nz [sx sy sz] [raw|vti]
+ *       the box of nx * ny * nz voxels from (x0, y0, z0), sampled every
+ *       sx, sy and sz voxels (default 1), as raw voxels in file order
+ *       (x fastest) or as a .vti like the converted output; boxes whose
+ *       answer is larger than the limit set are refused
+ *   COUNT x0 y0 z0 nx ny nz
+ *       the number of voxels of each label in the box, one "label count"
+ *       line per label present, counted on the packed bricks
+ *   STATS
+ *       query count and latency, and the cache's hits, misses and size
+ *   SHUTDOWN
+ *       stops the server once the open connections are answered
+ *
+ * Every answer is a line "OK bytes [nx ny nz latency_us]" followed by
+ * that many bytes, or a line "ERROR message". A client may send any
+ * number of requests on one connection. Connections are handled by a
+ * pool of threads, one connection per thread at a time, and every query
+ * is logged with its latency.
+ */
+
+// Sockets and query statistics (see SubvolumeServer.cpp)
+int ListenOn(const std::string &address);
+void StopListening(int fd, const std::string &address);
+bool ReadLine(int fd, std::string &pending, std::string &line);
+bool SendAll(int fd, const std::string &data);
+void ShutdownSocket(int fd);
+
+class LatencyLog
+{
+public:
+	LatencyLog();
+	void add(double microseconds);
+	std::string summary() const;
+
+private:
+	mutable std::mutex mutex;
+	unsigned long long count;
+	double total, longest;
+	std::vector<double> recent; // the last few latencies, for percentiles
+	size_t next;
+};
+
+template <typename T>
+class SubvolumeServer
+{
+public:
+	SubvolumeServer(const std::string &fname, size_t header, const Domain &global_domain, int brick_size, int bits, size_t cache_bytes);
+	virtual ~SubvolumeServer();
+
+	void setRemap(const LabelRemap<T> &remap);
+	void setCellData(bool cell_data);
+	void setMaxAnswerBytes(size_t max_bytes);
+	void serve(const std::string &address, int threads);
+
+	std::string query(const Domain &roi, const int3 &stride, bool vti, int &hits, int &misses);
+	std::vector<unsigned long long> count(const Domain &roi, int &hits, int &misses);
+
+private:
+	SubvolumeServer(const SubvolumeServer &);
+	SubvolumeServer &operator=(const SubvolumeServer &);
+
+	void checkBox(const Domain &roi) const;
+	template <typename F>
+	void forEachBrick(const Domain &roi, F f);
+	typename BrickCache<T>::BrickPtr brick(int index, int &hits, int &misses);
+	void decode(const Domain &brick, T *voxels) const;
+	void handle(int client);
+	std::string answer(const std::string &request);
+
+	Domain global;
+	size_t header;
+	int brick_size;
+	int bits;  // the bits each cached voxel is packed into
+	int3 grid; // bricks along each direction
+	bool cell_data;
+	size_t max_answer_bytes; // the largest GET answer, 0 for no limit
+	LabelRemap<T> remap;
+
+	int fd;
+	const char *map;
+	size_t map_size;
+
+	BrickCache<T> cache;
+	LatencyLog latencies;
+
+	// the accepted connections waiting for a thread, and those being answered
+	std::mutex clients_mutex;
+	std::condition_variable clients_ready;
+	std::deque<int> waiting;
+	std::set<int> open_clients;
+	std::atomic<bool> stopping;
+	int listener;
+	std::mutex log_mutex;
+};
+
+/**
+ * @brief Maps the RAW file.
+ * @param fname The uncompressed .raw file.
+ * @param header The size of the file header in bytes.
+ * @param global_domain The domain of the file, with (i, j, k) = (z, y, x).
+ * @param brick_size The edge length of the cached bricks in voxels.
+ * @param bits The bits each cached voxel is packed into: 2, 4, 8, or 8 * sizeof(T) for none.
+ * @param cache_bytes The packed voxels kept in the cache.
+ * @throws std::runtime_error if the bits are not one of these, or the file cannot be mapped or
+ * does not match the domain.
+ */
+template <typename T>
+SubvolumeServer<T>::SubvolumeServer(const std::string &fname, size_t header, const Domain &global_domain, int brick_size, int bits, size_t cache_bytes)
+	: global(global_domain), header(header), brick_size(brick_size), bits(bits), grid(BrickGrid(global_domain.extent, brick_size)), cell_data(false), max_answer_bytes(0),
+	  fd(-1), map(NULL), map_size(0), cache(global_domain, brick_size, bits, cache_bytes), stopping(false), listener(-1)
+{
+	if (bits != 2 && bits != 4 && bits != 8 && bits != 8 * (int)sizeof(T))
+		throw std::runtime_error("Cached voxels are packed with 2, 4 or 8 bits.");
+
+	fd = ::open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Cannot open file " + fname + "!");
+	struct stat filestatus;
+	unsigned long long expected = header + (unsigned long long)global.extent.i * global.extent.j * global.extent.k * sizeof(T);
+	if (fstat(fd, &filestatus) != 0 || (unsigned long long)filestatus.st_size != expected)
+	{
+		::close(fd);
+		throw std::runtime_error("File size of " + fname + " does not match the domain (expected " + std::to_string(expected) + " bytes).");
+	}
+	map_size = filestatus.st_size;
+	void *p = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		::close(fd);
+		throw std::runtime_error("Cannot map file " + fname + "!");
+	}
+	map = (const char *)p;
+}
+
+template <typename T>
+SubvolumeServer<T>::~SubvolumeServer()
+{
+	munmap((void *)map, map_size);
+	::close(fd);
+}
+
+/**
+ * @brief Sets the labels renumbered as bricks are decoded (an empty remap turns it off).
+ */
+template <typename T>
+void SubvolumeServer<T>::setRemap(const LabelRemap<T> &remap_in)
+{
+	remap = remap_in;
+}
+
+/**
+ * @brief Selects whether .vti answers hold cell data rather than point data.
+ */
+template <typename T>
+void SubvolumeServer<T>::setCellData(bool cell_data_in)
+{
+	cell_data = cell_data_in;
+}
+
+/**
+ * @brief Sets the largest answer to a GET, in bytes (0 for no limit); larger boxes are refused.
+ */
+template <typename T>
+void SubvolumeServer<T>::setMaxAnswerBytes(size_t max_bytes)
+{
+	max_answer_bytes = max_bytes;
+}
+
+/**
+ * @brief Copies a brick's voxels out of the mapped file, one file row at a time.
+ */
+template <typename T>
+void SubvolumeServer<T>::decode(const Domain &brick, T *voxels) const
+{
+	const Strides<ZFastest> file(global.origin, global.extent);
+	const Strides<ZFastest> box(brick);
+	for (int i = brick.origin.i; i < brick.origin.i + brick.extent.i; ++i)
+	{
+		for (int j = brick.origin.j; j < brick.origin.j + brick.extent.j; ++j)
+		{
+			// the header need not be a multiple of sizeof(T), so the rows are copied as bytes
+			T *dst = voxels + box.offset(i, j, brick.origin.k);
+			std::memcpy(dst, map + header + file.offset(i, j, brick.origin.k) * sizeof(T), brick.extent.k * sizeof(T));
+			if (!remap.empty())
+				remap.apply(dst, dst, brick.extent.k);
+		}
+	}
+}
+
+/**
+ * @throws std::runtime_error if the box is empty or not within the domain.
+ */
+template <typename T>
+void SubvolumeServer<T>::checkBox(const Domain &roi) const
+{
+	const int3 end = roi.origin + roi.extent;
+	const int3 global_end = global.origin + global.extent;
+	if (roi.extent.i < 1 || roi.extent.j < 1 || roi.extent.k < 1 ||
+		roi.origin.i < global.origin.i || roi.origin.j < global.origin.j || roi.origin.k < global.origin.k ||
+		end.i > global_end.i || end.j > global_end.j || end.k > global_end.k)
+		throw std::runtime_error("The box is empty or not within the domain.");
+}
+
+/**
+ * @brief Calls f(index, box) for every brick intersecting a box within the domain.
+ */
+template <typename T>
+template <typename F>
+void SubvolumeServer<T>::forEachBrick(const Domain &roi, F f)
+{
+	const int3 r0 = roi.origin - global.origin, r1 = roi.origin + roi.extent - global.origin;
+	const int3 b0(r0.i / brick_size, r0.j / brick_size, r0.k / brick_size);
+	const int3 b1((r1.i - 1) / brick_size, (r1.j - 1) / brick_size, (r1.k - 1) / brick_size);
+	for (int bi = b0.i; bi <= b1.i; ++bi)
+	{
+		for (int bj = b0.j; bj <= b1.j; ++bj)
+		{
+			for (int bk = b0.k; bk <= b1.k; ++bk)
+			{
+				int index = (bi * grid.j + bj) * grid.k + bk;
+				f(index, GridBrick(global, brick_size, index));
+			}
+		}
+	}
+}
+
+/**
+ * @brief Fetches a brick from the cache, decoding it if needed, and counts the hit or miss.
+ */
+template <typename T>
+typename BrickCache<T>::BrickPtr SubvolumeServer<T>::brick(int index, int &hits, int &misses)
+{
+	bool hit;
+	typename BrickCache<T>::BrickPtr voxels = cache.get(index, [this](const Domain &box, T *voxels) { decode(box, voxels); }, hit);
+	(hit ? hits : misses)++;
+	return voxels;
+}
+
+/**
+ * @brief The voxels of a box sampled every stride voxels, from the cached bricks.
+ * @details Only the bricks holding sampled voxels are fetched. Each brick row is unpacked
+ * straight into the answer, or into a row buffer which is then sampled.
+ * @param roi The box, within the domain.
+ * @param stride The distance between the voxels sampled along each direction.
+ * @param vti Whether to return a .vti rather than raw voxels in file order.
+ * @param hits Set to the number of bricks found in the cache.
+ * @param misses Set to the number of bricks decoded.
+ * @return The answer's bytes.
+ * @throws std::runtime_error if the box is empty or not within the domain, the answer would be
+ * larger than the limit (see setMaxAnswerBytes), or its labels do not fit in the packed bits.
+ */
+template <typename T>
+std::string SubvolumeServer<T>::query(const Domain &roi, const int3 &stride, bool vti, int &hits, int &misses)
+{
+	checkBox(roi);
+	if (stride.i < 1 || stride.j < 1 || stride.k < 1)
+		throw std::runtime_error("The box is empty or not within the domain.");
+
+	const int3 out_extent((roi.extent.i + stride.i - 1) / stride.i, (roi.extent.j + stride.j - 1) / stride.j, (roi.extent.k + stride.k - 1) / stride.k);
+	const Domain out_box(int3(), out_extent);
+	const size_t out_voxels = (size_t)out_extent.i * out_extent.j * out_extent.k;
+	if (max_answer_bytes > 0 && out_voxels > max_answer_bytes / sizeof(T))
+		throw std::runtime_error("The answer of " + std::to_string(out_voxels * sizeof(T)) + " bytes is larger than the limit of " + std::to_string(max_answer_bytes) + " bytes.");
+	std::vector<T> out(out_voxels);
+	std::vector<T> row(brick_size);
+
+	// the first voxel sampled at or after n along one direction
+	auto sampled = [](int first, int step, int n) { return n <= first ? first : first + (n - first + step - 1) / step * step; };
+
+	hits = misses = 0;
+	forEachBrick(roi, [&](int index, const Domain &box)
+	{
+		Domain part = Intersection(roi, box);
+		int3 first(sampled(roi.origin.i, stride.i, part.origin.i), sampled(roi.origin.j, stride.j, part.origin.j), sampled(roi.origin.k, stride.k, part.origin.k));
+		int3 last = part.origin + part.extent;
+		if (first.i >= last.i || first.j >= last.j || first.k >= last.k)
+			return;
+
+		typename BrickCache<T>::BrickPtr voxels = brick(index, hits, misses);
+		const Strides<ZFastest> in(box);
+		for (int i = first.i; i < last.i; i += stride.i)
+		{
+			for (int j = first.j; j < last.j; j += stride.j)
+			{
+				size_t o = ((size_t)(i - roi.origin.i) / stride.i * out_extent.j + (j - roi.origin.j) / stride.j) * out_extent.k;
+				if (stride.k == 1)
+				{
+					voxels->unpack(in.offset(i, j, first.k), last.k - first.k, &out[o + first.k - roi.origin.k]);
+					continue;
+				}
+				voxels->unpack(in.offset(i, j, first.k), last.k - first.k, row.data());
+				for (int k = first.k; k < last.k; k += stride.k)
+					out[o + (k - roi.origin.k) / stride.k] = row[k - first.k];
+			}
+		}
+	});
+
+	if (!vti)
+		return std::string((const char *)out.data(), out.size() * sizeof(T));
+
+	// VTK's order is i fastest
+	std::vector<MappedVtiFile::Array> arrays(1, MappedVtiFile::Array("MaterialType", VtkTypeName<T>(), out.size() * sizeof(T)));
+	// indexed from 0, placed at the box's first voxel with the stride as spacing
+	MappedVtiFile file(out_box, cell_data, arrays, roi.origin, stride);
+	T *dst = file.data<T>(0);
+	const Strides<ZFastest> src(out_box);
+	const Strides<XFastest> vtk(out_box);
+	for (int i = out_box.origin.i; i < out_box.origin.i + out_extent.i; ++i)
+	{
+		for (int j = out_box.origin.j; j < out_box.origin.j + out_extent.j; ++j)
+		{
+			for (int k = out_box.origin.k; k < out_box.origin.k + out_extent.k; ++k)
+				dst[vtk.offset(i, j, k)] = out[src.offset(i, j, k)];
+		}
+	}
+	return std::string(file.bytes(), file.size());
+}
+
+/**
+ * @brief The number of voxels of each label in a box, from the cached bricks.
+ * @details Bricks inside the box are counted whole, the others a row at a time, in both cases
+ * on the packed voxels (see CountPackedLabels).
+ * @param roi The box, within the domain.
+ * @param hits Set to the number of bricks found in the cache.
+ * @param misses Set to the number of bricks decoded.
+ * @return The count of every label, indexed by label.
+ * @throws std::runtime_error if the box is empty or not within the domain, or its labels do not
+ * fit in the packed bits.
+ */
+template <typename T>
+std::vector<unsigned long long> SubvolumeServer<T>::count(const Domain &roi, int &hits, int &misses)
+{
+	checkBox(roi);
+	std::vector<unsigned long long> counts;
+	hits = misses = 0;
+	forEachBrick(roi, [&](int index, const Domain &box)
+	{
+		typename BrickCache<T>::BrickPtr voxels = brick(index, hits, misses);
+		Domain part = Intersection(roi, box);
+		if (part.origin == box.origin && part.extent == box.extent)
+		{
+			voxels->count(0, voxels->size(), counts);
+			return;
+		}
+		const Strides<ZFastest> in(box);
+		for (int i = part.origin.i; i < part.origin.i + part.extent.i; ++i)
+		{
+			for (int j = part.origin.j; j < part.origin.j + part.extent.j; ++j)
+				voxels->count(in.offset(i, j, part.origin.k), part.extent.k, counts);
+		}
+	});
+	return counts;
+}
+
+/**
+ * @brief Answers one request line (see the protocol above).
+ */
+template <typename T>
+std::string SubvolumeServer<T>::answer(const std::string &request)
+{
+	std::stringstream words(request);
+	std::string command;
+	words >> command;
+
+	if (command == "STATS")
+	{
+		typename BrickCache<T>::Stats c = cache.stats();
+		std::stringstream text;
+		text << latencies.summary();
+		text << "cache hits " << c.hits << " misses " << c.misses << " evictions " << c.evictions << " bricks " << c.bricks << " bytes " << c.bytes << " bits " << bits << "\n";
+		return "OK " + std::to_string(text.str().size()) + "\n" + text.str();
+	}
+	if (command == "SHUTDOWN")
+	{
+		stopping = true;
+		return "OK 0\n";
+	}
+	if (command != "GET" && command != "COUNT")
+		return "ERROR unknown request '" + command + "', expected GET, COUNT, STATS or SHUTDOWN\n";
+
+	// x, y and z map to (k, j, i)
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int x0, y0, z0, nx, ny, nz;
+	if (command == "COUNT")
+	{
+		std::string extra;
+		if (!(words >> x0 >> y0 >> z0 >> nx >> ny >> nz) || (words >> extra))
+			return "ERROR expected COUNT x0 y0 z0 nx ny nz\n";
+
+		int hits, misses;
+		std::stringstream text;
+		try
+		{
+			std::vector<unsigned long long> counts = count(Domain(int3(z0, y0, x0), int3(nz, ny, nx)), hits, misses);
+			for (size_t label = 0; label < counts.size(); ++label)
+			{
+				if (counts[label])
+					text << label << " " << counts[label] << "\n";
+			}
+		}
+		catch (const std::exception &e)
+		{
+			return std::string("ERROR ") + e.what() + "\n";
+		}
+		double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		latencies.add(microseconds);
+		{
+			std::lock_guard<std::mutex> lock(log_mutex);
+			std::cout << "COUNT " << x0 << " " << y0 << " " << z0 << " " << nx << " " << ny << " " << nz << ": " << hits << " bricks cached, " << misses << " decoded, " << (long long)microseconds << " us" << std::endl;
+		}
+		return "OK " + std::to_string(text.str().size()) + "\n" + text.str();
+	}
+
+	if (!(words >> x0 >> y0 >> z0 >> nx >> ny >> nz))
+		return "ERROR expected GET x0 y0 z0 nx ny nz [sx sy sz] [raw|vti]\n";
+	int3 stride(1, 1, 1);
+	std::string format = "raw", word;
+	std::vector<std::string> rest;
+	while (words >> word)
+		rest.push_back(word);
+	if (rest.size() == 3 || rest.size() == 4)
+		stride = int3(std::atoi(rest[2].c_str()), std::atoi(rest[1].c_str()), std::atoi(rest[0].c_str()));
+	if (rest.size() == 1 || rest.size() == 4)
+		format = rest.back();
+	if ((rest.size() != 0 && rest.size() != 1 && rest.size() != 3 && rest.size() != 4) || (format != "raw" && format != "vti"))
+		return "ERROR expected GET x0 y0 z0 nx ny nz [sx sy sz] [raw|vti]\n";
+
+	Domain roi(int3(z0, y0, x0), int3(nz, ny, nx));
+	int hits, misses;
+	std::string data;
+	try
+	{
+		data = query(roi, stride, format == "vti", hits, misses);
+	}
+	catch (const std::exception &e)
+	{
+		return std::string("ERROR ") + e.what() + "\n";
+	}
+	double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	latencies.add(microseconds);
+
+	const int3 out((nz + stride.i - 1) / stride.i, (ny + stride.j - 1) / stride.j, (nx + stride.k - 1) / stride.k);
+	{
+		std::lock_guard<std::mutex> lock(log_mutex);
+		std::cout << "GET " << x0 << " " << y0 << " " << z0 << " " << nx << " " << ny << " " << nz << " stride " << stride.k << " " << stride.j << " " << stride.i
+				  << " " << format << ": " << data.size() << " bytes, " << hits << " bricks cached, " << misses << " decoded, " << (long long)microseconds << " us" << std::endl;
+	}
+
+	std::stringstream status;
+	status << "OK " << data.size() << " " << out.k << " " << out.j << " " << out.i << " " << (long long)microseconds << "\n";
+	return status.str() + data;
+}
+
+/**
+ * @brief Answers the requests of one connection until the client closes it.
+ */
+template <typename T>
+void SubvolumeServer<T>::handle(int client)
+{
+	std::string pending, line;
+	while (ReadLine(client, pending, line))
+	{
+		if (line.empty())
+			continue;
+		if (!SendAll(client, answer(line)))
+			break;
+
+		// once the answer is out, wake the accepting thread to stop
+		if (stopping)
+		{
+			ShutdownSocket(listener);
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Accepts connections and answers their requests until a SHUTDOWN request.
+ * @param address A UNIX socket path, or a TCP port number on localhost.
+ * @param threads The number of connections answered at the same time.
+ * @throws std::runtime_error if the address cannot be listened on.
+ */
+template <typename T>
+void SubvolumeServer<T>::serve(const std::string &address, int threads)
+{
+	listener = ListenOn(address);
+	std::cout << "Serving " << global << " in bricks of " << brick_size << " voxels (" << bits << " bits each, packed with " << PackKernelName() << " kernels) on " << address << " with " << threads << " threads" << std::endl;
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < std::max(1, threads); ++t)
+	{
+		workers.push_back(std::thread([this]()
+		{
+			while (true)
+			{
+				int client;
+				{
+					std::unique_lock<std::mutex> lock(clients_mutex);
+					clients_ready.wait(lock, [this]() { return !waiting.empty(); });
+					client = waiting.front();
+					waiting.pop_front();
+					if (client < 0)
+						return;
+				}
+				handle(client);
+
+				std::lock_guard<std::mutex> lock(clients_mutex);
+				open_clients.erase(client);
+				::close(client);
+			}
+		}));
+	}
+
+	while (!stopping)
+	{
+		int client = accept(listener, NULL, NULL);
+		if (client < 0)
+			continue;
+		std::lock_guard<std::mutex> lock(clients_mutex);
+		waiting.push_back(client);
+		open_clients.insert(client);
+		clients_ready.notify_one();
+	}
+
+	// wake the threads, ending the connections which are still open
+	{
+		std::lock_guard<std::mutex> lock(clients_mutex);
+		for (std::set<int>::iterator c = open_clients.begin(); c != open_clients.end(); ++c)
+			ShutdownSocket(*c);
+		for (size_t t = 0; t < workers.size(); ++t)
+			waiting.push_back(-1);
+		clients_ready.notify_all();
+	}
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	StopListening(listener, address);
+	std::cout << "Server stopped." << std::endl
+			  << latencies.summary();
+}
+
+#endif /* SUBVOLUMESERVER_H_ */
@@ -0,0 +1,219 @@
+#include "Threads.h"
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+int Threads::count = 1;
+int Threads::share_index = 0;
+int Threads::share_count = 1;
+
+// The workers running the blocks of ParallelFor, started when first needed
+struct WorkerPool
+{
+	std::vector<std::thread> workers;
+	int share_index = 0; // the CPU sharing the workers were pinned for
+	int share_count = 1;
+	std::mutex run_lock; // held by the ParallelFor using the workers
+
+	std::mutex lock;
+	std::condition_variable start;
+	std::condition_variable done;
+	const std::function<void(size_t, size_t)> *job = nullptr;
+	size_t n = 0;
+	size_t num_blocks = 0;
+	size_t remaining = 0;
+	unsigned long long generation = 0;
+	bool stop = false;
+	std::vector<std::exception_ptr> errors;
+
+	void resize(size_t num_workers, int index, int sharing);
+	void work(size_t t, int cpu);
+	~WorkerPool();
+};
+
+static thread_local bool in_worker = false;
+
+/**
+ * @brief The CPUs the process may run on, in order (empty if unknown).
+ */
+std::vector<int> Threads::AllowedCpus()
+{
+	std::vector<int> cpus;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+	}
+#endif
+	return cpus;
+}
+
+/**
+ * @brief Stops the current workers and starts num_workers new ones, worker t pinned to CPU
+ * index * num_workers + t of those the process may run on.
+ * @details The workers are not pinned if the CPUs are fewer than the workers of all sharing
+ * processes, rather than stacking them onto the same CPUs.
+ * @param index The index of the process among those bound to the same CPUs.
+ * @param sharing The number of processes bound to the same CPUs.
+ */
+void WorkerPool::resize(size_t num_workers, int index, int sharing)
+{
+	if (workers.size() == num_workers && share_index == index && share_count == sharing)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	start.notify_all();
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+	workers.clear();
+
+	// new workers skip the blocks of the last ParallelFor
+	stop = false;
+	num_blocks = 0;
+	share_index = index;
+	share_count = sharing;
+
+	std::vector<int> cpus = Threads::AllowedCpus();
+	bool pin = cpus.size() >= (size_t)sharing * num_workers;
+	for (size_t t = 0; t < num_workers; ++t)
+	{
+		int cpu = pin ? cpus[index * num_workers + t] : -1;
+		workers.push_back(std::thread(&WorkerPool::work, this, t, cpu));
+	}
+}
+
+/**
+ * @brief Runs block t of every ParallelFor until the pool stops.
+ */
+void WorkerPool::work(size_t t, int cpu)
+{
+#ifdef __linux__
+	if (cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#else
+	(void)cpu;
+#endif
+	in_worker = true;
+
+	unsigned long long seen = 0;
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;)
+	{
+		start.wait(guard, [&]() { return stop || generation != seen; });
+		if (stop)
+			return;
+		seen = generation;
+		if (t >= num_blocks)
+			continue;
+
+		size_t begin = n * t / num_blocks;
+		size_t end = n * (t + 1) / num_blocks;
+		guard.unlock();
+		std::exception_ptr error;
+		try
+		{
+			(*job)(begin, end);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		guard.lock();
+		errors[t] = error;
+		if (--remaining == 0)
+			done.notify_one();
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	resize(0, share_index, share_count);
+}
+
+static WorkerPool &Pool()
+{
+	static WorkerPool pool;
+	return pool;
+}
+
+Threads::Threads()
+{
+}
+
+Threads::~Threads()
+{
+}
+
+int Threads::Count()
+{
+	return count;
+}
+
+void Threads::SetCount(int count_in)
+{
+	count = (count_in < 1) ? 1 : count_in;
+}
+
+/**
+ * @brief Sets which of the processes bound to the same CPUs (e.g. all processes of a node
+ * started without binding) this one is, so that their workers are pinned to different CPUs.
+ * @param index The index of this process among them.
+ * @param sharing The number of processes bound to the same CPUs, 1 if none share them.
+ */
+void Threads::ShareCpus(int index, int sharing)
+{
+	share_count = (sharing < 1) ? 1 : sharing;
+	share_index = (index < 0 || index >= share_count) ? 0 : index;
+}
+
+/**
+ * @brief Runs the blocks of a ParallelFor on the worker pool.
+ */
+void Threads::Run(size_t n, const std::function<void(size_t, size_t)> &f)
+{
+	size_t num_blocks = std::min((size_t)count, n);
+	if (num_blocks <= 1 || in_worker)
+	{
+		if (n > 0)
+			f(size_t(0), n);
+		return;
+	}
+
+	WorkerPool &pool = Pool();
+	std::lock_guard<std::mutex> turn(pool.run_lock);
+	pool.resize(count, share_index, share_count);
+
+	std::unique_lock<std::mutex> guard(pool.lock);
+	pool.job = &f;
+	pool.n = n;
+	pool.num_blocks = num_blocks;
+	pool.remaining = num_blocks;
+	pool.errors.assign(num_blocks, std::exception_ptr());
+	pool.generation++;
+	pool.start.notify_all();
+	pool.done.wait(guard, [&]() { return pool.remaining == 0; });
+
+	for (size_t t = 0; t < num_blocks; ++t)
+	{
+		if (pool.errors[t])
+			std::rethrow_exception(pool.errors[t]);
+	}
+}
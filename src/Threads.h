@@ -0,0 +1,54 @@
+#ifndef THREADS_H_
+#define THREADS_H_
+
+#include <vector>
+#include <thread>
+#include <exception>
+#include <functional>
+
+/*
+ * Number of worker threads each process uses for its local work
+ * and a helper which splits a range between them. The split is
+ * always the same contiguous blocks for the same range, and block t
+ * always runs on worker t of a persistent pool whose workers are
+ * pinned to the CPUs the process is bound to (one each, in order,
+ * after those of the processes bound to the same CPUs, see ShareCpus),
+ * so memory first touched in a ParallelFor over a buffer (see
+ * SlabAllocator) is local to the threads which process those blocks
+ * later.
+ */
+class Threads
+{
+public:
+	static int Count();
+	static void SetCount(int count);
+	static void ShareCpus(int index, int sharing);
+	static std::vector<int> AllowedCpus();
+
+	template <typename F>
+	static void ParallelFor(size_t n, F f);
+
+private:
+	Threads();
+	virtual ~Threads();
+
+	static void Run(size_t n, const std::function<void(size_t, size_t)> &f);
+
+	static int count;
+	static int share_index;
+	static int share_count;
+};
+
+/**
+ * @brief Calls f(begin, end) on Count() threads for contiguous blocks covering [0, n).
+ * @details Runs on the calling thread alone when there is one thread or nothing to split, and
+ * when called from a block of another ParallelFor. Calls from several threads take turns.
+ * An exception thrown by any block is rethrown once all blocks have finished.
+ */
+template <typename F>
+void Threads::ParallelFor(size_t n, F f)
+{
+	Run(n, std::function<void(size_t, size_t)>(std::ref(f)));
+}
+
+#endif /* THREADS_H_ */
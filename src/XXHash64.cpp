@@ -0,0 +1,133 @@
+#include "XXHash64.h"
+#include <cstring>
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t Rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// reads are little endian, as on every platform this runs on
+static inline uint64_t Read64(const unsigned char *p)
+{
+	uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t Read32(const unsigned char *p)
+{
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t Round(uint64_t acc, uint64_t input)
+{
+	return Rotl(acc + input * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t Merge(uint64_t h, uint64_t acc)
+{
+	return (h ^ Round(0, acc)) * PRIME1 + PRIME4;
+}
+
+XXHash64::XXHash64(uint64_t seed)
+	: buffered(0), total(0), seed(seed)
+{
+	acc[0] = seed + PRIME1 + PRIME2;
+	acc[1] = seed + PRIME2;
+	acc[2] = seed;
+	acc[3] = seed - PRIME1;
+}
+
+/**
+ * @brief Adds bytes to the hashed data.
+ */
+void XXHash64::update(const void *data, size_t length)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	total += length;
+
+	// complete a stripe left over from the previous call
+	if (buffered > 0)
+	{
+		size_t n = length < 32 - buffered ? length : 32 - buffered;
+		std::memcpy(buffer + buffered, p, n);
+		buffered += n;
+		p += n;
+		length -= n;
+		if (buffered < 32)
+			return;
+
+		for (int a = 0; a < 4; ++a)
+			acc[a] = Round(acc[a], Read64(buffer + 8 * a));
+		buffered = 0;
+	}
+
+	// whole stripes straight from the input
+	for (; length >= 32; p += 32, length -= 32)
+	{
+		acc[0] = Round(acc[0], Read64(p));
+		acc[1] = Round(acc[1], Read64(p + 8));
+		acc[2] = Round(acc[2], Read64(p + 16));
+		acc[3] = Round(acc[3], Read64(p + 24));
+	}
+
+	std::memcpy(buffer, p, length);
+	buffered = length;
+}
+
+/**
+ * @brief Returns the hash of all bytes added so far (more can still be added).
+ */
+uint64_t XXHash64::digest() const
+{
+	uint64_t h;
+	if (total >= 32)
+	{
+		h = Rotl(acc[0], 1) + Rotl(acc[1], 7) + Rotl(acc[2], 12) + Rotl(acc[3], 18);
+		for (int a = 0; a < 4; ++a)
+			h = Merge(h, acc[a]);
+	}
+	else
+	{
+		h = seed + PRIME5;
+	}
+	h += total;
+
+	const unsigned char *p = buffer;
+	size_t length = buffered;
+	for (; length >= 8; p += 8, length -= 8)
+		h = Rotl(h ^ Round(0, Read64(p)), 27) * PRIME1 + PRIME4;
+	if (length >= 4)
+	{
+		h = Rotl(h ^ (Read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+		p += 4;
+		length -= 4;
+	}
+	for (; length > 0; ++p, --length)
+		h = Rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * @brief Hashes a block of memory in one call.
+ */
+uint64_t XXHash64::Hash(const void *data, size_t length, uint64_t seed)
+{
+	XXHash64 hash(seed);
+	hash.update(data, length);
+	return hash.digest();
+}
@@ -0,0 +1,31 @@
+#ifndef XXHASH64_H_
+#define XXHASH64_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Streaming implementation of the xxHash64 hash, used to recognise
+ * input which has not changed since a previous conversion. Data can
+ * be added in pieces of any size; the digest only depends on the
+ * bytes added and their order.
+ */
+class XXHash64
+{
+public:
+	XXHash64(uint64_t seed = 0);
+
+	void update(const void *data, size_t length);
+	uint64_t digest() const;
+
+	static uint64_t Hash(const void *data, size_t length, uint64_t seed = 0);
+
+private:
+	uint64_t acc[4];
+	unsigned char buffer[32]; // input not yet consumed as a whole stripe
+	size_t buffered;
+	uint64_t total;
+	uint64_t seed;
+};
+
+#endif /* XXHASH64_H_ */
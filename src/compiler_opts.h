@@ -6,6 +6,9 @@
  */
 
 #include <memory>
+#include <string>
+#include <cstdlib>
+#include <stdexcept>
 #include <mpi.h>
 
 #ifndef MPI_RAW_TYPE
@@ -57,6 +60,43 @@ enum PixelType
 	Sulphide = 4
 };
 
+// every material label, in the order stages iterate over them
+const PixelType AllPixelTypes[] = {Air, Pore, Rock, Sulphide};
+const int NumPixelTypes = sizeof(AllPixelTypes) / sizeof(AllPixelTypes[0]);
+
+inline const char *PixelTypeName(PixelType p)
+{
+	switch (p)
+	{
+	case Rock:
+		return "Rock";
+	case Air:
+		return "Air";
+	case Pore:
+		return "Pore";
+	case Sulphide:
+		return "Sulphide";
+	}
+	return "Unknown";
+}
+
+// accepts a material name (e.g. "Pore") or its numeric label (e.g. "2")
+inline PixelType ParsePixelType(const std::string &name)
+{
+	for (int m = 0; m < NumPixelTypes; ++m)
+	{
+		if (name == PixelTypeName(AllPixelTypes[m]))
+			return AllPixelTypes[m];
+	}
+
+	char *end;
+	long label = std::strtol(name.c_str(), &end, 10);
+	if (!name.empty() && *end == '\0')
+		return (PixelType)label;
+
+	throw std::runtime_error("Unknown material '" + name + "'.");
+}
+
 #define MPIOUT(a) \
 	if (a == 0)   \
 	std::cout
@@ -1,14 +1,92 @@
 #include <iostream>
 #include <stdexcept>
+#include <sstream>
+#include <vector>
+#include <iomanip>
+#include <fstream>
+#include <glob.h>
 #include <mpi.h>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include "compiler_opts.h"
 #include "Domain.h"
 #include "Preprocessor.h"
+#include "MPIDetails.h"
 
 namespace opts = boost::program_options;
 
+/**
+ * @brief Builds the list of RAW files to convert from the command line arguments.
+ * @details A single --raw-file, the lines of a --raw-list file or the (sorted) matches of a
+ * --raw-glob pattern. The list is built on the root process and broadcast so that every
+ * process converts the same files in the same order.
+ * @param vm The parsed command line arguments.
+ * @param mpi_rank The rank of the calling process.
+ * @return The RAW files to convert, in order.
+ * @throws std::runtime_error if not exactly one input option is given or no files are found.
+ */
+static std::vector<std::string> InputFiles(const opts::variables_map &vm, int mpi_rank)
+{
+    if (vm.count("raw-file") + vm.count("raw-list") + vm.count("raw-glob") != 1)
+    {
+        throw std::runtime_error("Exactly one of --raw-file, --raw-list or --raw-glob must be given.");
+    }
+
+    std::string joined;
+    if (mpi_rank == 0)
+    {
+        std::stringstream names;
+        if (vm.count("raw-file"))
+        {
+            names << vm["raw-file"].as<std::string>() << std::endl;
+        }
+        else if (vm.count("raw-list"))
+        {
+            std::ifstream fin(vm["raw-list"].as<std::string>().c_str());
+            if (!fin.is_open())
+            {
+                throw std::runtime_error("Cannot open RAW file list " + vm["raw-list"].as<std::string>());
+            }
+            names << fin.rdbuf();
+        }
+        else
+        {
+            glob_t matches;
+            if (glob(vm["raw-glob"].as<std::string>().c_str(), 0, NULL, &matches) == 0)
+            {
+                for (size_t n = 0; n < matches.gl_pathc; ++n)
+                {
+                    names << matches.gl_pathv[n] << std::endl;
+                }
+            }
+            globfree(&matches);
+        }
+        joined = names.str();
+    }
+
+    int length = joined.size();
+    MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    joined.resize(length);
+    MPI_Bcast(&joined[0], length, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    std::vector<std::string> files;
+    std::stringstream names(joined);
+    std::string name;
+    while (std::getline(names, name))
+    {
+        if (!name.empty())
+        {
+            files.push_back(name);
+        }
+    }
+
+    if (files.empty())
+    {
+        throw std::runtime_error("No RAW files to convert.");
+    }
+    return files;
+}
+
 /**
  * @brief Main entry point for the RAW to VTK preprocessing application.
  * @details This function executes the preprocessing workflow. It initialises MPI,
@@ -30,7 +108,7 @@ int main(int argc, char *argv[])
 
         // Command line arguments
         opts::options_description cmd_opts("Usage");
-        cmd_opts.add_options()("help,h", "Print this help message")("raw-file", opts::value<std::string>()->required(), "Input RAW file specifying the domain.")("x-ext", opts::value<int>()->required(), "The x extent (width) of the domain.")("y-ext", opts::value<int>()->required(), "The y extent (height) of the domain.")("z-ext", opts::value<int>()->required(), "The z extent (depth) of the domain.")("header-size", opts::value<size_t>()->default_value(0), "RAW file header size in bytes.")("output-dir", opts::value<std::string>()->default_value("./output"), "The output directory for VTK files.");
+        cmd_opts.add_options()("help,h", "Print this help message")("raw-file", opts::value<std::string>(), "Input RAW file specifying the domain, or a pattern naming one 2D slice file per z plane (e.g. 'slice_%04d.tif' or 'slices/*.raw').")("raw-list", opts::value<std::string>(), "Text file listing one RAW file (or slice pattern) per line to convert as a time series.")("raw-glob", opts::value<std::string>(), "Glob pattern (e.g. 'scan_*.raw') matching RAW files to convert as a time series.")("x-ext", opts::value<int>()->required(), "The x extent (width) of the domain.")("y-ext", opts::value<int>()->required(), "The y extent (height) of the domain.")("z-ext", opts::value<int>()->required(), "The z extent (depth) of the domain.")("header-size", opts::value<size_t>()->default_value(0), "RAW file header size in bytes.")("threads", opts::value<int>()->default_value(1), "Threads per process used for reading (e.g. decompressing zstd frames).")("remap", opts::value<std::string>(), "Renumber material labels while reading: a file of 'from to' lines or inline pairs (e.g. 0:1,1:2,2:3).")("filter", opts::value<std::string>(), "Morphological filters run on the labels after reading, e.g. median:1,open:2:cube (erode, dilate, open, close or median, radius, ball or cube).")("shared-read", "Read each node's slabs once, on one process, into memory shared by the node's processes.")("output-dir", opts::value<std::string>()->default_value("./output"), "The output directory for VTK files.")("incremental", "Only rewrite the .vti pieces whose input or options changed since the last conversion into the same output.")("cell-data", "Write voxels as VTK cell data, so pieces do not overlap.")("output-blocks", "Write one 3D block per process instead of a slab, redistributing the data before writing.")("brick", opts::value<int>(), "Write the output as cubic bricks of this many voxels per edge, independent of the number of processes, with a .bricks index.")("io-aggregators", opts::value<int>(), "Number of processes writing .vti pieces (0 for one per node); the others send them their voxels.")("surfaces", "Also extract the boundary surface of each material as parallel VTK polydata (.pvtp).")("components", opts::value<std::string>(), "Comma separated materials (e.g. Pore,Air) to label connected components of.")("distance", opts::value<std::string>(), "Materials to compute the distance to the nearest target material for, optionally followed by the targets (e.g. Pore or Pore:Rock,Sulphide).")("slices", opts::value<std::string>(), "Only write these orthogonal planes as 2D .vti and .pgm previews, reading just their voxels, e.g. x=100,y=50,z=10,z=20.")("mip", opts::value<std::string>()->implicit_value("xyz"), "Only write maximum intensity projections along these axes (all of xyz if none are given) as 2D .vti and .pgm previews.")("serve", opts::value<std::string>(), "Serve subvolume queries on the --raw-file from a cache of bricks (of --brick voxels, default 64) on a UNIX socket path or a localhost TCP port, until a SHUTDOWN request.")("cache-mb", opts::value<size_t>()->default_value(1024), "Memory in MiB for the bricks cached by --serve.")("max-answer-mb", opts::value<size_t>()->default_value(1024), "Largest answer in MiB --serve gives to a GET, 0 for no limit.")("pack-bits", opts::value<int>()->default_value(0), "Bits per voxel (2, 4 or 8) the labels are packed into when they are redistributed to the output pieces, or the bricks cached by --serve are; 0 to keep the voxels as they are.")("plan", opts::value<int>(), "Only print the decomposition, memory use and output of a run on this many processes (0 for this job's).")("procs-per-node", opts::value<int>()->default_value(1), "Processes per node assumed by --plan.")("node-memory", opts::value<double>(), "Memory per node in GiB, for --plan to recommend a number of processes.");
 
         opts::variables_map vm;
         try
@@ -61,18 +139,75 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        // Setup MPI and Domain data types
-        Domain::BuildMPIDataType();
-
-        // Create and run the preprocessor
-        Preprocessor preprocessor;
+        // Create and run the preprocessor (which also sets up the Domain data type)
+        Preprocessor preprocessor(MPI_COMM_WORLD);
+        preprocessor.setThreads(vm["threads"].as<int>());
+        preprocessor.setCellData(vm.count("cell-data") > 0);
+        preprocessor.setSharedRead(vm.count("shared-read") > 0);
+        preprocessor.setIncremental(vm.count("incremental") > 0);
+        if (vm.count("remap"))
+        {
+            preprocessor.setRemap(vm["remap"].as<std::string>());
+        }
+        if (vm.count("filter"))
+        {
+            preprocessor.setFilters(vm["filter"].as<std::string>());
+        }
+        preprocessor.setOutputBlocks(vm.count("output-blocks") > 0);
+        if (vm.count("io-aggregators"))
+        {
+            preprocessor.setIoAggregators(vm["io-aggregators"].as<int>());
+        }
+        if (vm.count("brick"))
+        {
+            preprocessor.setBrickSize(vm["brick"].as<int>());
+        }
+        preprocessor.setPackBits(vm["pack-bits"].as<int>());
+#ifndef USE_VTK
+        if (vm.count("surfaces"))
+        {
+            throw std::runtime_error("--surfaces requires a build with USE_VTK=1.");
+        }
+#endif
 
         // int3 global_extent(vm["x-ext"].as<int>(), vm["y-ext"].as<int>(), vm["z-ext"].as<int>());
         // Map arguments to the code's (i, j, k) = (Z, Y, X) internal indexing
         int3 global_extent(vm["z-ext"].as<int>(), vm["y-ext"].as<int>(), vm["x-ext"].as<int>());
 
-        preprocessor.setupDomain(global_extent);
-        preprocessor.readRawFile(vm["raw-file"].as<std::string>(), vm["header-size"].as<size_t>());
+        // A plan only needs the number of RAW files, nothing is read or allocated
+        if (vm.count("plan"))
+        {
+            RunPlan run;
+            run.num_procs = vm["plan"].as<int>() > 0 ? vm["plan"].as<int>() : MPIDetails::CommSize();
+            run.procs_per_node = vm["procs-per-node"].as<int>();
+            run.num_files = (vm.count("raw-file") + vm.count("raw-list") + vm.count("raw-glob")) ? InputFiles(vm, mpi_rank).size() : 1;
+            run.components = vm.count("components") > 0;
+            run.distances = vm.count("distance") > 0;
+            run.node_memory = vm.count("node-memory") ? vm["node-memory"].as<double>() * 1024 * 1024 * 1024 : 0;
+            if (mpi_rank == 0)
+            {
+                preprocessor.plan(global_extent, run, std::cout);
+            }
+            MPI_Finalize();
+            return 0;
+        }
+
+        // A server answers queries on one file until it is shut down, nothing is converted
+        if (vm.count("serve"))
+        {
+            if (!vm.count("raw-file"))
+            {
+                throw std::runtime_error("--serve needs a single --raw-file.");
+            }
+            preprocessor.serveSubvolumes(global_extent, vm["raw-file"].as<std::string>(), vm["header-size"].as<size_t>(), vm["serve"].as<std::string>(), vm["pack-bits"].as<int>(), vm["cache-mb"].as<size_t>() << 20, vm["max-answer-mb"].as<size_t>() << 20);
+            MPI_Finalize();
+            return 0;
+        }
+
+        std::vector<std::string> raw_files = InputFiles(vm, mpi_rank);
+
+        bool time_series = !vm.count("raw-file");
+        size_t header_size = vm["header-size"].as<size_t>();
 
         // Ensure the output directory exists
         std::string out_dir = vm["output-dir"].as<std::string>();
@@ -85,8 +220,83 @@ int main(int argc, char *argv[])
         // Ensure all processes wait until the directory is created before proceeding
         MPI_Barrier(MPI_COMM_WORLD);
 
-        // Write output files
-        preprocessor.writeVtkFile(out_dir + "/material_domain");
+        // Previews only read the voxels of a few planes, nothing is converted
+        if (vm.count("slices") || vm.count("mip"))
+        {
+            std::vector<PreviewPlane> planes = ParsePreviewPlanes(vm.count("slices") ? vm["slices"].as<std::string>() : "", vm.count("mip") ? vm["mip"].as<std::string>() : "");
+            for (size_t n = 0; n < raw_files.size(); ++n)
+            {
+                std::stringstream step;
+                if (time_series)
+                {
+                    step << "_" << std::setw(4) << std::setfill('0') << n;
+                }
+                preprocessor.writePreviews(global_extent, raw_files[n], header_size, planes, out_dir + "/preview" + step.str());
+            }
+            MPI_Finalize();
+            return 0;
+        }
+
+        preprocessor.setupDomain(global_extent);
+
+        StepOutputs outputs;
+        outputs.surfaces = vm.count("surfaces") > 0;
+        if (vm.count("components"))
+        {
+            std::stringstream names(vm["components"].as<std::string>());
+            std::string name;
+            while (std::getline(names, name, ','))
+            {
+                outputs.components.push_back(ParsePixelType(name));
+            }
+        }
+
+        // Distances from the materials before the colon to those after it (every other material if none are given)
+        if (vm.count("distance"))
+        {
+            std::string spec = vm["distance"].as<std::string>();
+            size_t colon = spec.find(':');
+            std::stringstream names(spec.substr(0, colon));
+            std::string name;
+            while (std::getline(names, name, ','))
+            {
+                outputs.distance_phases.push_back(ParsePixelType(name));
+            }
+            if (colon != std::string::npos)
+            {
+                std::stringstream targets(spec.substr(colon + 1));
+                while (std::getline(targets, name, ','))
+                {
+                    outputs.distance_targets.push_back(ParsePixelType(name));
+                }
+            }
+        }
+
+        // Each file is read in the background while the previous one is processed and written
+        std::vector<std::string> pvti_files;
+        preprocessor.startRawFileRead(raw_files[0], header_size);
+        for (size_t n = 0; n < raw_files.size(); ++n)
+        {
+            preprocessor.finishRawFileRead();
+            if (n + 1 < raw_files.size())
+            {
+                preprocessor.startRawFileRead(raw_files[n + 1], header_size);
+            }
+
+            // Time series outputs are numbered, e.g. material_domain_0003.pvti
+            std::stringstream step;
+            if (time_series)
+            {
+                step << "_" << std::setw(4) << std::setfill('0') << n;
+            }
+
+            pvti_files.push_back(preprocessor.processStep(outputs, out_dir, step.str()));
+        }
+
+        if (time_series)
+        {
+            preprocessor.writePvdFile(out_dir + "/material_domain.pvd", pvti_files);
+        }
 
         MPI_Finalize();
     }